@@ -65,15 +65,16 @@ main (int argc, char *argv[])
   IJVMImage *image;
   JasmMethod *methods;
   JasmCPool *cpool;
-  char *spec_file;
-  FILE *f;
+  char *spec_file, *lines_file;
+  FILE *f, *lines;
   extern int yydebug;
   int size;
+  bool binary;
 
   if (argv[1] != NULL && strcmp (argv[1], "-v") == 0) {
     printf ("ijvm-asm version " VERSION " compiled " 
 	    COMPILE_DATE " on " COMPILE_HOST "\n");
-    printf ("Default specification file is " IJVM_DATADIR "/ijvm.spec\n");
+    printf ("The default specification is built in; -f SPEC-FILE reads another\n");
     exit (0);
   }    
 
@@ -82,6 +83,21 @@ main (int argc, char *argv[])
 
   ijvm_spec = ijvm_spec_init (&argc, argv);
 
+  /* The binary image format loads faster, see ijvm_image_read. */
+  binary = FALSE;
+  if (argv[1] != NULL && strcmp (argv[1], "--binary") == 0) {
+    binary = TRUE;
+    argv = argv + 1;
+  }
+
+  lines_file = NULL;
+  if (argv[1] != NULL && strcmp (argv[1], "--lines") == 0) {
+    if (argv[2] == NULL)
+      jasm_abort ("Option --lines requires an argument\n");
+    lines_file = argv[2];
+    argv = argv + 2;
+  }
+
   if (argv[1] != NULL) {
     f = freopen (argv[1], "r", stdin);
     if (f == NULL)
@@ -99,7 +115,18 @@ main (int argc, char *argv[])
   size = jasm_method_check (methods, cpool);
 
   image = jasm_emit (methods, cpool);
-  ijvm_image_write (stdout, image);
+  if (binary)
+    ijvm_image_write_binary (stdout, image);
+  else
+    ijvm_image_write (stdout, image);
+
+  if (lines_file != NULL) {
+    lines = fopen (lines_file, "w");
+    if (lines == NULL)
+      jasm_abort ("Couldn't open `%s' for writing.\n", lines_file);
+    jasm_lines_write (lines, argv[1] != NULL ? argv[1] : "-", methods);
+    fclose (lines);
+  }
 
   return 0;
 }
@@ -153,6 +153,7 @@ int jasm_lex_parse_int (const char *token);
 JasmMethod *jasm_parse ();
 int jasm_method_check (JasmMethod *method, JasmCPool *cpool);
 IJVMImage *jasm_emit (JasmMethod *methods, JasmCPool *cpool);
+void jasm_lines_write (FILE *file, char *source, JasmMethod *methods);
 
 
 #endif
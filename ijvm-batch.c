@@ -0,0 +1,368 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "ijvm.h"
+
+/* ijvm-batch.c
+ *
+ * Running one program for many sets of arguments and input, see
+ * `--batch' in ijvm-main.c.  The image is loaded once, and its method
+ * area and constant pool are shared read only by the IJVMs of all
+ * jobs, see ijvm_share_image; each IJVM gets a stack of its own in
+ * the rest of its memory.  The decoded code isn't shared, as the
+ * engines keep state in it.
+ *
+ * The jobs are split evenly between the worker threads up front.  A
+ * worker takes jobs from the front of its own range, and when it runs
+ * out, steals the back half of the range of another worker.  The
+ * main thread prints the results in the order of the jobs, as soon as
+ * they are done. */
+
+typedef struct IJVMBatchJob IJVMBatchJob;
+struct IJVMBatchJob
+{
+  char *line;           /* The line of the jobs file, for the report */
+  char **args;
+  int nargs;
+  char *input;          /* Input file, or NULL */
+
+  uint8 *output;
+  int output_length;
+  int32 result;
+  char error[IJVM_ERROR_SIZE];  /* Empty unless the job failed */
+  volatile bool done;
+};
+
+typedef struct IJVMBatch IJVMBatch;
+
+typedef struct IJVMBatchWorker IJVMBatchWorker;
+struct IJVMBatchWorker
+{
+  IJVMBatch *batch;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int next, end;        /* The jobs left to this worker */
+};
+
+struct IJVMBatch
+{
+  IJVMImage *image;
+  IJVMMemoryShared *shared;
+  unsigned long memory_size;
+  unsigned long limit;  /* Instructions per job, 0 for no limit */
+  IJVMEngine engine;
+  IJVMSuperInsn **supers;
+  bool tail_calls;
+
+  IJVMBatchJob *jobs;
+  int njobs;
+  IJVMBatchWorker *workers;
+  int nworkers;
+
+  pthread_mutex_t done_lock;
+  pthread_cond_t done_cond;
+};
+
+/* Read the jobs file: a job per line, with the arguments to main
+ * separated by white space and optionally `< FILE' at the end.  An
+ * empty line is a job without arguments; lines starting with `#' are
+ * skipped. */
+
+static void
+ijvm_batch_read_jobs (IJVMBatch *batch, char *filename)
+{
+  FILE *file;
+  IJVMBatchJob *job;
+  char buffer[4096], *word;
+  int alloc, line, n;
+
+  file = fopen (filename, "r");
+  if (file == NULL) {
+    fprintf (stderr, "Couldn't read jobs file `%s'.\n", filename);
+    exit (-1);
+  }
+
+  alloc = 0;
+  batch->jobs = NULL;
+  batch->njobs = 0;
+  line = 0;
+  while (fgets (buffer, sizeof (buffer), file) != NULL) {
+    line++;
+    n = strlen (buffer);
+    if (n > 0 && buffer[n - 1] == '\n')
+      buffer[--n] = '\0';
+    else if (!feof (file)) {
+      fprintf (stderr, "%s:%d: line too long\n", filename, line);
+      exit (-1);
+    }
+    word = buffer + strspn (buffer, " \t\r");
+    if (*word == '#')
+      continue;
+
+    if (batch->njobs == alloc) {
+      alloc = MAX (alloc * 2, 64);
+      batch->jobs = realloc (batch->jobs, alloc * sizeof (IJVMBatchJob));
+    }
+    job = &batch->jobs[batch->njobs++];
+    memset (job, 0, sizeof (IJVMBatchJob));
+    job->line = strdup (word);
+    job->args = malloc ((n / 2 + 1) * sizeof (char *));
+
+    for (word = strtok (buffer, " \t\r"); word != NULL;
+	 word = strtok (NULL, " \t\r")) {
+      if (strcmp (word, "<") == 0) {
+	word = strtok (NULL, " \t\r");
+	if (word == NULL || strtok (NULL, " \t\r") != NULL) {
+	  fprintf (stderr, "%s:%d: `<' must be followed by one file name\n",
+		   filename, line);
+	  exit (-1);
+	}
+	job->input = strdup (word);
+	break;
+      }
+      job->args[job->nargs++] = strdup (word);
+    }
+  }
+  fclose (file);
+}
+
+/* Read all of filename into memory. */
+
+static uint8 *
+ijvm_batch_read_input (char *filename, int *length)
+{
+  FILE *file;
+  uint8 *data;
+  int alloc, n;
+
+  file = fopen (filename, "rb");
+  if (file == NULL)
+    return NULL;
+
+  alloc = 4096;
+  data = malloc (alloc);
+  *length = 0;
+  while ((n = fread (data + *length, 1, alloc - *length, file)) > 0) {
+    *length += n;
+    if (*length == alloc) {
+      alloc *= 2;
+      data = realloc (data, alloc);
+    }
+  }
+  fclose (file);
+
+  return data;
+}
+
+static void
+ijvm_batch_run_job (IJVMBatch *batch, IJVMBatchJob *job)
+{
+  IJVM *i;
+  sigjmp_buf fault;
+  int32 *args;
+  uint8 *input;
+  char *end_ptr;
+  int length, j;
+
+  args = malloc (MAX (job->nargs, 1) * sizeof (int32));
+  for (j = 0; j < job->nargs; j++) {
+    args[j] = strtol (job->args[j], &end_ptr, 0);
+    if (job->args[j] == end_ptr) {
+      snprintf (job->error, IJVM_ERROR_SIZE,
+		"Invalid argument to main method: `%s'", job->args[j]);
+      free (args);
+      return;
+    }
+  }
+
+  length = 0;
+  input = NULL;
+  if (job->input != NULL) {
+    input = ijvm_batch_read_input (job->input, &length);
+    if (input == NULL) {
+      snprintf (job->error, IJVM_ERROR_SIZE,
+		"Couldn't read input file `%s'", job->input);
+      free (args);
+      return;
+    }
+  }
+
+  i = ijvm_new_shared (batch->image, batch->shared, batch->memory_size,
+		       job->nargs, args, job->error);
+  free (args);
+  if (i == NULL) {
+    free (input);
+    return;
+  }
+  i->io = ijvm_io_new_memory (input != NULL ? input : (uint8 *) "", length);
+  free (input);
+
+  if (sigsetjmp (fault, 1) == 0) {
+    i->fault = &fault;
+    if (batch->limit > 0)
+      i->budget = batch->limit;
+    i->tail_calls = batch->tail_calls &&
+      (batch->engine == IJVM_ENGINE_SWITCH ||
+       batch->engine == IJVM_ENGINE_THREADED ||
+       batch->engine == IJVM_ENGINE_TOS ||
+       batch->engine == IJVM_ENGINE_HOT);
+    ijvm_run_engine (i, batch->image, batch->engine, batch->supers, FALSE);
+    while (ijvm_active (i) && i->budget > 0) {
+      ijvm_execute_opcode (i);
+      i->budget--;
+    }
+    if (ijvm_active (i))
+      ijvm_error (i, "Instruction limit of %lu reached", batch->limit);
+    job->result = i->stack[i->sp];
+  }
+  else
+    strcpy (job->error, i->error);
+  i->fault = NULL;
+
+  /* Keep the output; the IJVM doesn't need it anymore. */
+  job->output = ijvm_io_output (i->io, &job->output_length);
+  i->io->out = NULL;
+  ijvm_free (i);
+}
+
+/* Take the next job of worker, or steal half of the jobs of another
+ * worker.  Returns -1 when no jobs are left anywhere. */
+
+static int
+ijvm_batch_next_job (IJVMBatch *batch, IJVMBatchWorker *worker)
+{
+  IJVMBatchWorker *victim;
+  int index, end, k, n;
+
+  pthread_mutex_lock (&worker->lock);
+  index = worker->next < worker->end ? worker->next++ : -1;
+  pthread_mutex_unlock (&worker->lock);
+  if (index >= 0)
+    return index;
+
+  /* Nothing is ever added to a range, so one pass over the other
+   * workers is enough to tell that all jobs are taken. */
+  for (k = 1; k < batch->nworkers; k++) {
+    victim = &batch->workers[(worker - batch->workers + k) % batch->nworkers];
+    pthread_mutex_lock (&victim->lock);
+    n = victim->end - victim->next;
+    if (n > 0) {
+      index = victim->end - (n + 1) / 2;
+      end = victim->end;
+      victim->end = index;
+    }
+    pthread_mutex_unlock (&victim->lock);
+
+    if (index >= 0) {
+      pthread_mutex_lock (&worker->lock);
+      worker->next = index + 1;
+      worker->end = end;
+      pthread_mutex_unlock (&worker->lock);
+      return index;
+    }
+  }
+
+  return -1;
+}
+
+static void *
+ijvm_batch_worker (void *data)
+{
+  IJVMBatchWorker *worker = data;
+  IJVMBatch *batch = worker->batch;
+  int index;
+
+  while ((index = ijvm_batch_next_job (batch, worker)) >= 0) {
+    ijvm_batch_run_job (batch, &batch->jobs[index]);
+    pthread_mutex_lock (&batch->done_lock);
+    batch->jobs[index].done = TRUE;
+    pthread_cond_broadcast (&batch->done_cond);
+    pthread_mutex_unlock (&batch->done_lock);
+  }
+
+  return NULL;
+}
+
+/* Run the jobs in filename with nthreads threads, and print the
+ * results in order: a line `job N: LINE' for each job, followed by
+ * the output of the job and its return value or error.  Returns 0 if
+ * all jobs succeeded and -1 otherwise. */
+
+int
+ijvm_batch_run (IJVMImage *image, char *filename, int nthreads,
+		unsigned long memory_size, unsigned long limit,
+		IJVMEngine engine, IJVMSuperInsn **supers, bool tail_calls)
+{
+  IJVMBatch batch;
+  IJVMBatchJob *job;
+  IJVMBatchWorker *worker;
+  pthread_attr_t attr;
+  struct rlimit stack_limit;
+  int k, status;
+
+  batch.image = image;
+  batch.memory_size = memory_size;
+  batch.limit = limit;
+  batch.engine = engine;
+  batch.supers = supers;
+  batch.tail_calls = tail_calls;
+  batch.shared = ijvm_share_image (image);
+  /* The workers share what ijvm_new finds of the stack sizes too. */
+  ijvm_stack_frames (image);
+  ijvm_batch_read_jobs (&batch, filename);
+
+  batch.nworkers = MAX (MIN (nthreads, batch.njobs), 1);
+  batch.workers = calloc (batch.nworkers, sizeof (IJVMBatchWorker));
+  pthread_mutex_init (&batch.done_lock, NULL);
+  pthread_cond_init (&batch.done_cond, NULL);
+
+  /* The JIT engine takes the stack size from RLIMIT_STACK, which is
+   * the size of the main thread's stack; give the workers the same. */
+  pthread_attr_init (&attr);
+  if (getrlimit (RLIMIT_STACK, &stack_limit) == 0)
+    pthread_attr_setstacksize (&attr, stack_limit.rlim_cur == RLIM_INFINITY ?
+			       (size_t) 512 << 20 : stack_limit.rlim_cur);
+
+  for (k = 0; k < batch.nworkers; k++) {
+    worker = &batch.workers[k];
+    worker->batch = &batch;
+    worker->next = (long) batch.njobs * k / batch.nworkers;
+    worker->end = (long) batch.njobs * (k + 1) / batch.nworkers;
+    pthread_mutex_init (&worker->lock, NULL);
+  }
+  for (k = 0; k < batch.nworkers; k++)
+    if (pthread_create (&batch.workers[k].thread, &attr, ijvm_batch_worker,
+			&batch.workers[k]) != 0) {
+      fprintf (stderr, "Couldn't start batch thread\n");
+      exit (-1);
+    }
+
+  status = 0;
+  for (k = 0; k < batch.njobs; k++) {
+    job = &batch.jobs[k];
+    pthread_mutex_lock (&batch.done_lock);
+    while (!job->done)
+      pthread_cond_wait (&batch.done_cond, &batch.done_lock);
+    pthread_mutex_unlock (&batch.done_lock);
+
+    printf ("job %d: %s\n", k + 1, job->line);
+    fwrite (job->output, 1, job->output_length, stdout);
+    if (job->error[0] != '\0') {
+      printf ("error: %s\n", job->error);
+      status = -1;
+    }
+    else
+      printf ("return value: %d\n", job->result);
+    free (job->output);
+    job->output = NULL;
+  }
+
+  for (k = 0; k < batch.nworkers; k++)
+    pthread_join (batch.workers[k].thread, NULL);
+  if (batch.shared != NULL)
+    ijvm_memory_share_free (batch.shared);
+
+  return status;
+}
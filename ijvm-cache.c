@@ -0,0 +1,397 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "ijvm.h"
+
+/* ijvm-cache.c
+ *
+ * The verification cache.  What a run of a verified program needs
+ * besides the verdict is the stack size of each method, the memory
+ * estimate from the walk of the calls from main, and the frame of
+ * each constant, see ijvm-stack.c.  Verification and the walk are
+ * single passes over the code, about 0.6 ms for a method area of
+ * 400 KB, so the cache only wins if a hit is cheaper than that.  An
+ * image that passes ijvm_verify is written to the cache directory,
+ * $XDG_CACHE_HOME/ijvm or ~/.cache/ijvm, as its method area and
+ * constant pool followed by what was found, and a later run of the
+ * same image maps the entry and compares it with one memcmp, about
+ * 0.15 ms for the same image.  Only runs with --verify look in the
+ * cache, so what is in it never changes how a plain run goes.
+ *
+ * An entry is named after a hash of the image, its recorded stack
+ * sizes, the instruction set of the spec and the version of ijvm,
+ * and is compared with the image in full before it is used, so a
+ * hash that collides only costs a verification.  Entries are written
+ * to a temporary file that is renamed into place, so a reader never
+ * sees half of one, and the least recently used entries are removed
+ * when the directory grows past IJVM_CACHE_SIZE bytes.  Anything
+ * that goes wrong with the cache, a directory whose paths don't fit
+ * in IJVM_CACHE_PATH bytes included, just means verifying as usual. */
+
+#define IJVM_CACHE_VERSION  2                  /* Of the entries */
+#define IJVM_CACHE_MAGIC    0x494a5643         /* "IJVC" */
+#define IJVM_CACHE_SIZE     (32L << 20)
+#define IJVM_CACHE_PATH     1024
+#define IJVM_CACHE_NAME     64                 /* Room for a name in it */
+
+typedef struct IJVMCacheHeader IJVMCacheHeader;
+struct IJVMCacheHeader
+{
+  uint32 magic, version;
+  uint32 main_index, method_area_size, cpool_size;
+  uint32 nmax_stack;    /* Stack sizes found by the verifier */
+  uint32 nframes;       /* 0 or cpool_size, see ijvm_stack_frames */
+  uint32 why_length;    /* With the NUL */
+  unsigned long estimate;
+};
+
+/* The key is only a name: an entry is compared with the image in full
+ * before it is used, so it need only tell images apart in the common
+ * case.  The image is hashed a long at a time into four lanes in
+ * turn, whose multiplications overlap, and the lanes are folded into
+ * two words at the end. */
+
+typedef struct IJVMCacheKey IJVMCacheKey;
+struct IJVMCacheKey
+{
+  unsigned long h[4];
+};
+
+#define MIX(h, w)  ((h) = ((h) ^ (w)) * 0x9e3779b1, (h) ^= (h) >> 15)
+
+static void
+ijvm_cache_hash_bytes (IJVMCacheKey *key, void *data, unsigned long length)
+{
+  unsigned long words[4];
+  uint8 *p;
+  unsigned long j;
+
+  p = data;
+  for (j = 0; j + sizeof (words) <= length; j += sizeof (words)) {
+    memcpy (words, p + j, sizeof (words));
+    MIX (key->h[0], words[0]);
+    MIX (key->h[1], words[1]);
+    MIX (key->h[2], words[2]);
+    MIX (key->h[3], words[3]);
+  }
+  memset (words, 0, sizeof (words));
+  memcpy (words, p + j, length - j);
+  MIX (key->h[0], words[0]);
+  MIX (key->h[1], words[1]);
+  MIX (key->h[2], words[2]);
+  MIX (key->h[3], words[3] ^ length);
+}
+
+static void
+ijvm_cache_hash_word (IJVMCacheKey *key, uint32 word)
+{
+  ijvm_cache_hash_bytes (key, &word, 4);
+}
+
+/* The name of the cache entry for image, see above. */
+
+static void
+ijvm_cache_key (IJVMCacheKey *key, IJVMImage *image, IJVMSpec *spec)
+{
+  IJVMInsnTemplate *tmpl;
+  int j;
+
+  key->h[0] = 2166136261u;
+  key->h[1] = IJVM_CACHE_VERSION;
+  key->h[2] = 0x85ebca77;
+  key->h[3] = 0xc2b2ae3d;
+  ijvm_cache_hash_word (key, image->main_index);
+  ijvm_cache_hash_bytes (key, image->method_area, image->method_area_size);
+  ijvm_cache_hash_bytes (key, image->cpool, image->cpool_size * 4);
+  ijvm_cache_hash_bytes (key, image->max_stack,
+			 image->nmax_stack * sizeof (IJVMMaxStack));
+  for (j = 0; spec != NULL && j < spec->ntemplates; j++) {
+    tmpl = spec->templates[j];
+    ijvm_cache_hash_word (key, tmpl->opcode);
+    ijvm_cache_hash_bytes (key, tmpl->mnemonic, strlen (tmpl->mnemonic));
+    ijvm_cache_hash_bytes (key, tmpl->operands,
+			   tmpl->noperands * sizeof (IJVMOperandKind));
+  }
+  ijvm_cache_hash_bytes (key, VERSION, strlen (VERSION));
+
+  MIX (key->h[0], key->h[2]);
+  MIX (key->h[1], key->h[3]);
+}
+
+/* Find the cache directory, creating it if create is set.  Returns
+ * FALSE if there is none, or if it leaves less than IJVM_CACHE_NAME
+ * bytes of IJVM_CACHE_PATH for the name of an entry. */
+
+static bool
+ijvm_cache_directory (char *dir, bool create)
+{
+  char *base;
+  int n;
+
+  base = getenv ("XDG_CACHE_HOME");
+  if (base != NULL && base[0] == '/')
+    n = snprintf (dir, IJVM_CACHE_PATH, "%s", base);
+  else if ((base = getenv ("HOME")) != NULL)
+    n = snprintf (dir, IJVM_CACHE_PATH, "%s/.cache", base);
+  else
+    return FALSE;
+  if (n + sizeof ("/ijvm") > IJVM_CACHE_PATH - IJVM_CACHE_NAME)
+    return FALSE;
+
+  if (create)
+    mkdir (dir, 0700);
+  strcat (dir, "/ijvm");
+  if (create)
+    mkdir (dir, 0700);
+
+  return access (dir, create ? W_OK : R_OK) == 0;
+}
+
+static void
+ijvm_cache_path (char *path, char *dir, IJVMImage *image, IJVMSpec *spec)
+{
+  IJVMCacheKey key;
+
+  ijvm_cache_key (&key, image, spec);
+  snprintf (path, IJVM_CACHE_PATH, "%s/%08lx%08lx.ijc", dir,
+	    key.h[0] & 0xffffffff, key.h[1] & 0xffffffff);
+}
+
+/* Take the stack sizes, estimate and frames of the entry at path if
+ * it holds image, and mark image verified.  The entry is mapped
+ * rather than read, which would cost a page fault for each page of
+ * the buffer. */
+
+static bool
+ijvm_cache_lookup (IJVMImage *image, char *path)
+{
+  IJVMCacheHeader header;
+  IJVMMaxStack entry;
+  struct stat st;
+  unsigned long size;
+  uint8 *data, *p, *max_stack, *frames;
+  uint32 k;
+  bool same;
+  int fd, j;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return FALSE;
+  data = MAP_FAILED;
+  if (fstat (fd, &st) == 0 && st.st_size >= (off_t) sizeof (header))
+    data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    return FALSE;
+
+  memcpy (&header, data, sizeof (header));
+  same = header.magic == IJVM_CACHE_MAGIC &&
+    header.version == IJVM_CACHE_VERSION &&
+    header.main_index == image->main_index &&
+    header.method_area_size == image->method_area_size &&
+    header.cpool_size == image->cpool_size &&
+    (header.nframes == 0 || header.nframes == image->cpool_size) &&
+    header.nmax_stack <= image->method_area_size &&
+    header.why_length > 0 && header.why_length <= IJVM_ERROR_SIZE;
+  size = sizeof (header) + image->method_area_size +
+    image->cpool_size * 4 + header.nmax_stack * sizeof (IJVMMaxStack) +
+    header.nframes * 4 + header.why_length;
+  same = same && (unsigned long) st.st_size == size;
+
+  p = data + sizeof (header);
+  same = same && memcmp (p, image->method_area,
+			 image->method_area_size) == 0;
+  p += image->method_area_size;
+  same = same && memcmp (p, image->cpool, image->cpool_size * 4) == 0;
+  p += image->cpool_size * 4;
+  max_stack = p;
+  p += header.nmax_stack * sizeof (IJVMMaxStack);
+  frames = p;
+  p += header.nframes * 4;
+  same = same && p[header.why_length - 1] == 0;
+
+  /* The recorded stack sizes must be those the verifier found. */
+  for (j = 0; same && j < image->nmax_stack; j++) {
+    same = FALSE;
+    for (k = 0; k < header.nmax_stack; k++) {
+      memcpy (&entry, max_stack + k * sizeof (IJVMMaxStack), sizeof (entry));
+      if (entry.address == image->max_stack[j].address) {
+	same = entry.words == image->max_stack[j].words;
+	break;
+      }
+    }
+  }
+
+  if (same) {
+    for (k = 0; k < header.nmax_stack; k++) {
+      memcpy (&entry, max_stack + k * sizeof (IJVMMaxStack), sizeof (entry));
+      ijvm_image_set_max_stack (image, entry.address, entry.words);
+    }
+    image->stack_estimate = header.estimate;
+    free (image->stack_why);
+    image->stack_why = strdup ((char *) p);
+    if (header.nframes != 0) {
+      image->frames = malloc (header.nframes * 4);
+      memcpy (image->frames, frames, header.nframes * 4);
+    }
+    image->stack_found = TRUE;
+    image->verified = TRUE;
+    utime (path, NULL);
+  }
+  munmap (data, st.st_size);
+
+  return same;
+}
+
+typedef struct IJVMCacheEntry IJVMCacheEntry;
+struct IJVMCacheEntry
+{
+  char *name;
+  off_t size;
+  time_t used;
+};
+
+static int
+ijvm_cache_compare (const void *a, const void *b)
+{
+  const IJVMCacheEntry *x = a, *y = b;
+
+  return x->used < y->used ? -1 : x->used > y->used;
+}
+
+/* Remove the least recently used entries of dir until the rest take
+ * no more than IJVM_CACHE_SIZE bytes, and temporary files that were
+ * left behind. */
+
+static void
+ijvm_cache_evict (char *dir)
+{
+  IJVMCacheEntry *entries;
+  struct dirent *d;
+  struct stat st;
+  char path[IJVM_CACHE_PATH];
+  unsigned long total;
+  int nentries, alloc, j, n;
+  DIR *handle;
+
+  handle = opendir (dir);
+  if (handle == NULL)
+    return;
+
+  entries = NULL;
+  nentries = alloc = 0;
+  total = 0;
+  while ((d = readdir (handle)) != NULL) {
+    n = strlen (d->d_name);
+    if (snprintf (path, IJVM_CACHE_PATH, "%s/%s", dir, d->d_name) >=
+	IJVM_CACHE_PATH)
+      continue;
+    if (stat (path, &st) != 0 || !S_ISREG (st.st_mode))
+      continue;
+    if (n > 4 && strcmp (d->d_name + n - 4, ".tmp") == 0) {
+      if (st.st_mtime < time (NULL) - 3600)
+	unlink (path);
+      continue;
+    }
+    if (n <= 4 || strcmp (d->d_name + n - 4, ".ijc") != 0)
+      continue;
+
+    if (nentries == alloc) {
+      alloc = MAX (alloc * 2, 16);
+      entries = realloc (entries, alloc * sizeof (IJVMCacheEntry));
+    }
+    entries[nentries].name = strdup (d->d_name);
+    entries[nentries].size = st.st_size;
+    entries[nentries].used = st.st_mtime;
+    nentries++;
+    total += st.st_size;
+  }
+  closedir (handle);
+
+  qsort (entries, nentries, sizeof (IJVMCacheEntry), ijvm_cache_compare);
+  for (j = 0; j < nentries && total > IJVM_CACHE_SIZE; j++)
+    if (snprintf (path, IJVM_CACHE_PATH, "%s/%s", dir, entries[j].name) <
+	IJVM_CACHE_PATH && unlink (path) == 0)
+      total -= entries[j].size;
+
+  for (j = 0; j < nentries; j++)
+    free (entries[j].name);
+  free (entries);
+}
+
+/* Write image and what was found about it to the entry at path, by
+ * way of a temporary file. */
+
+static void
+ijvm_cache_store (IJVMImage *image, char *dir, char *path)
+{
+  char temp[IJVM_CACHE_PATH + 32], why[IJVM_ERROR_SIZE];
+  IJVMCacheHeader header;
+  uint32 *frames;
+  FILE *file;
+  bool ok;
+
+  memset (&header, 0, sizeof (header));
+  header.magic = IJVM_CACHE_MAGIC;
+  header.version = IJVM_CACHE_VERSION;
+  header.main_index = image->main_index;
+  header.method_area_size = image->method_area_size;
+  header.cpool_size = image->cpool_size;
+  header.nmax_stack = image->nmax_stack;
+  header.estimate = ijvm_stack_estimate (image, why);
+  header.why_length = strlen (why) + 1;
+  frames = ijvm_stack_frames (image);
+  header.nframes = frames != NULL ? image->cpool_size : 0;
+
+  snprintf (temp, sizeof (temp), "%s.%d.tmp", path, (int) getpid ());
+  file = fopen (temp, "w");
+  if (file == NULL)
+    return;
+  fwrite (&header, sizeof (header), 1, file);
+  fwrite (image->method_area, 1, image->method_area_size, file);
+  fwrite (image->cpool, 4, image->cpool_size, file);
+  fwrite (image->max_stack, sizeof (IJVMMaxStack), image->nmax_stack, file);
+  fwrite (frames, 4, header.nframes, file);
+  fwrite (why, 1, header.why_length, file);
+  ok = !ferror (file);
+  ok = fclose (file) == 0 && ok;
+  if (!ok || rename (temp, path) != 0) {
+    unlink (temp);
+    return;
+  }
+
+  ijvm_cache_evict (dir);
+}
+
+/* ijvm_verify, with the outcome kept in the cache directory, see
+ * above.  spec is the instruction set in use, or NULL. */
+
+bool
+ijvm_verify_cached (IJVMImage *image, IJVMSpec *spec, char *error)
+{
+  char dir[IJVM_CACHE_PATH], path[IJVM_CACHE_PATH];
+  bool cached;
+
+  cached = ijvm_cache_directory (dir, TRUE);
+  if (cached) {
+    ijvm_cache_path (path, dir, image, spec);
+    if (ijvm_cache_lookup (image, path))
+      return TRUE;
+  }
+
+  if (!ijvm_verify (image, error))
+    return FALSE;
+  if (cached)
+    ijvm_cache_store (image, dir, path);
+
+  return TRUE;
+}
@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ijvm.h"
+
+/* ijvm-checkpoint.c
+ *
+ * Checkpoints of a running program, see `--checkpoint' and
+ * `--restore' in ijvm-main.c.  A checkpoint holds everything the
+ * program can see of its state: the registers, the memory, and how
+ * far it has got with its input and output.  Restoring it for the
+ * same image gives an IJVM that carries on as the original would
+ * have.  Decoded and compiled code is not kept; the engines build it
+ * again as they go.
+ *
+ * A checkpoint file starts with the 8 bytes "IJCHECK" and a version
+ * byte, followed by 32 bit big endian words:
+ *
+ *   the hash of the image, see ijvm_image_hash
+ *   the memory size, high and low word
+ *   pc, sp, lv, initial_sp, wide
+ *   the input and output positions, high and low word each
+ *   the page size and the number of pages that follow
+ *
+ * and then each page as its page number followed by its contents, the
+ * last one cut short at the end of the memory.  Only pages that
+ * aren't all zero are stored, so a checkpoint is about the size of
+ * the memory the program uses.  Only the pages up to the extent of
+ * the memory the program has used are looked at, see
+ * ijvm_checkpoint_extent, so that a checkpoint with a memory of
+ * gigabytes doesn't read them all. */
+
+#define IJVM_CHECKPOINT_VERSION 1
+
+static char ijvm_checkpoint_magic[] = "IJCHECK";
+
+static void
+ijvm_checkpoint_put (FILE *file, uint32 word)
+{
+  putc (word >> 24, file);
+  putc ((word >> 16) & 255, file);
+  putc ((word >> 8) & 255, file);
+  putc (word & 255, file);
+}
+
+static bool
+ijvm_checkpoint_get (FILE *file, uint32 *word)
+{
+  uint8 bytes[4];
+
+  if (fread (bytes, 1, 4, file) != 4)
+    return FALSE;
+  *word = (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+  return TRUE;
+}
+
+static void
+ijvm_checkpoint_put_long (FILE *file, unsigned long value)
+{
+  ijvm_checkpoint_put (file, (uint32) (value >> 16 >> 16));
+  ijvm_checkpoint_put (file, (uint32) value);
+}
+
+static bool
+ijvm_checkpoint_get_long (FILE *file, unsigned long *value)
+{
+  uint32 high, low;
+
+  if (!ijvm_checkpoint_get (file, &high) || !ijvm_checkpoint_get (file, &low))
+    return FALSE;
+  *value = (unsigned long) high << 16 << 16 | low;
+  return TRUE;
+}
+
+/* Return TRUE if the length bytes at data are all zero. */
+
+static bool
+ijvm_checkpoint_zero (uint8 *data, unsigned long length)
+{
+  unsigned long j;
+
+  for (j = 0; j < length; j++)
+    if (data[j] != 0)
+      return FALSE;
+  return TRUE;
+}
+
+/* Return TRUE if the next instruction of i calls a builtin that reads
+ * input, getchar or readblock: the place to checkpoint a program that
+ * prepares itself before it looks at its input. */
+
+bool
+ijvm_checkpoint_at_input (IJVM *i)
+{
+  uint16 index;
+
+  if (i->method[i->pc] != IJVM_OPCODE_INVOKEVIRTUAL || i->wide)
+    return FALSE;
+  index = i->method[i->pc + 1] * 256 + i->method[i->pc + 2];
+  return index == 0x8000 || index == 0x8002;
+}
+
+/* Return the number of bytes at the start of the memory of i that
+ * hold everything the program has written: up to SP, or up to the
+ * last page the host has in core, if that is higher.  The stack grows
+ * from the bottom of the memory, so the pages the program has written
+ * are the ones below the highest SP it reached, and of those, the
+ * ones above SP now are left from calls that have returned, which the
+ * program can still read.  They were all in core when written, and
+ * the highest of them can only be left out if the host has swapped
+ * it out since; the pages in between are looked at whether they are
+ * in core or not.  If the host can't tell, the whole memory is. */
+
+static unsigned long
+ijvm_checkpoint_extent (IJVM *i)
+{
+  unsigned char *vector;
+  unsigned long page, extent, j;
+
+  vector = ijvm_memory_resident_pages (i->method, &page);
+  if (vector == NULL)
+    return i->memory_size;
+
+  extent = ((unsigned long) i->sp + 1) * 4;
+  for (j = (i->memory_size + page - 1) / page; j > 0; j--)
+    if (vector[j - 1]) {
+      extent = MAX (extent, j * page);
+      break;
+    }
+  free (vector);
+
+  return MIN (extent, i->memory_size);
+}
+
+/* Write a checkpoint of i, a run of image, to file.  Returns FALSE if
+ * the file couldn't be written. */
+
+bool
+ijvm_checkpoint_write (IJVM *i, IJVMImage *image, FILE *file)
+{
+  unsigned long page, pages, length, j, n;
+
+  page = 4096;
+  pages = (ijvm_checkpoint_extent (i) + page - 1) / page;
+
+  n = 0;
+  for (j = 0; j < pages; j++) {
+    length = MIN (page, i->memory_size - j * page);
+    if (!ijvm_checkpoint_zero (i->method + j * page, length))
+      n++;
+  }
+
+  fwrite (ijvm_checkpoint_magic, 1, 7, file);
+  putc (IJVM_CHECKPOINT_VERSION, file);
+  ijvm_checkpoint_put (file, ijvm_image_hash (image));
+  ijvm_checkpoint_put_long (file, i->memory_size);
+  ijvm_checkpoint_put (file, i->pc);
+  ijvm_checkpoint_put (file, i->sp);
+  ijvm_checkpoint_put (file, i->lv);
+  ijvm_checkpoint_put (file, i->initial_sp);
+  ijvm_checkpoint_put (file, i->wide);
+  ijvm_checkpoint_put_long (file, ijvm_io_input_position (i->io));
+  ijvm_checkpoint_put_long (file, ijvm_io_output_position (i->io));
+  ijvm_checkpoint_put (file, page);
+  ijvm_checkpoint_put (file, n);
+
+  for (j = 0; j < pages; j++) {
+    length = MIN (page, i->memory_size - j * page);
+    if (!ijvm_checkpoint_zero (i->method + j * page, length)) {
+      ijvm_checkpoint_put (file, j);
+      fwrite (i->method + j * page, 1, length, file);
+    }
+  }
+
+  return !ferror (file);
+}
+
+/* Restore the checkpoint in file, which must have been made from a
+ * run of image.  The input and output positions of the run are
+ * stored in input and output.  Returns NULL, with the reason in
+ * error, if the checkpoint can't be restored. */
+
+IJVM *
+ijvm_checkpoint_read (FILE *file, IJVMImage *image,
+		      long *input, long *output, char *error)
+{
+  IJVM *i;
+  char magic[8];
+  int32 *args;
+  uint32 hash, registers[5], page, pages, index;
+  unsigned long memory_size, in_position, out_position, length, j;
+  int main_offset, nargs;
+
+  if (fread (magic, 1, 8, file) != 8 ||
+      memcmp (magic, ijvm_checkpoint_magic, 7) != 0 ||
+      magic[7] != IJVM_CHECKPOINT_VERSION) {
+    snprintf (error, IJVM_ERROR_SIZE, "Not a checkpoint file");
+    return NULL;
+  }
+
+  if (!ijvm_checkpoint_get (file, &hash) ||
+      !ijvm_checkpoint_get_long (file, &memory_size))
+    goto truncated;
+  for (j = 0; j < 5; j++)
+    if (!ijvm_checkpoint_get (file, &registers[j]))
+      goto truncated;
+  if (!ijvm_checkpoint_get_long (file, &in_position) ||
+      !ijvm_checkpoint_get_long (file, &out_position) ||
+      !ijvm_checkpoint_get (file, &page) ||
+      !ijvm_checkpoint_get (file, &pages))
+    goto truncated;
+
+  if (hash != ijvm_image_hash (image)) {
+    snprintf (error, IJVM_ERROR_SIZE,
+	      "The checkpoint was made for another program");
+    return NULL;
+  }
+  if (memory_size == 0 || memory_size > IJVM_MEMORY_MAX_SIZE || page == 0 ||
+      registers[0] >= image->method_area_size ||
+      registers[1] >= memory_size / 4 || registers[2] >= memory_size / 4 ||
+      registers[3] >= memory_size / 4) {
+    snprintf (error, IJVM_ERROR_SIZE, "Corrupt checkpoint");
+    return NULL;
+  }
+
+  /* Set up an IJVM as for a run of main, then replace its state.  main
+   * takes at least the object reference; a header that says otherwise
+   * would have no run to restore. */
+  if (image->main_index >= image->cpool_size ||
+      image->cpool[image->main_index] < 0 ||
+      image->cpool[image->main_index] + 4 > image->method_area_size)
+    nargs = -1;
+  else {
+    main_offset = image->cpool[image->main_index];
+    nargs = image->method_area[main_offset] * 256 +
+      image->method_area[main_offset + 1] - 1;
+  }
+  if (nargs < 0) {
+    snprintf (error, IJVM_ERROR_SIZE, "Incorrect number of arguments");
+    return NULL;
+  }
+  args = calloc (MAX (nargs, 1), sizeof (int32));
+  i = ijvm_new (image, memory_size, nargs, args, error);
+  free (args);
+  if (i == NULL)
+    return NULL;
+  memset (i->method, 0, (i->sp + 1) * sizeof (int32));
+
+  for (; pages > 0; pages--) {
+    if (!ijvm_checkpoint_get (file, &index)) {
+      ijvm_free (i);
+      goto truncated;
+    }
+    if ((unsigned long) index * page >= memory_size) {
+      ijvm_free (i);
+      snprintf (error, IJVM_ERROR_SIZE, "Corrupt checkpoint");
+      return NULL;
+    }
+    length = MIN (page, memory_size - (unsigned long) index * page);
+    if (fread (i->method + (unsigned long) index * page, 1, length, file)
+	!= length) {
+      ijvm_free (i);
+      goto truncated;
+    }
+  }
+
+  i->pc = registers[0];
+  i->sp = registers[1];
+  i->lv = registers[2];
+  i->initial_sp = registers[3];
+  i->wide = registers[4];
+  *input = in_position;
+  *output = out_position;
+
+  return i;
+
+ truncated:
+  snprintf (error, IJVM_ERROR_SIZE, "Truncated checkpoint");
+  return NULL;
+}
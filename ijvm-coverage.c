@@ -0,0 +1,431 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ijvm.h"
+
+/* ijvm-coverage.c
+ *
+ * Basic block and branch coverage, see `--coverage' in ijvm-main.c.
+ * When the program is loaded its code is split into basic blocks,
+ * using the decoder of the threaded engine to find every reachable
+ * instruction, and a counter is set up for each block and for both
+ * edges of each conditional branch.  The switch engine calls
+ * ijvm_coverage_step before each instruction, which counts the block
+ * that starts there, if one does, and the edge taken by the branch
+ * before it, if it was one.
+ *
+ * The report lists the blocks and branches of each method with their
+ * counts.  Given the line file written by `ijvm-asm --lines', see
+ * jasm_lines_write, the blocks and branches are listed with their
+ * source lines, followed by the source itself with the count of each
+ * line, if the source can be read. */
+
+typedef struct IJVMBlock IJVMBlock;
+struct IJVMBlock
+{
+  uint32 start, end;     /* Offsets of the first and last instruction */
+  unsigned long count;
+};
+
+typedef struct IJVMBranch IJVMBranch;
+struct IJVMBranch
+{
+  uint32 pc, target;
+  uint8 opcode;
+  unsigned long taken, not_taken;
+};
+
+struct IJVMCoverage
+{
+  IJVMImage *image;
+  IJVMSpec *spec;
+  uint32 size;
+
+  IJVMBlock *blocks;
+  int nblocks, alloc;
+  IJVMBranch *branches;
+  int nbranches, branch_alloc;
+  int32 *block_at;       /* Block starting at an offset, or -1 */
+  int32 *branch_at;      /* Branch at an offset, or -1 */
+  uint8 *method_at;      /* TRUE at the header of each method */
+  int branch;            /* Branch run by the last step, or -1 */
+
+  /* From the line file, or NULL */
+  char *source;
+  int *line_at;          /* Source line of the instruction at an offset */
+  char **name_at;        /* Name of the method at an offset */
+  int nlines;            /* Highest source line */
+};
+
+static void
+ijvm_coverage_method (IJVMCoverage *c, uint8 *leader, uint32 address)
+{
+  if (address + 4 < c->size) {
+    c->method_at[address] = TRUE;
+    leader[address + 4] = TRUE;
+  }
+}
+
+IJVMCoverage *
+ijvm_coverage_new (IJVMImage *image, IJVMSpec *spec)
+{
+  IJVMCoverage *c;
+  IJVMCode *code;
+  IJVMInsn *insn;
+  IJVMBlock *block;
+  IJVMBranch *branch;
+  uint8 *leader;
+  uint32 pc;
+  bool ends;
+  int k;
+
+  c = calloc (1, sizeof (IJVMCoverage));
+  c->image = image;
+  c->spec = spec;
+  c->size = image->method_area_size;
+  c->block_at = malloc ((c->size + 1) * sizeof (int32));
+  c->branch_at = malloc ((c->size + 1) * sizeof (int32));
+  for (pc = 0; pc < c->size; pc++)
+    c->block_at[pc] = c->branch_at[pc] = -1;
+  c->method_at = calloc (c->size + 1, 1);
+  c->branch = -1;
+
+  /* Blocks start at the entry of each method, at branch targets and
+   * after the instructions that end a block. */
+  code = ijvm_code_decode (image);
+  leader = calloc (c->size + 1, 1);
+  if (image->main_index < image->cpool_size)
+    ijvm_coverage_method (c, leader, image->cpool[image->main_index]);
+  for (k = 0; k < code->ninsns; k++) {
+    insn = &code->insns[k];
+    if (insn->op == IJVM_OPCODE_INVOKEVIRTUAL &&
+	insn->a < image->cpool_size)
+      ijvm_coverage_method (c, leader, image->cpool[insn->a]);
+    if (insn->target != NULL && insn->a >= 0 && insn->a < c->size)
+      leader[insn->a] = TRUE;
+  }
+
+  ends = TRUE;
+  for (k = 0; k < code->ninsns; k++) {
+    insn = &code->insns[k];
+    if (insn->op >= 256) {
+      ends = TRUE;
+      continue;
+    }
+
+    if (ends || leader[insn->pc]) {
+      if (c->nblocks == c->alloc) {
+	c->alloc = MAX (c->alloc * 2, 64);
+	c->blocks = realloc (c->blocks, c->alloc * sizeof (IJVMBlock));
+      }
+      block = &c->blocks[c->nblocks];
+      block->start = insn->pc;
+      block->count = 0;
+      c->block_at[insn->pc] = c->nblocks++;
+    }
+    c->blocks[c->nblocks - 1].end = insn->pc;
+
+    if (ijvm_insn_is_conditional (insn)) {
+      if (c->nbranches == c->branch_alloc) {
+	c->branch_alloc = MAX (c->branch_alloc * 2, 64);
+	c->branches = realloc (c->branches,
+			       c->branch_alloc * sizeof (IJVMBranch));
+      }
+      branch = &c->branches[c->nbranches];
+      branch->pc = insn->pc;
+      branch->target = insn->a;
+      branch->opcode = insn->op;
+      branch->taken = branch->not_taken = 0;
+      c->branch_at[insn->pc] = c->nbranches++;
+    }
+
+    ends = ijvm_insn_ends_block (insn);
+  }
+
+  free (leader);
+  ijvm_code_free (code);
+
+  return c;
+}
+
+/* Read the line file written by ijvm-asm for the program.  Returns
+ * FALSE if file isn't one, or was written for another program. */
+
+bool
+ijvm_coverage_read_lines (IJVMCoverage *c, FILE *file)
+{
+  char buffer[1024], name[256];
+  uint32 address, index, pc;
+  int line, length;
+
+  if (fgets (buffer, sizeof (buffer), file) == NULL ||
+      strncmp (buffer, "ijvm lines: ", 12) != 0)
+    return FALSE;
+  length = strlen (buffer);
+  if (length > 0 && buffer[length - 1] == '\n')
+    buffer[length - 1] = '\0';
+  c->source = strdup (buffer + 12);
+  c->line_at = calloc (c->size + 1, sizeof (int));
+  c->name_at = calloc (c->size + 1, sizeof (char *));
+
+  while (fgets (buffer, sizeof (buffer), file) != NULL) {
+    if (sscanf (buffer, "method %255s %u %u", name, &address, &index) == 3) {
+      if (address >= c->size || index >= c->image->cpool_size ||
+	  c->image->cpool[index] != address)
+	return FALSE;
+      free (c->name_at[address]);
+      c->name_at[address] = strdup (name);
+    }
+    else if (sscanf (buffer, "%u %d", &pc, &line) == 2) {
+      if (pc >= c->size || line < 1)
+	return FALSE;
+      c->line_at[pc] = line;
+      c->nlines = MAX (c->nlines, line);
+    }
+    else
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Called before i runs the instruction at its pc. */
+
+void
+ijvm_coverage_step (IJVMCoverage *c, IJVM *i)
+{
+  IJVMBranch *branch;
+  int32 n;
+
+  if (c->branch >= 0) {
+    branch = &c->branches[c->branch];
+    if (i->pc == branch->target)
+      branch->taken++;
+    else
+      branch->not_taken++;
+    c->branch = -1;
+  }
+
+  if (i->pc < c->size) {
+    n = c->block_at[i->pc];
+    if (n >= 0)
+      c->blocks[n].count++;
+    c->branch = c->branch_at[i->pc];
+  }
+}
+
+/* The first and last source line of the instructions from start to
+ * end, or 0 if there are none. */
+
+static void
+ijvm_coverage_lines (IJVMCoverage *c, uint32 start, uint32 end,
+		     int *first, int *last)
+{
+  uint32 pc;
+
+  *first = *last = 0;
+  if (c->line_at == NULL)
+    return;
+  for (pc = start; pc <= end; pc++)
+    if (c->line_at[pc] > 0) {
+      if (*first == 0 || c->line_at[pc] < *first)
+	*first = c->line_at[pc];
+      *last = MAX (*last, c->line_at[pc]);
+    }
+}
+
+static char *
+ijvm_coverage_mnemonic (IJVMCoverage *c, uint8 opcode)
+{
+  IJVMInsnTemplate *tmpl;
+
+  tmpl = c->spec != NULL ?
+    ijvm_spec_lookup_template_by_opcode (c->spec, opcode) : NULL;
+  return tmpl != NULL ? tmpl->mnemonic : "branch";
+}
+
+/* Read a line from file into *buffer, grown as needed, without the
+ * newline.  Returns FALSE at the end of the file. */
+
+static bool
+ijvm_coverage_read_line (FILE *file, char **buffer, int *alloc)
+{
+  int c, length;
+
+  length = 0;
+  while ((c = getc (file)) != EOF && c != '\n') {
+    if (length + 1 >= *alloc) {
+      *alloc = MAX (*alloc * 2, 256);
+      *buffer = realloc (*buffer, *alloc);
+    }
+    (*buffer)[length++] = c;
+  }
+  if (c == EOF && length == 0)
+    return FALSE;
+  if (*buffer == NULL) {
+    *alloc = 256;
+    *buffer = malloc (*alloc);
+  }
+  (*buffer)[length] = '\0';
+  return TRUE;
+}
+
+/* List the source with the number of times each line was run, and
+ * the edges of the branches on it.  Lines without instructions are
+ * marked `-', lines whose instructions never ran `#####'. */
+
+static void
+ijvm_coverage_write_source (IJVMCoverage *c, FILE *file)
+{
+  FILE *source;
+  unsigned long *counts;
+  IJVMBlock *block;
+  IJVMBranch *branch;
+  char *buffer;
+  bool *code;
+  int *first, *next;
+  uint32 pc;
+  int line, alloc, j;
+
+  source = fopen (c->source, "r");
+  if (source == NULL) {
+    fprintf (file, "\nsource `%s' not found\n", c->source);
+    return;
+  }
+
+  counts = calloc (c->nlines + 1, sizeof (unsigned long));
+  code = calloc (c->nlines + 1, sizeof (bool));
+  for (pc = 0; pc < c->size; pc++)
+    if (c->line_at[pc] > 0)
+      code[c->line_at[pc]] = TRUE;
+  for (j = 0; j < c->nblocks; j++) {
+    block = &c->blocks[j];
+    for (pc = block->start; pc <= block->end; pc++)
+      if (c->line_at[pc] > 0)
+	counts[c->line_at[pc]] = MAX (counts[c->line_at[pc]], block->count);
+  }
+
+  /* The branches on each line, in order. */
+  first = malloc ((c->nlines + 1) * sizeof (int));
+  next = malloc (MAX (c->nbranches, 1) * sizeof (int));
+  for (line = 0; line <= c->nlines; line++)
+    first[line] = -1;
+  for (j = c->nbranches - 1; j >= 0; j--) {
+    line = c->line_at[c->branches[j].pc];
+    next[j] = first[line];
+    first[line] = j;
+  }
+
+  fprintf (file, "\nsource %s\n", c->source);
+  buffer = NULL;
+  alloc = 0;
+  for (line = 1; ijvm_coverage_read_line (source, &buffer, &alloc); line++) {
+    if (line > c->nlines || !code[line]) {
+      fprintf (file, "%12s:%5d:%s\n", "-", line, buffer);
+      continue;
+    }
+    if (counts[line] == 0)
+      fprintf (file, "%12s:%5d:%s\n", "#####", line, buffer);
+    else
+      fprintf (file, "%12lu:%5d:%s\n", counts[line], line, buffer);
+    for (j = first[line]; j >= 0; j = next[j]) {
+      branch = &c->branches[j];
+      fprintf (file, "%12s  %s taken %lu, not taken %lu\n", "",
+	       ijvm_coverage_mnemonic (c, branch->opcode),
+	       branch->taken, branch->not_taken);
+    }
+  }
+
+  fclose (source);
+  free (buffer);
+  free (counts);
+  free (code);
+  free (first);
+  free (next);
+}
+
+/* Write the coverage report to file. */
+
+void
+ijvm_coverage_write (IJVMCoverage *c, FILE *file)
+{
+  IJVMBlock *block;
+  IJVMBranch *branch;
+  uint32 method, pc;
+  bool header;
+  int blocks_run, edges_run, first, last, j, k;
+
+  blocks_run = edges_run = 0;
+  pc = method = 0;
+  k = 0;
+  for (j = 0; j < c->nblocks; j++) {
+    block = &c->blocks[j];
+
+    /* The method a block belongs to is the last one before it. */
+    header = FALSE;
+    for (; pc <= block->start; pc++)
+      if (c->method_at[pc]) {
+	method = pc;
+	header = TRUE;
+      }
+    if (header) {
+      if (c->name_at != NULL && c->name_at[method] != NULL)
+	fprintf (file, "method %s at 0x%04x\n", c->name_at[method], method);
+      else if (c->image->main_index < c->image->cpool_size &&
+	       method == c->image->cpool[c->image->main_index])
+	fprintf (file, "method main at 0x%04x\n", method);
+      else
+	fprintf (file, "method at 0x%04x\n", method);
+    }
+
+    fprintf (file, "  block 0x%04x-0x%04x", block->start, block->end);
+    ijvm_coverage_lines (c, block->start, block->end, &first, &last);
+    if (first == last && first > 0)
+      fprintf (file, "  line %d", first);
+    else if (first > 0)
+      fprintf (file, "  lines %d-%d", first, last);
+    fprintf (file, "  count %lu\n", block->count);
+    if (block->count > 0)
+      blocks_run++;
+
+    for (; k < c->nbranches && c->branches[k].pc <= block->end; k++) {
+      branch = &c->branches[k];
+      fprintf (file, "  branch 0x%04x %s", branch->pc,
+	       ijvm_coverage_mnemonic (c, branch->opcode));
+      if (c->line_at != NULL && c->line_at[branch->pc] > 0)
+	fprintf (file, "  line %d", c->line_at[branch->pc]);
+      fprintf (file, "  taken %lu  not taken %lu\n",
+	       branch->taken, branch->not_taken);
+      edges_run += (branch->taken > 0) + (branch->not_taken > 0);
+    }
+  }
+
+  fprintf (file, "\nblocks run: %d of %d (%.1f%%)\n", blocks_run, c->nblocks,
+	   c->nblocks > 0 ? 100.0 * blocks_run / c->nblocks : 100.0);
+  fprintf (file, "branch edges run: %d of %d (%.1f%%)\n", edges_run,
+	   2 * c->nbranches,
+	   c->nbranches > 0 ? 50.0 * edges_run / c->nbranches : 100.0);
+
+  if (c->source != NULL)
+    ijvm_coverage_write_source (c, file);
+}
+
+void
+ijvm_coverage_free (IJVMCoverage *c)
+{
+  uint32 pc;
+
+  if (c->name_at != NULL)
+    for (pc = 0; pc < c->size; pc++)
+      free (c->name_at[pc]);
+  free (c->name_at);
+  free (c->line_at);
+  free (c->source);
+  free (c->blocks);
+  free (c->branches);
+  free (c->block_at);
+  free (c->branch_at);
+  free (c->method_at);
+  free (c);
+}
@@ -0,0 +1,653 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ijvm.h"
+
+/* ijvm-decode.c
+ *
+ * This file translates the bytecode in an IJVM image into the fixed
+ * width instruction stream run by the threaded engine.  The method
+ * area has no record of where methods begin and end, so the decoder
+ * works like a disassembler: starting from main it follows
+ * fall-through, branch targets and the methods named by
+ * invokevirtual, and decodes every instruction it reaches.  Anything
+ * it can't decode statically (truncated instructions, constant pool
+ * indices out of range, jumps out of the method area) becomes an
+ * IJVM_DECODED_EXIT, which hands the rest of the run back to the byte
+ * interpreter. */
+
+typedef struct IntStack IntStack;
+struct IntStack {
+  int length, alloc;
+  int32 *values;
+};
+
+static void
+int_stack_push (IntStack *s, int32 value)
+{
+  if (s->length == s->alloc) {
+    s->alloc = MAX (s->alloc * 2, 16);
+    s->values = realloc (s->values, s->alloc * sizeof (int32));
+  }
+  s->values[s->length++] = value;
+}
+
+static int
+ijvm_code_append (IJVMCode *code, uint16 op, uint32 pc, int length)
+{
+  IJVMInsn *insn;
+
+  if (code->ninsns == code->alloc) {
+    code->alloc = MAX (code->alloc * 2, 64);
+    code->insns = realloc (code->insns, code->alloc * sizeof (IJVMInsn));
+  }
+
+  insn = &code->insns[code->ninsns];
+  memset (insn, 0, sizeof (IJVMInsn));
+  insn->op = op;
+  insn->pc = pc;
+  insn->length = length;
+
+  return code->ninsns++;
+}
+
+/* Decode the instruction at pc into insn.  Returns FALSE if the
+ * instruction can't be decoded statically. */
+
+static bool
+ijvm_insn_decode (IJVMInsn *insn, IJVMImage *image, uint32 pc)
+{
+  uint8 *m;
+  uint32 size;
+  uint16 index;
+
+  m = image->method_area;
+  size = image->method_area_size;
+
+  insn->pc = pc;
+  insn->op = m[pc];
+  insn->target = NULL;
+  insn->a = 0;
+  insn->b = 0;
+
+  switch (m[pc]) {
+  case IJVM_OPCODE_BIPUSH:
+  case IJVM_OPCODE_ILOAD:
+  case IJVM_OPCODE_ISTORE:
+    insn->length = 2;
+    break;
+
+  case IJVM_OPCODE_GOTO:
+  case IJVM_OPCODE_IFEQ:
+  case IJVM_OPCODE_IFLT:
+  case IJVM_OPCODE_IF_ICMPEQ:
+  case IJVM_OPCODE_IINC:
+  case IJVM_OPCODE_INVOKEVIRTUAL:
+  case IJVM_OPCODE_LDC_W:
+    insn->length = 3;
+    break;
+
+  case IJVM_OPCODE_WIDE:
+    if (pc + 1 < size && (m[pc + 1] == IJVM_OPCODE_ILOAD ||
+			  m[pc + 1] == IJVM_OPCODE_ISTORE))
+      insn->length = 4;
+    else
+      insn->length = 1;
+    break;
+
+  default:
+    insn->length = 1;
+    break;
+  }
+
+  if (pc + insn->length > size)
+    return FALSE;
+
+  switch (m[pc]) {
+  case IJVM_OPCODE_BIPUSH:
+    insn->a = (int8) m[pc + 1];
+    break;
+
+  case IJVM_OPCODE_ILOAD:
+  case IJVM_OPCODE_ISTORE:
+    insn->a = m[pc + 1];
+    break;
+
+  case IJVM_OPCODE_WIDE:
+    if (insn->length == 4) {
+      insn->op = m[pc + 1];
+      insn->a = m[pc + 2] * 256 + m[pc + 3];
+    }
+    break;
+
+  case IJVM_OPCODE_IINC:
+    insn->a = m[pc + 1];
+    insn->b = (int8) m[pc + 2];
+    break;
+
+  case IJVM_OPCODE_GOTO:
+  case IJVM_OPCODE_IFEQ:
+  case IJVM_OPCODE_IFLT:
+  case IJVM_OPCODE_IF_ICMPEQ:
+    insn->a = pc + (int16) (m[pc + 1] * 256 + m[pc + 2]);
+    break;
+
+  case IJVM_OPCODE_INVOKEVIRTUAL:
+    insn->a = m[pc + 1] * 256 + m[pc + 2];
+    break;
+
+  case IJVM_OPCODE_LDC_W:
+    index = m[pc + 1] * 256 + m[pc + 2];
+    if (index >= image->cpool_size)
+      return FALSE;
+    insn->a = image->cpool[index];
+    break;
+  }
+
+  return TRUE;
+}
+
+static bool
+ijvm_insn_falls_through (IJVMInsn *insn)
+{
+  return insn->op != IJVM_OPCODE_GOTO && insn->op != IJVM_OPCODE_IRETURN;
+}
+
+bool
+ijvm_insn_is_conditional (IJVMInsn *insn)
+{
+  return (insn->op == IJVM_OPCODE_IFEQ || insn->op == IJVM_OPCODE_IFLT ||
+	  insn->op == IJVM_OPCODE_IF_ICMPEQ);
+}
+
+/* Return TRUE if insn ends a basic block: the engines only leave
+ * straight line code at these. */
+
+bool
+ijvm_insn_ends_block (IJVMInsn *insn)
+{
+  switch (insn->op) {
+  case IJVM_OPCODE_GOTO:
+  case IJVM_OPCODE_IFEQ:
+  case IJVM_OPCODE_IFLT:
+  case IJVM_OPCODE_IF_ICMPEQ:
+  case IJVM_OPCODE_INVOKEVIRTUAL:
+  case IJVM_OPCODE_IRETURN:
+  case IJVM_DECODED_JUMP:
+  case IJVM_DECODED_EXIT:
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
+static bool
+ijvm_insn_is_branch (IJVMInsn *insn)
+{
+  switch (insn->op) {
+  case IJVM_OPCODE_GOTO:
+  case IJVM_OPCODE_IFEQ:
+  case IJVM_OPCODE_IFLT:
+  case IJVM_OPCODE_IF_ICMPEQ:
+  case IJVM_DECODED_JUMP:
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
+/* Push the entry point of the method invoked by insn, if it is a
+ * method in the image. */
+
+static void
+ijvm_push_callee (IntStack *work, IJVMInsn *insn, IJVMImage *image)
+{
+  uint32 address;
+
+  if (insn->a >= 0x8000 || insn->a >= image->cpool_size)
+    return;
+  address = image->cpool[insn->a];
+  if (address + 4 < image->method_area_size)
+    int_stack_push (work, address + 4);
+}
+
+IJVMCode *
+ijvm_code_decode (IJVMImage *image)
+{
+  IJVMCode *code;
+  IJVMInsn insn;
+  IntStack work;
+  uint8 *start;
+  int32 *index, *target;
+  uint32 pc, next, size;
+  int j, k, n;
+
+  size = image->method_area_size;
+  code = malloc (sizeof (IJVMCode));
+  code->insns = NULL;
+  code->ninsns = 0;
+  code->alloc = 0;
+  code->size = size;
+  code->linked = NULL;
+  code->blocks = NULL;
+
+  /* Find the start of every reachable instruction. */
+
+  start = calloc (size + 1, 1);
+  memset (&work, 0, sizeof (work));
+  if (image->main_index < image->cpool_size)
+    int_stack_push (&work, image->cpool[image->main_index] + 4);
+
+  while (work.length > 0) {
+    pc = work.values[--work.length];
+    while (pc < size && !start[pc] && pc != IJVM_INITIAL_PC) {
+      start[pc] = TRUE;
+      if (!ijvm_insn_decode (&insn, image, pc))
+	break;
+      if (ijvm_insn_is_branch (&insn))
+	int_stack_push (&work, insn.a);
+      if (insn.op == IJVM_OPCODE_INVOKEVIRTUAL)
+	ijvm_push_callee (&work, &insn, image);
+      if (!ijvm_insn_falls_through (&insn))
+	break;
+      pc += insn.length;
+    }
+  }
+
+  /* Lay out the instructions in method area order.  When the next
+   * instruction in the stream isn't the one an instruction falls
+   * through to, an explicit jump is inserted. */
+
+  index = malloc ((size + 1) * sizeof (int32));
+  for (pc = 0; pc < size; pc++)
+    index[pc] = -1;
+
+  for (pc = 0; pc < size; pc++) {
+    if (!start[pc])
+      continue;
+    if (!ijvm_insn_decode (&insn, image, pc)) {
+      index[pc] = ijvm_code_append (code, IJVM_DECODED_EXIT, pc, 0);
+      continue;
+    }
+    k = ijvm_code_append (code, insn.op, pc, insn.length);
+    code->insns[k] = insn;
+    index[pc] = k;
+
+    if (!ijvm_insn_falls_through (&insn))
+      continue;
+    next = pc + insn.length;
+    for (j = pc + 1; j < next && j < size; j++)
+      if (start[j])
+	break;
+    if (j < next || next >= size || !start[next]) {
+      k = ijvm_code_append (code, IJVM_DECODED_JUMP, next, 0);
+      code->insns[k].a = next;
+    }
+  }
+
+  /* Resolve branch targets.  Targets outside the decoded code get an
+   * exit of their own. */
+
+  n = code->ninsns;
+  target = malloc ((n + 1) * sizeof (int32));
+  for (k = 0; k < n; k++) {
+    target[k] = -1;
+    if (!ijvm_insn_is_branch (&code->insns[k]))
+      continue;
+    pc = code->insns[k].a;
+    if (pc < size && index[pc] >= 0)
+      target[k] = index[pc];
+    else
+      target[k] = ijvm_code_append (code, IJVM_DECODED_EXIT, pc, 0);
+  }
+  for (k = 0; k < n; k++)
+    if (target[k] >= 0)
+      code->insns[k].target = &code->insns[target[k]];
+
+  ijvm_code_count (code->insns, code->ninsns);
+
+  code->map = calloc (size + 1, sizeof (IJVMInsn *));
+  for (pc = 0; pc < size; pc++)
+    if (index[pc] >= 0)
+      code->map[pc] = &code->insns[index[pc]];
+
+  free (target);
+  free (index);
+  free (start);
+  free (work.values);
+
+  return code;
+}
+
+/* Return the decoded instruction starting at method area offset pc,
+ * or NULL if there is none. */
+
+IJVMInsn *
+ijvm_code_lookup (IJVMCode *code, uint32 pc)
+{
+  if (pc < code->size)
+    return code->map[pc];
+  return NULL;
+}
+
+/* Count the instructions to the end of the basic block of each of
+ * the ninsns at insns, for the budget; see IJVMInsn.  Backwards, so
+ * the count of the next instruction in the stream is known. */
+
+void
+ijvm_code_count (IJVMInsn *insns, int ninsns)
+{
+  int j, k;
+
+  for (k = ninsns - 1; k >= 0; k--) {
+    if (insns[k].op >= 256)
+      j = 0;
+    else
+      j = insns[k].length == 4 ? 2 : 1;
+    if (ijvm_insn_ends_block (&insns[k])) {
+      insns[k].cost = j;
+      insns[k].reserve = j;
+      if (ijvm_insn_is_conditional (&insns[k]) && k + 1 < ninsns)
+	insns[k].reserve += insns[k + 1].reserve;
+    }
+    else {
+      insns[k].cost = j + insns[k + 1].cost;
+      insns[k].reserve = j + insns[k + 1].reserve;
+    }
+  }
+}
+
+/* Add the ninsns at insns to code, see IJVMCodeBlock.  They stay the
+ * caller's to free, after code. */
+
+void
+ijvm_code_add (IJVMCode *code, IJVMInsn *insns, int ninsns)
+{
+  IJVMCodeBlock *block;
+  int k;
+
+  block = malloc (sizeof (IJVMCodeBlock));
+  block->insns = insns;
+  block->ninsns = ninsns;
+  block->next = code->blocks;
+  code->blocks = block;
+
+  if (code->linked != NULL)
+    for (k = 0; k < ninsns; k++)
+      insns[k].handler = code->linked[insns[k].op];
+}
+
+/* Set the handler of every instruction in code from table, the
+ * dispatch table of an engine, indexed by op. */
+
+void
+ijvm_code_link (IJVMCode *code, void **table)
+{
+  IJVMCodeBlock *block;
+  int k;
+
+  for (k = 0; k < code->ninsns; k++)
+    code->insns[k].handler = table[code->insns[k].op];
+  for (block = code->blocks; block != NULL; block = block->next)
+    for (k = 0; k < block->ninsns; k++)
+      block->insns[k].handler = table[block->insns[k].op];
+  code->linked = table;
+}
+
+void
+ijvm_code_free (IJVMCode *code)
+{
+  IJVMCodeBlock *block;
+
+  while (code->blocks != NULL) {
+    block = code->blocks;
+    code->blocks = block->next;
+    free (block);
+  }
+  free (code->insns);
+  free (code->map);
+  free (code);
+}
+
+/* Superinstructions.  The table lists the sequences ijvm_code_fuse
+ * knows how to replace, in the order they are tried when no profile
+ * says otherwise.  The operands of a superinstruction are copied from
+ * the instructions it replaces:
+ *
+ *   iload x; iload y; iadd         a = x, b = y
+ *   iload x; iload y; isub         a = x, b = y
+ *   iload x; iload y; if_icmpeq l  a = x, b = y, target = l
+ *   iload x; bipush v; isub        a = x, b = v
+ *   bipush v; if_icmpeq l          a = v, target = l
+ *   iload x; ifeq l                a = x, target = l
+ *   iload x; iflt l                a = x, target = l
+ *   iinc x, v; goto l              a = x, b = v, target = l
+ *   iadd; istore x                 a = x
+ *   isub; istore x                 a = x
+ */
+
+IJVMSuperInsn ijvm_super_insns[] =
+{
+  { IJVM_DECODED_ILOAD_ILOAD_IADD, 3,
+    { IJVM_OPCODE_ILOAD, IJVM_OPCODE_ILOAD, IJVM_OPCODE_IADD } },
+  { IJVM_DECODED_ILOAD_ILOAD_ISUB, 3,
+    { IJVM_OPCODE_ILOAD, IJVM_OPCODE_ILOAD, IJVM_OPCODE_ISUB } },
+  { IJVM_DECODED_ILOAD_ILOAD_IF_ICMPEQ, 3,
+    { IJVM_OPCODE_ILOAD, IJVM_OPCODE_ILOAD, IJVM_OPCODE_IF_ICMPEQ } },
+  { IJVM_DECODED_ILOAD_BIPUSH_ISUB, 3,
+    { IJVM_OPCODE_ILOAD, IJVM_OPCODE_BIPUSH, IJVM_OPCODE_ISUB } },
+  { IJVM_DECODED_BIPUSH_IF_ICMPEQ, 2,
+    { IJVM_OPCODE_BIPUSH, IJVM_OPCODE_IF_ICMPEQ } },
+  { IJVM_DECODED_ILOAD_IFEQ, 2,
+    { IJVM_OPCODE_ILOAD, IJVM_OPCODE_IFEQ } },
+  { IJVM_DECODED_ILOAD_IFLT, 2,
+    { IJVM_OPCODE_ILOAD, IJVM_OPCODE_IFLT } },
+  { IJVM_DECODED_IINC_GOTO, 2,
+    { IJVM_OPCODE_IINC, IJVM_OPCODE_GOTO } },
+  { IJVM_DECODED_IADD_ISTORE, 2,
+    { IJVM_OPCODE_IADD, IJVM_OPCODE_ISTORE } },
+  { IJVM_DECODED_ISUB_ISTORE, 2,
+    { IJVM_OPCODE_ISUB, IJVM_OPCODE_ISTORE } },
+  { 0, 0, { 0 } }
+};
+
+static bool
+ijvm_super_insn_matches (IJVMSuperInsn *super, IJVMCode *code, int k)
+{
+  int j;
+
+  if (k + super->length > code->ninsns)
+    return FALSE;
+  for (j = 0; j < super->length; j++)
+    if (code->insns[k + j].op != super->opcodes[j])
+      return FALSE;
+  return TRUE;
+}
+
+/* Replace the sequences in table (a NULL terminated array, or NULL
+ * for all of ijvm_super_insns) with superinstructions.  Every
+ * position is tried, also those inside a sequence that was just
+ * replaced, so a jump into the middle of a sequence lands on a
+ * superinstruction too.  Since an instruction only falls through to
+ * the next one in the stream, a match is always straight line
+ * code. */
+
+void
+ijvm_code_fuse (IJVMCode *code, IJVMSuperInsn **table)
+{
+  IJVMSuperInsn *super, **default_table;
+  IJVMInsn *insn;
+  int j, k;
+
+  default_table = NULL;
+  if (table == NULL) {
+    for (j = 0; ijvm_super_insns[j].length > 0; j++)
+      ;
+    default_table = malloc ((j + 1) * sizeof (IJVMSuperInsn *));
+    for (j = 0; ijvm_super_insns[j].length > 0; j++)
+      default_table[j] = &ijvm_super_insns[j];
+    default_table[j] = NULL;
+    table = default_table;
+  }
+
+  for (k = 0; k < code->ninsns; k++) {
+    for (j = 0; table[j] != NULL; j++)
+      if (ijvm_super_insn_matches (table[j], code, k))
+	break;
+    super = table[j];
+    if (super == NULL)
+      continue;
+
+    insn = &code->insns[k];
+    switch (super->op) {
+    case IJVM_DECODED_ILOAD_ILOAD_IADD:
+    case IJVM_DECODED_ILOAD_ILOAD_ISUB:
+    case IJVM_DECODED_ILOAD_BIPUSH_ISUB:
+      insn->b = insn[1].a;
+      break;
+
+    case IJVM_DECODED_ILOAD_ILOAD_IF_ICMPEQ:
+      insn->b = insn[1].a;
+      insn->target = insn[2].target;
+      break;
+
+    case IJVM_DECODED_BIPUSH_IF_ICMPEQ:
+    case IJVM_DECODED_ILOAD_IFEQ:
+    case IJVM_DECODED_ILOAD_IFLT:
+    case IJVM_DECODED_IINC_GOTO:
+      insn->target = insn[1].target;
+      break;
+
+    case IJVM_DECODED_IADD_ISTORE:
+    case IJVM_DECODED_ISUB_ISTORE:
+      insn->a = insn[1].a;
+      break;
+    }
+    insn->op = super->op;
+  }
+
+  code->linked = NULL;
+  free (default_table);
+}
+
+/* Replace the invokevirtuals of methods in image by
+ * IJVM_DECODED_CALLs, which build the frame of the method themselves
+ * and go straight on with its decoded code: no builtin test, no
+ * reading of the method header and no lookup of the entry point.
+ * Only for an image that passed ijvm_verify, in which every method
+ * invoked is a method, and decoded, since the decoder followed the
+ * same calls the verifier did.  A call checks that the frame of the
+ * method fits in the memory if i has the frame sizes, see
+ * ijvm_stack_frames.  If i->tail_calls is set, a call followed by an
+ * ireturn becomes an IJVM_DECODED_TAIL_CALL, see
+ * ijvm_invoke_virtual. */
+
+void
+ijvm_code_bind (IJVM *i, IJVMImage *image)
+{
+  IJVMCode *code;
+  IJVMInsn *insn, *next;
+  uint8 *m;
+  uint32 address;
+  int k;
+
+  if (!image->verified)
+    return;
+
+  code = i->code;
+  m = image->method_area;
+  for (k = 0; k < code->ninsns; k++) {
+    insn = &code->insns[k];
+    if (insn->op != IJVM_OPCODE_INVOKEVIRTUAL || insn->a >= 0x8000)
+      continue;
+    address = image->cpool[insn->a];
+    insn->op = IJVM_DECODED_CALL;
+    insn->b = (uint32) insn->a < i->nframes ? i->frames[insn->a] : 0;
+    insn->a = m[address] * 256 + m[address + 1] +
+      (m[address + 2] * 256 + m[address + 3]) * 65536;
+    insn->target = code->map[address + 4];
+    next = ijvm_code_lookup (code, insn->pc + insn->length);
+    if (i->tail_calls && next != NULL && next->op == IJVM_OPCODE_IRETURN)
+      insn->op = IJVM_DECODED_TAIL_CALL;
+  }
+
+  code->linked = NULL;
+}
+
+/* Write the number of times each pair of opcodes was executed in
+ * sequence.  Each line holds two opcodes in hex and a count. */
+
+void
+ijvm_pair_profile_write (FILE *file, unsigned long *pairs)
+{
+  int j;
+
+  for (j = 0; j < 256 * 256; j++)
+    if (pairs[j] != 0)
+      fprintf (file, "%02x %02x %lu\n", j >> 8, j & 255, pairs[j]);
+}
+
+static unsigned long
+ijvm_super_insn_score (IJVMSuperInsn *super, unsigned long *pairs)
+{
+  unsigned long score;
+  int j;
+
+  score = pairs[super->opcodes[0] * 256 + super->opcodes[1]];
+  for (j = 2; j < super->length; j++)
+    score = MIN (score, pairs[super->opcodes[j - 1] * 256 +
+			      super->opcodes[j]]);
+  return score;
+}
+
+/* Read a pair profile written by ijvm_pair_profile_write and return
+ * the superinstructions whose pairs all occur in it, most frequent
+ * first.  A sequence is never executed more often than its least
+ * frequent pair, so that is what we sort by. */
+
+IJVMSuperInsn **
+ijvm_super_insns_from_profile (FILE *file)
+{
+  IJVMSuperInsn **table;
+  unsigned long *pairs, *scores, count, s;
+  unsigned int first, second;
+  int fields, line, n, j, k;
+
+  pairs = calloc (256 * 256, sizeof (unsigned long));
+  line = 1;
+  while ((fields = fscanf (file, "%x %x %lu", &first, &second, &count)) != EOF) {
+    if (fields != 3 || first > 255 || second > 255) {
+      fprintf (stderr, "Pair profile parse error in line %d\n", line);
+      exit (-1);
+    }
+    pairs[first * 256 + second] += count;
+    line++;
+  }
+
+  for (n = 0; ijvm_super_insns[n].length > 0; n++)
+    ;
+  table = malloc ((n + 1) * sizeof (IJVMSuperInsn *));
+  scores = malloc ((n + 1) * sizeof (unsigned long));
+
+  /* Insertion sort by score; there are only a handful. */
+  n = 0;
+  for (j = 0; ijvm_super_insns[j].length > 0; j++) {
+    s = ijvm_super_insn_score (&ijvm_super_insns[j], pairs);
+    if (s == 0)
+      continue;
+    for (k = n; k > 0 && scores[k - 1] < s; k--) {
+      table[k] = table[k - 1];
+      scores[k] = scores[k - 1];
+    }
+    table[k] = &ijvm_super_insns[j];
+    scores[k] = s;
+    n++;
+  }
+  table[n] = NULL;
+
+  free (scores);
+  free (pairs);
+
+  return table;
+}
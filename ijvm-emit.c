@@ -4,6 +4,7 @@
 #include <limits.h>
 #include "ijvm-asm.h"
 #include "ijvm-util.h"
+#include "ijvm.h"
 
 JasmCPool *
 jasm_cpool_make (void)
@@ -72,9 +73,18 @@ jasm_cpool_emit (JasmCPool *cpool)
  * indices in the constant pool.  The instruction `invokevirtual
  * putchar' is assembled into B6 80 00, and the simulator knows that
  * indices above 0x8000 are special and dispatches to a C function,
- * implementing the actual I/O */
+ * implementing the actual I/O
+ *
+ * For programs moving a lot of text there are two block builtins,
+ * `readblock' and `writeblock'.  They take a local variable number
+ * and a count, and read characters into or write characters from
+ * that many consecutive local variables of the calling method, one
+ * character per variable.  `readblock' returns the number of
+ * characters read, which is less than the count only at the end of
+ * the input. */
 
-char *ijvm_builtins[] = { "getchar", "putchar", NULL };
+char *ijvm_builtins[] = { "getchar", "putchar", "readblock", "writeblock",
+			  NULL };
 
 int
 jasm_builtin_lookup (char *name)
@@ -505,11 +515,48 @@ jasm_method_emit (JasmMethod *methods, JasmCPool *cpool, ByteStream *bs)
   }
 }
 
+/* Write the source line of every instruction to file, so that tools
+ * that report on a run of the program, such as the coverage report of
+ * ijvm, can refer to the source.  The file is text, with numbers in
+ * decimal: a first line naming the source file, then for each method
+ * a line with its name, address and constant pool index, followed by
+ * a line with the address and source line of each of its
+ * instructions:
+ *
+ *   ijvm lines: test.j
+ *   method main 0 0
+ *   4 12
+ *   6 13
+ */
+
+void
+jasm_lines_write (FILE *file, char *source, JasmMethod *methods)
+{
+  JasmMethod *m;
+  JasmInsn *insn;
+
+  fprintf (file, "ijvm lines: %s\n", source);
+  for (m = methods; m != NULL; m = m->next) {
+    fprintf (file, "method %s %d %d\n", m->name, m->address, m->index);
+    for (insn = m->insns; insn != NULL; insn = insn->next)
+      if (insn->kind == JASM_INSN_GENERIC)
+	fprintf (file, "%d %d\n", insn->pc, insn->line);
+  }
+}
+
+/* Emit the program.  The most words each method has on its operand
+ * stack are found by the verifier and recorded in the image, for the
+ * stack checks of ijvm, see ijvm-stack.c.  A program the verifier
+ * rejects is emitted as it is, without them; it can still be run
+ * with the checks the interpreter does as it goes. */
+
 IJVMImage *
 jasm_emit (JasmMethod *methods, JasmCPool *cpool)
 {
   JasmMethod *main_method;
   ByteStream *bs;
+  IJVMImage *image;
+  char error[IJVM_ERROR_SIZE];
 
   bs = byte_stream_new ();
   jasm_method_emit (methods, cpool, bs);
@@ -518,7 +565,14 @@ jasm_emit (JasmMethod *methods, JasmCPool *cpool)
   if (main_method == NULL)
     jasm_abort ("Method `main' not found\n");
 
-  return ijvm_image_new (main_method->index,
-			  bs->bytes, bs->length,
-			  cpool->consts, cpool->length);
+  image = ijvm_image_new (main_method->index,
+			 bs->bytes, bs->length,
+			 cpool->consts, cpool->length);
+  if (!ijvm_verify (image, error)) {
+    free (image->max_stack);
+    image->max_stack = NULL;
+    image->nmax_stack = 0;
+  }
+
+  return image;
 }
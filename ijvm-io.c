@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "ijvm-util.h"
+#include "ijvm-io.h"
+
+/* ijvm-io.c
+ *
+ * The buffers behind ijvm_io_getc and ijvm_io_putc.  Output goes
+ * through stdio in the end, so that it stays in order with the
+ * traces the interpreter prints with printf; the buffer here only
+ * saves the call per character.  When a trace is printed on stdout
+ * the output isn't buffered at all.  Output to memory is never
+ * flushed; the buffer grows instead. */
+
+IJVMIO *
+ijvm_io_new (int in_fd, FILE *out_file, bool unbuffered)
+{
+  IJVMIO *io;
+
+  io = malloc (sizeof (IJVMIO));
+  io->in_fd = in_fd;
+  io->in = malloc (IJVM_IO_BUFFER_SIZE);
+  io->in_pos = 0;
+  io->in_length = 0;
+  io->in_eof = FALSE;
+  io->in_offset = 0;
+
+  io->out_file = out_file;
+  io->out_size = unbuffered ? 1 : IJVM_IO_BUFFER_SIZE;
+  io->out = malloc (io->out_size);
+  io->out_length = 0;
+  io->out_lines = isatty (fileno (out_file));
+  io->out_offset = 0;
+
+  return io;
+}
+
+/* Read the length bytes at input, and write to memory. */
+
+IJVMIO *
+ijvm_io_new_memory (uint8 *input, int length)
+{
+  IJVMIO *io;
+
+  io = malloc (sizeof (IJVMIO));
+  io->in_fd = -1;
+  io->in = malloc (MAX (length, 1));
+  memcpy (io->in, input, length);
+  io->in_pos = 0;
+  io->in_length = length;
+  io->in_eof = TRUE;
+  io->in_offset = 0;
+
+  io->out_file = NULL;
+  io->out_size = 256;
+  io->out = malloc (io->out_size);
+  io->out_length = 0;
+  io->out_lines = FALSE;
+  io->out_offset = 0;
+
+  return io;
+}
+
+/* Make room for n more characters of output to memory. */
+
+static void
+ijvm_io_grow (IJVMIO *io, int n)
+{
+  while (io->out_length + n >= io->out_size)
+    io->out_size *= 2;
+  io->out = realloc (io->out, io->out_size);
+}
+
+/* The output written to memory so far. */
+
+uint8 *
+ijvm_io_output (IJVMIO *io, int *length)
+{
+  *length = io->out_length;
+  return io->out;
+}
+
+void
+ijvm_io_flush (IJVMIO *io)
+{
+  if (io->out_file == NULL)
+    return;
+  if (io->out_length > 0)
+    fwrite (io->out, 1, io->out_length, io->out_file);
+  io->out_offset += io->out_length;
+  io->out_length = 0;
+}
+
+/* Refill the input buffer and return its first character, or EOF.
+ * Whatever was written so far is flushed first, as the program may
+ * be waiting for an answer to it. */
+
+int
+ijvm_io_fill (IJVMIO *io)
+{
+  ssize_t n;
+
+  if (io->in_eof)
+    return EOF;
+
+  ijvm_io_flush (io);
+  if (io->out_file != NULL)
+    fflush (io->out_file);
+
+  io->in_offset += io->in_length;
+  io->in_pos = io->in_length = 0;
+  do
+    n = read (io->in_fd, io->in, IJVM_IO_BUFFER_SIZE);
+  while (n < 0 && errno == EINTR);
+
+  if (n <= 0) {
+    io->in_eof = TRUE;
+    return EOF;
+  }
+  io->in_pos = 1;
+  io->in_length = n;
+
+  return io->in[0];
+}
+
+/* The slow path of ijvm_io_putc: the buffer is full or c ends a
+ * line. */
+
+int
+ijvm_io_flush_char (IJVMIO *io, int c)
+{
+  if (io->out_file == NULL) {
+    ijvm_io_grow (io, 1);
+    io->out[io->out_length++] = c;
+    return (uint8) c;
+  }
+
+  io->out[io->out_length++] = c;
+  if (io->out_length == io->out_size || (c == '\n' && io->out_lines))
+    ijvm_io_flush (io);
+  if (ferror (io->out_file))
+    return EOF;
+
+  return (uint8) c;
+}
+
+/* Read up to n characters, stopping only at the end of the input.
+ * Returns the number of characters read. */
+
+int
+ijvm_io_read (IJVMIO *io, uint8 *buffer, int n)
+{
+  int done, k;
+
+  done = 0;
+  while (done < n) {
+    if (io->in_pos == io->in_length) {
+      if (ijvm_io_fill (io) == EOF)
+	break;
+      io->in_pos = 0;
+    }
+    k = MIN (n - done, io->in_length - io->in_pos);
+    memcpy (buffer + done, io->in + io->in_pos, k);
+    io->in_pos += k;
+    done += k;
+  }
+
+  return done;
+}
+
+/* Write n characters.  Unless lines are flushed as they end, they
+ * are copied to the buffer in one go.  Returns n, or EOF if writing
+ * failed. */
+
+int
+ijvm_io_write (IJVMIO *io, uint8 *buffer, int n)
+{
+  int done, k;
+
+  if (io->out_file == NULL) {
+    ijvm_io_grow (io, n);
+    memcpy (io->out + io->out_length, buffer, n);
+    io->out_length += n;
+    return n;
+  }
+
+  if (io->out_lines || io->out_size == 1) {
+    for (done = 0; done < n; done++)
+      if (ijvm_io_putc (io, buffer[done]) == EOF)
+	return EOF;
+    return n;
+  }
+
+  for (done = 0; done < n; done += k) {
+    k = MIN (n - done, io->out_size - io->out_length);
+    memcpy (io->out + io->out_length, buffer + done, k);
+    io->out_length += k;
+    if (io->out_length == io->out_size)
+      ijvm_io_flush (io);
+  }
+  if (ferror (io->out_file))
+    return EOF;
+
+  return n;
+}
+
+/* The number of characters read and written so far. */
+
+long
+ijvm_io_input_position (IJVMIO *io)
+{
+  return io->in_offset + io->in_pos;
+}
+
+long
+ijvm_io_output_position (IJVMIO *io)
+{
+  return io->out_offset + io->out_length;
+}
+
+/* Continue a run that had read input characters and written output
+ * characters: the input characters are read and dropped, and output
+ * is counted from output on.  Returns the number of characters
+ * dropped, which is less than input if the input ends first. */
+
+long
+ijvm_io_skip (IJVMIO *io, long input, long output)
+{
+  long done;
+
+  for (done = 0; done < input; done++)
+    if (ijvm_io_getc (io) == EOF)
+      break;
+  io->out_offset = output - io->out_length;
+
+  return done;
+}
+
+void
+ijvm_io_free (IJVMIO *io)
+{
+  ijvm_io_flush (io);
+  if (io->out_file != NULL)
+    fflush (io->out_file);
+  free (io->in);
+  free (io->out);
+  free (io);
+}
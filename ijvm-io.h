@@ -0,0 +1,56 @@
+#ifndef IJVM_IO_H
+#define IJVM_IO_H
+
+#include "types.h"
+
+/* ijvm-io.h
+ *
+ * Buffered I/O for the builtin methods.  Input is read ahead in large
+ * blocks with read (2), and output collects in a buffer that is
+ * written to stdout when it is full, at the end of each line if
+ * stdout is a terminal, before waiting for input and when the
+ * program ends.  For programs run by the library the input is a
+ * block of memory, and the output collects in a growing buffer.
+ * ijvm_io_getc and ijvm_io_putc are macros, so the
+ * common case costs no function call; like getc, they may evaluate
+ * their arguments more than once. */
+
+#define IJVM_IO_BUFFER_SIZE (64 << 10)
+
+typedef struct IJVMIO IJVMIO;
+struct IJVMIO
+{
+  int in_fd;            /* -1 when reading from memory */
+  uint8 *in;
+  int in_pos, in_length;
+  bool in_eof;
+  long in_offset;       /* Input before the buffer */
+
+  FILE *out_file;       /* NULL when writing to memory */
+  uint8 *out;
+  int out_length, out_size;
+  bool out_lines;       /* Flush at the end of each line */
+  long out_offset;      /* Output before the buffer */
+};
+
+IJVMIO *ijvm_io_new (int in_fd, FILE *out_file, bool unbuffered);
+IJVMIO *ijvm_io_new_memory (uint8 *input, int length);
+uint8 *ijvm_io_output (IJVMIO *io, int *length);
+int ijvm_io_fill (IJVMIO *io);
+int ijvm_io_flush_char (IJVMIO *io, int c);
+void ijvm_io_flush (IJVMIO *io);
+int ijvm_io_read (IJVMIO *io, uint8 *buffer, int n);
+int ijvm_io_write (IJVMIO *io, uint8 *buffer, int n);
+long ijvm_io_input_position (IJVMIO *io);
+long ijvm_io_output_position (IJVMIO *io);
+long ijvm_io_skip (IJVMIO *io, long input, long output);
+void ijvm_io_free (IJVMIO *io);
+
+#define ijvm_io_getc(io) \
+  ((io)->in_pos < (io)->in_length ? (io)->in[(io)->in_pos++] : ijvm_io_fill (io))
+
+#define ijvm_io_putc(io, c) \
+  ((io)->out_length < (io)->out_size - 1 && (uint8) (c) != '\n' ? \
+   ((io)->out[(io)->out_length++] = (uint8) (c)) : ijvm_io_flush_char (io, c))
+
+#endif
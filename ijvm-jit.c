@@ -0,0 +1,768 @@
+#define _GNU_SOURCE     /* for REG_RIP */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
+
+#include "ijvm.h"
+
+/* ijvm-jit.c
+ *
+ * A template JIT compiler for x86-64 Linux.  Each method is
+ * translated to native code the first time it is invoked, one fixed
+ * template per decoded instruction.  The compiled code keeps the IJVM
+ * registers in callee saved machine registers
+ *
+ *   rbx  base of IJVM memory (i->stack)
+ *   r12  address of the top of stack, &stack[sp]
+ *   r13  address of the local variable frame, &stack[lv]
+ *   r14  the IJVM
+ *   r15  the lowest rsp allowed for a call
+ *
+ * and builds the same frames in IJVM memory as ijvm_invoke_virtual,
+ * so the interpreter can take over at any point.  invokevirtual and
+ * ireturn become native call and ret.  The builtins are called in C.
+ *
+ * Anything the compiler doesn't handle (the IJVM_DECODED_EXIT
+ * instructions of the decoded code, methods it can't find, calls
+ * nested deeper than the C stack allows) is compiled into a bailout:
+ * the registers are written back to the IJVM, and ijvm_jit_bailout
+ * longjmps out of the native code to ijvm_run_jit, which leaves the
+ * rest of the run to the interpreter.
+ *
+ * The templates store no PC for ijvm_fault.  Each compiled method
+ * keeps the offsets of its templates instead, and a template makes
+ * any access that can fault before it moves r12, so the instruction
+ * and SP of a fault can be had from rip and r12 at the time; see
+ * ijvm_jit_fault. */
+
+#if defined (__x86_64__) && defined (__linux__)
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <ucontext.h>
+
+#define JIT_CHUNK_SIZE (1 << 20)
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+typedef void (*IJVMJitEntry) (IJVM *i, void *code);
+
+typedef struct IJVMJitChunk IJVMJitChunk;
+struct IJVMJitChunk {
+  uint8 *previous;
+  size_t size;
+};
+
+/* The templates of a compiled method, for ijvm_jit_fault. */
+typedef struct IJVMJitMethod IJVMJitMethod;
+struct IJVMJitMethod {
+  uint8 *code;
+  int length;
+  int ninsns;
+  int *offsets;         /* Of the templates in code, ascending */
+  uint32 *pcs;          /* Of their instructions */
+  IJVMJitMethod *next;
+};
+
+typedef struct IJVMJitFixup IJVMJitFixup;
+struct IJVMJitFixup {
+  int offset;           /* Offset of rel32 in the method's code */
+  int target;           /* Index of target in decoded code */
+};
+
+struct IJVMJit
+{
+  uint8 *chunk;         /* Executable memory being filled, which
+			 * starts with a pointer to the previous one */
+  uint32 chunk_used, chunk_size;
+
+  void **compiled;      /* Native code by method entry offset */
+  void **entries;       /* Native code by constant pool index */
+  IJVMJitMethod *methods;
+  uint32 ncompiled, code_size;
+
+  IJVMJitEntry enter;
+  jmp_buf bailout;
+  char *stack_limit;    /* Lowest rsp for an invokevirtual */
+
+  /* Buffer for the method being compiled. */
+  uint8 *buf;
+  int length, alloc;
+  int *labels;
+  IJVMJitFixup *fixups;
+  int nfixups, fixups_alloc;
+};
+
+static void
+emit_byte (IJVMJit *jit, uint8 byte)
+{
+  if (jit->length == jit->alloc) {
+    jit->alloc = MAX (jit->alloc * 2, 4096);
+    jit->buf = realloc (jit->buf, jit->alloc);
+  }
+  jit->buf[jit->length++] = byte;
+}
+
+static void
+emit_bytes (IJVMJit *jit, int n, ...)
+{
+  va_list ap;
+  int j;
+
+  va_start (ap, n);
+  for (j = 0; j < n; j++)
+    emit_byte (jit, va_arg (ap, int));
+  va_end (ap);
+}
+
+static void
+emit_int32 (IJVMJit *jit, int32 value)
+{
+  emit_byte (jit, value);
+  emit_byte (jit, value >> 8);
+  emit_byte (jit, value >> 16);
+  emit_byte (jit, value >> 24);
+}
+
+static void
+emit_int64 (IJVMJit *jit, unsigned long value)
+{
+  emit_int32 (jit, value);
+  emit_int32 (jit, value >> 32);
+}
+
+/* Emit `opcode reg, [base + disp]', with a 32 bit displacement. */
+
+static void
+emit_mem (IJVMJit *jit, bool wide, uint8 opcode, int reg, int base, int32 disp)
+{
+  uint8 rex;
+
+  rex = 0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (base & 8 ? 1 : 0);
+  if (rex != 0x40)
+    emit_byte (jit, rex);
+  emit_byte (jit, opcode);
+  emit_byte (jit, 0x80 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == 4)
+    emit_byte (jit, 0x24);
+  emit_int32 (jit, disp);
+}
+
+/* add r12, 4 * slots */
+static void
+emit_adjust_sp (IJVMJit *jit, int slots)
+{
+  if (slots == 0)
+    return;
+  emit_bytes (jit, 3, 0x49, 0x81, 0xc4);
+  emit_int32 (jit, 4 * slots);
+}
+
+/* mov rax, imm64; call rax */
+static void
+emit_call (IJVMJit *jit, void *function)
+{
+  emit_bytes (jit, 2, 0x48, 0xb8);
+  emit_int64 (jit, (unsigned long) function);
+  emit_bytes (jit, 2, 0xff, 0xd0);
+}
+
+/* eax = (reg - rbx) / 4, ie. the stack index reg points to. */
+static void
+emit_index_of (IJVMJit *jit, int reg)
+{
+  emit_bytes (jit, 3, 0x4c, 0x89, reg == R12 ? 0xe0 : 0xe8);
+  emit_bytes (jit, 3, 0x48, 0x29, 0xd8);
+  emit_bytes (jit, 4, 0x48, 0xc1, 0xe8, 0x02);
+}
+
+/* Write sp and lv back to the IJVM. */
+static void
+emit_sync (IJVMJit *jit)
+{
+  emit_index_of (jit, R12);
+  emit_mem (jit, FALSE, 0x89, RAX, R14, offsetof (IJVM, sp));
+  emit_index_of (jit, R13);
+  emit_mem (jit, FALSE, 0x89, RAX, R14, offsetof (IJVM, lv));
+}
+
+/* Jump with 32 bit displacement to decoded instruction target.
+ * opcode is 0xe9 for jmp, or the second byte of a 0x0f jcc. */
+static void
+emit_jump (IJVMJit *jit, uint8 opcode, int target)
+{
+  IJVMJitFixup *fixup;
+
+  if (opcode != 0xe9)
+    emit_byte (jit, 0x0f);
+  emit_byte (jit, opcode);
+
+  if (jit->nfixups == jit->fixups_alloc) {
+    jit->fixups_alloc = MAX (jit->fixups_alloc * 2, 64);
+    jit->fixups = realloc (jit->fixups,
+			   jit->fixups_alloc * sizeof (IJVMJitFixup));
+  }
+  fixup = &jit->fixups[jit->nfixups++];
+  fixup->offset = jit->length;
+  fixup->target = target;
+  emit_int32 (jit, 0);
+}
+
+static void
+ijvm_jit_bailout (IJVM *i, uint32 pc)
+{
+  i->pc = pc;
+  longjmp (i->jit->bailout, 1);
+}
+
+static void
+ijvm_jit_builtin (IJVM *i, uint32 index, uint32 pc)
+{
+  i->insn_pc = pc;
+  i->insn_sp = i->sp;
+  ijvm_invoke_builtin (i, index - 0x8000);
+}
+
+static void
+ijvm_jit_overflow (IJVM *i, uint32 index, uint32 pc)
+{
+  i->insn_pc = pc;
+  i->insn_sp = i->sp;
+  ijvm_stack_overflow (i, i->cpp[index], i->frames[index]);
+}
+
+static void *ijvm_jit_lookup (IJVM *i, uint32 index);
+
+static void
+emit_bailout (IJVMJit *jit, uint32 pc)
+{
+  emit_sync (jit);
+  emit_bytes (jit, 3, 0x4c, 0x89, 0xf7);             /* mov rdi, r14 */
+  emit_byte (jit, 0xbe);                             /* mov esi, pc */
+  emit_int32 (jit, pc);
+  emit_call (jit, ijvm_jit_bailout);
+}
+
+static void
+emit_invoke (IJVMJit *jit, IJVM *i, IJVMInsn *insn)
+{
+  uint32 address;
+  int nargs, nlocals, skip;
+
+  if (insn->a >= 0x8000) {
+    emit_sync (jit);
+    emit_bytes (jit, 3, 0x4c, 0x89, 0xf7);           /* mov rdi, r14 */
+    emit_byte (jit, 0xbe);                           /* mov esi, index */
+    emit_int32 (jit, insn->a);
+    emit_byte (jit, 0xba);                           /* mov edx, pc */
+    emit_int32 (jit, insn->pc);
+    emit_call (jit, ijvm_jit_builtin);
+    emit_mem (jit, FALSE, 0x8b, RAX, R14, offsetof (IJVM, sp));
+    emit_bytes (jit, 4, 0x4c, 0x8d, 0x24, 0x83);     /* lea r12, [rbx+rax*4] */
+    return;
+  }
+
+  address = (uint32) i->cpp[insn->a];
+  if ((int32 *) (i->method + address + 4) > i->cpp) {
+    emit_bailout (jit, insn->pc);
+    return;
+  }
+  nargs = i->method[address] * 256 + i->method[address + 1];
+  nlocals = i->method[address + 2] * 256 + i->method[address + 3];
+
+  /* Every IJVM call is a native call, so leave deep recursion to the
+   * interpreter before the C stack runs out. */
+  emit_bytes (jit, 3, 0x4c, 0x39, 0xfc);             /* cmp rsp, r15 */
+  emit_bytes (jit, 2, 0x73, 0);                      /* jae frame */
+  skip = jit->length;
+  emit_bailout (jit, insn->pc);
+  jit->buf[skip - 1] = jit->length - skip;
+
+  /* Check the frame once if its size is known, as
+   * ijvm_invoke_virtual does. */
+  if ((uint32) insn->a < i->nframes && i->frames[insn->a] > 0) {
+    emit_mem (jit, TRUE, 0x8d, RAX, R12, 4 * i->frames[insn->a]);
+    emit_bytes (jit, 2, 0x48, 0xb9);                 /* mov rcx, &stack[words] */
+    emit_int64 (jit, (unsigned long) (i->stack + i->memory_size / 4));
+    emit_bytes (jit, 3, 0x48, 0x39, 0xc8);           /* cmp rax, rcx */
+    emit_bytes (jit, 2, 0x72, 0);                    /* jb frame */
+    skip = jit->length;
+    emit_sync (jit);
+    emit_bytes (jit, 3, 0x4c, 0x89, 0xf7);           /* mov rdi, r14 */
+    emit_byte (jit, 0xbe);                           /* mov esi, index */
+    emit_int32 (jit, insn->a);
+    emit_byte (jit, 0xba);                           /* mov edx, pc */
+    emit_int32 (jit, insn->pc);
+    emit_call (jit, ijvm_jit_overflow);
+    jit->buf[skip - 1] = jit->length - skip;
+  }
+
+  /* Build the frame like ijvm_invoke_virtual. */
+  emit_mem (jit, FALSE, 0xc7, 0, R12, 4 * (nlocals + 1)); /* push return pc */
+  emit_int32 (jit, insn->pc + insn->length);
+  emit_index_of (jit, R13);                          /* push lv */
+  emit_mem (jit, FALSE, 0x89, RAX, R12, 4 * (nlocals + 2));
+  emit_adjust_sp (jit, nlocals + 2);
+  emit_mem (jit, TRUE, 0x8d, R13, R12, -4 * (nargs + nlocals + 1));
+  emit_index_of (jit, R12);                          /* stack[lv] = sp - 1 */
+  emit_bytes (jit, 3, 0x83, 0xe8, 0x01);
+  emit_mem (jit, FALSE, 0x89, RAX, R13, 0);
+
+  /* Call the method, compiling it on the first call. */
+  emit_bytes (jit, 2, 0x48, 0xb8);                   /* mov rax, &entries[index] */
+  emit_int64 (jit, (unsigned long) &jit->entries[insn->a]);
+  emit_bytes (jit, 3, 0x48, 0x8b, 0x00);             /* mov rax, [rax] */
+  emit_bytes (jit, 3, 0x48, 0x85, 0xc0);             /* test rax, rax */
+  emit_bytes (jit, 2, 0x75, 20);                     /* jnz call */
+  emit_bytes (jit, 3, 0x4c, 0x89, 0xf7);             /* mov rdi, r14 */
+  emit_byte (jit, 0xbe);                             /* mov esi, index */
+  emit_int32 (jit, insn->a);
+  emit_call (jit, ijvm_jit_lookup);
+  emit_bytes (jit, 2, 0xff, 0xd0);                   /* call: call rax */
+}
+
+static void
+emit_return (IJVMJit *jit)
+{
+  emit_mem (jit, FALSE, 0x8b, RAX, R13, 0);          /* eax = link ptr */
+  emit_bytes (jit, 3, 0x8b, 0x0c, 0x83);             /* pc = stack[link] */
+  emit_mem (jit, FALSE, 0x89, RCX, R14, offsetof (IJVM, pc));
+  emit_bytes (jit, 4, 0x8b, 0x4c, 0x83, 0x04);       /* ecx = stack[link + 1] */
+  emit_mem (jit, FALSE, 0x8b, RDX, R12, 0);          /* stack[lv] = top */
+  emit_mem (jit, FALSE, 0x89, RDX, R13, 0);
+  emit_bytes (jit, 3, 0x4d, 0x89, 0xec);             /* mov r12, r13 */
+  emit_bytes (jit, 4, 0x4c, 0x8d, 0x2c, 0x8b);       /* lv = ecx */
+  emit_bytes (jit, 4, 0x48, 0x83, 0xc4, 0x08);       /* add rsp, 8 */
+  emit_byte (jit, 0xc3);
+}
+
+/* Emit the template for one decoded instruction. */
+
+static void
+emit_insn (IJVMJit *jit, IJVM *i, IJVMCode *code, IJVMInsn *insn)
+{
+  switch (insn->op) {
+  case IJVM_OPCODE_BIPUSH:
+  case IJVM_OPCODE_LDC_W:
+    emit_mem (jit, FALSE, 0xc7, 0, R12, 4);
+    emit_int32 (jit, insn->a);
+    emit_adjust_sp (jit, 1);
+    break;
+
+  case IJVM_OPCODE_DUP:
+    emit_mem (jit, FALSE, 0x8b, RAX, R12, 0);
+    emit_mem (jit, FALSE, 0x89, RAX, R12, 4);
+    emit_adjust_sp (jit, 1);
+    break;
+
+  case IJVM_OPCODE_IADD:
+  case IJVM_OPCODE_ISUB:
+  case IJVM_OPCODE_IAND:
+  case IJVM_OPCODE_IOR:
+    emit_mem (jit, FALSE, 0x8b, RAX, R12, 0);
+    emit_adjust_sp (jit, -1);
+    emit_mem (jit, FALSE,
+	      insn->op == IJVM_OPCODE_IADD ? 0x01 :
+	      insn->op == IJVM_OPCODE_ISUB ? 0x29 :
+	      insn->op == IJVM_OPCODE_IAND ? 0x21 : 0x09,
+	      RAX, R12, 0);
+    break;
+
+  case IJVM_OPCODE_IFEQ:
+  case IJVM_OPCODE_IFLT:
+    emit_mem (jit, FALSE, 0x8b, RAX, R12, 0);
+    emit_adjust_sp (jit, -1);
+    emit_bytes (jit, 2, 0x85, 0xc0);                 /* test eax, eax */
+    emit_jump (jit, insn->op == IJVM_OPCODE_IFEQ ? 0x84 : 0x8c,
+	       insn->target - code->insns);
+    break;
+
+  case IJVM_OPCODE_IF_ICMPEQ:
+    emit_mem (jit, FALSE, 0x8b, RAX, R12, 0);
+    emit_adjust_sp (jit, -2);
+    emit_mem (jit, FALSE, 0x3b, RAX, R12, 4);
+    emit_jump (jit, 0x84, insn->target - code->insns);
+    break;
+
+  case IJVM_OPCODE_GOTO:
+  case IJVM_DECODED_JUMP:
+    emit_jump (jit, 0xe9, insn->target - code->insns);
+    break;
+
+  case IJVM_OPCODE_IINC:
+    emit_mem (jit, FALSE, 0x81, 0, R13, 4 * insn->a);
+    emit_int32 (jit, insn->b);
+    break;
+
+  case IJVM_OPCODE_ILOAD:
+    emit_mem (jit, FALSE, 0x8b, RAX, R13, 4 * insn->a);
+    emit_mem (jit, FALSE, 0x89, RAX, R12, 4);
+    emit_adjust_sp (jit, 1);
+    break;
+
+  case IJVM_OPCODE_ISTORE:
+    emit_mem (jit, FALSE, 0x8b, RAX, R12, 0);
+    emit_mem (jit, FALSE, 0x89, RAX, R13, 4 * insn->a);
+    emit_adjust_sp (jit, -1);
+    break;
+
+  case IJVM_OPCODE_INVOKEVIRTUAL:
+    emit_invoke (jit, i, insn);
+    break;
+
+  case IJVM_OPCODE_IRETURN:
+    emit_return (jit);
+    break;
+
+  case IJVM_OPCODE_POP:
+    emit_adjust_sp (jit, -1);
+    break;
+
+  case IJVM_OPCODE_SWAP:
+    emit_mem (jit, FALSE, 0x8b, RAX, R12, 0);
+    emit_mem (jit, FALSE, 0x8b, RCX, R12, -4);
+    emit_mem (jit, FALSE, 0x89, RCX, R12, 0);
+    emit_mem (jit, FALSE, 0x89, RAX, R12, -4);
+    break;
+
+  case IJVM_DECODED_EXIT:
+    emit_bailout (jit, insn->pc);
+    break;
+
+  default:
+    /* nop, wide and unknown opcodes */
+    break;
+  }
+}
+
+static bool
+ijvm_jit_falls_through (IJVMInsn *insn)
+{
+  switch (insn->op) {
+  case IJVM_OPCODE_GOTO:
+  case IJVM_OPCODE_IRETURN:
+  case IJVM_DECODED_JUMP:
+  case IJVM_DECODED_EXIT:
+    return FALSE;
+  default:
+    return TRUE;
+  }
+}
+
+/* Copy the method just emitted into executable memory.  Chunks are
+ * mapped writable but not executable, and the pages the method goes
+ * to are made writable for the copy and executable again after it, so
+ * no page is ever both; the code calling the compiler may be on one
+ * of them, but doesn't run until the copy is done. */
+
+static void *
+ijvm_jit_install (IJVMJit *jit)
+{
+  void *code;
+  uint8 *chunk;
+  unsigned long page, start, end;
+
+  if (jit->chunk == NULL || jit->chunk_used + jit->length > jit->chunk_size) {
+    jit->chunk_size = MAX (JIT_CHUNK_SIZE, jit->length + 16);
+    chunk = mmap (NULL, jit->chunk_size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED) {
+      fprintf (stderr, "Couldn't allocate memory for compiled code\n");
+      exit (-1);
+    }
+    ((IJVMJitChunk *) chunk)->previous = jit->chunk;
+    ((IJVMJitChunk *) chunk)->size = jit->chunk_size;
+    jit->chunk = chunk;
+    jit->chunk_used = 16;
+  }
+
+  code = jit->chunk + jit->chunk_used;
+  page = sysconf (_SC_PAGESIZE);
+  start = (unsigned long) code & ~(page - 1);
+  end = ((unsigned long) code + jit->length + page - 1) & ~(page - 1);
+  if (mprotect ((void *) start, end - start, PROT_READ | PROT_WRITE) != 0) {
+    fprintf (stderr, "Couldn't write compiled code\n");
+    exit (-1);
+  }
+  memcpy (code, jit->buf, jit->length);
+  if (mprotect ((void *) start, end - start, PROT_READ | PROT_EXEC) != 0) {
+    fprintf (stderr, "Couldn't make compiled code executable\n");
+    exit (-1);
+  }
+  jit->chunk_used += (jit->length + 15) & ~15;
+  jit->code_size += jit->length;
+
+  return code;
+}
+
+/* Compile the method whose first instruction is at method area offset
+ * entry: everything reachable from there without following
+ * invokevirtual. */
+
+static void *
+ijvm_jit_compile (IJVM *i, uint32 entry)
+{
+  IJVMJit *jit;
+  IJVMCode *code;
+  IJVMInsn *insn, **work;
+  IJVMJitFixup *fixup;
+  IJVMJitMethod *method;
+  uint8 *reached;
+  int k, nwork;
+
+  jit = i->jit;
+  code = i->code;
+  if (entry < code->size && jit->compiled[entry] != NULL)
+    return jit->compiled[entry];
+
+  jit->length = 0;
+  jit->nfixups = 0;
+  emit_bytes (jit, 4, 0x48, 0x83, 0xec, 0x08);       /* sub rsp, 8 */
+
+  insn = ijvm_code_lookup (code, entry);
+  if (insn == NULL) {
+    emit_bailout (jit, entry);
+    return ijvm_jit_install (jit);
+  }
+
+  reached = calloc (code->ninsns, 1);
+  work = malloc (code->ninsns * sizeof (IJVMInsn *));
+  nwork = 0;
+  work[nwork++] = insn;
+  reached[insn - code->insns] = TRUE;
+  while (nwork > 0) {
+    insn = work[--nwork];
+    if (insn->target != NULL && !reached[insn->target - code->insns]) {
+      reached[insn->target - code->insns] = TRUE;
+      work[nwork++] = insn->target;
+    }
+    if (ijvm_jit_falls_through (insn) && !reached[insn + 1 - code->insns]) {
+      reached[insn + 1 - code->insns] = TRUE;
+      work[nwork++] = insn + 1;
+    }
+  }
+
+  /* The entry need not be the first instruction reached in method
+   * area order, so start with a jump to it. */
+  insn = ijvm_code_lookup (code, entry);
+  emit_jump (jit, 0xe9, insn - code->insns);
+
+  method = calloc (1, sizeof (IJVMJitMethod));
+  for (k = 0; k < code->ninsns; k++)
+    if (reached[k])
+      method->ninsns++;
+  method->offsets = malloc (method->ninsns * sizeof (int));
+  method->pcs = malloc (method->ninsns * sizeof (uint32));
+  method->ninsns = 0;
+  for (k = 0; k < code->ninsns; k++)
+    if (reached[k]) {
+      jit->labels[k] = jit->length;
+      method->offsets[method->ninsns] = jit->length;
+      method->pcs[method->ninsns++] = code->insns[k].pc;
+      emit_insn (jit, i, code, &code->insns[k]);
+    }
+
+  for (k = 0; k < jit->nfixups; k++) {
+    fixup = &jit->fixups[k];
+    *(int32 *) (jit->buf + fixup->offset) =
+      jit->labels[fixup->target] - (fixup->offset + 4);
+  }
+
+  free (work);
+  free (reached);
+
+  jit->compiled[entry] = ijvm_jit_install (jit);
+  jit->ncompiled++;
+  method->code = jit->compiled[entry];
+  method->length = jit->length;
+  method->next = jit->methods;
+  jit->methods = method;
+
+  return jit->compiled[entry];
+}
+
+static void *
+ijvm_jit_lookup (IJVM *i, uint32 index)
+{
+  void *native;
+
+  native = ijvm_jit_compile (i, i->cpp[index] + 4);
+  i->jit->entries[index] = native;
+
+  return native;
+}
+
+/* The trampoline from C into compiled code: save the callee saved
+ * registers, load the IJVM registers and call the method. */
+
+static void
+ijvm_jit_emit_enter (IJVMJit *jit)
+{
+  jit->length = 0;
+  emit_bytes (jit, 2, 0x53, 0x55);                   /* push rbx, rbp */
+  emit_bytes (jit, 8, 0x41, 0x54, 0x41, 0x55,        /* push r12-r15 */
+	      0x41, 0x56, 0x41, 0x57);
+  emit_bytes (jit, 4, 0x48, 0x83, 0xec, 0x08);       /* sub rsp, 8 */
+  emit_bytes (jit, 3, 0x49, 0x89, 0xfe);             /* mov r14, rdi */
+  emit_mem (jit, TRUE, 0x8b, R15, RDI, offsetof (IJVM, jit));
+  emit_mem (jit, TRUE, 0x8b, R15, R15, offsetof (IJVMJit, stack_limit));
+  emit_mem (jit, TRUE, 0x8b, RBX, RDI, offsetof (IJVM, stack));
+  emit_mem (jit, FALSE, 0x8b, RAX, RDI, offsetof (IJVM, sp));
+  emit_bytes (jit, 4, 0x4c, 0x8d, 0x24, 0x83);       /* lea r12, [rbx+rax*4] */
+  emit_mem (jit, FALSE, 0x8b, RAX, RDI, offsetof (IJVM, lv));
+  emit_bytes (jit, 4, 0x4c, 0x8d, 0x2c, 0x83);       /* lea r13, [rbx+rax*4] */
+  emit_bytes (jit, 2, 0xff, 0xd6);                   /* call rsi */
+  emit_sync (jit);
+  emit_bytes (jit, 4, 0x48, 0x83, 0xc4, 0x08);       /* add rsp, 8 */
+  emit_bytes (jit, 8, 0x41, 0x5f, 0x41, 0x5e,        /* pop r15-r12 */
+	      0x41, 0x5d, 0x41, 0x5c);
+  emit_bytes (jit, 3, 0x5d, 0x5b, 0xc3);             /* pop rbp, rbx; ret */
+  jit->enter = (IJVMJitEntry) ijvm_jit_install (jit);
+}
+
+/* Run the program in i with compiled code, from the invocation of a
+ * method that ijvm_new or the interpreter has set up.  The run ends
+ * when that method returns or when the compiled code bails out; in
+ * both cases the IJVM registers are up to date afterwards.  Returns
+ * FALSE if there's no JIT for this platform. */
+
+bool
+ijvm_run_jit (IJVM *i)
+{
+  IJVMJit *jit;
+  void *native;
+  struct rlimit limit;
+  rlim_t budget;
+
+  if (i->jit == NULL) {
+    jit = calloc (1, sizeof (IJVMJit));
+    jit->compiled = calloc (i->code->size + 1, sizeof (void *));
+    jit->entries = calloc (0x8000, sizeof (void *));
+    jit->labels = malloc ((i->code->ninsns + 1) * sizeof (int));
+    i->jit = jit;
+    ijvm_jit_emit_enter (jit);
+  }
+
+  if (!ijvm_active (i))
+    return TRUE;
+
+  /* Compiled code may use half of what's left of the C stack. */
+  budget = 4 << 20;
+  if (getrlimit (RLIMIT_STACK, &limit) == 0)
+    budget = limit.rlim_cur == RLIM_INFINITY ? 256 << 20 : limit.rlim_cur / 2;
+  i->jit->stack_limit = (char *) &limit - budget;
+
+  native = ijvm_jit_compile (i, i->pc);
+  if (setjmp (i->jit->bailout) == 0)
+    i->jit->enter (i, native);
+  i->wide = FALSE;
+
+  return TRUE;
+}
+
+/* Called by ijvm_fault with the machine context of a fault: if the
+ * fault was in compiled code, set the PC and SP for the report from
+ * the template rip is in and r12. */
+
+void
+ijvm_jit_fault (IJVM *i, void *context)
+{
+  IJVMJitMethod *method;
+  greg_t *registers;
+  uint8 *rip;
+  int low, high, middle;
+
+  registers = ((ucontext_t *) context)->uc_mcontext.gregs;
+  rip = (uint8 *) registers[REG_RIP];
+  for (method = i->jit->methods; method != NULL; method = method->next)
+    if (method->code <= rip && rip < method->code + method->length)
+      break;
+  if (method == NULL || method->ninsns == 0 ||
+      rip - method->code < method->offsets[0])
+    return;
+
+  /* The last template starting at or before rip */
+  low = 0;
+  high = method->ninsns - 1;
+  while (low < high) {
+    middle = (low + high + 1) / 2;
+    if (method->offsets[middle] <= rip - method->code)
+      low = middle;
+    else
+      high = middle - 1;
+  }
+  i->insn_pc = method->pcs[low];
+  i->insn_sp = (int32 *) registers[REG_R12] - i->stack;
+}
+
+void
+ijvm_jit_free (IJVMJit *jit)
+{
+  IJVMJitChunk *chunk;
+  IJVMJitMethod *method;
+
+  while (jit->chunk != NULL) {
+    chunk = (IJVMJitChunk *) jit->chunk;
+    jit->chunk = chunk->previous;
+    munmap (chunk, chunk->size);
+  }
+  while (jit->methods != NULL) {
+    method = jit->methods;
+    jit->methods = method->next;
+    free (method->offsets);
+    free (method->pcs);
+    free (method);
+  }
+  free (jit->compiled);
+  free (jit->entries);
+  free (jit->buf);
+  free (jit->labels);
+  free (jit->fixups);
+  free (jit);
+}
+
+void
+ijvm_jit_print_statistics (IJVM *i)
+{
+  if (i->jit != NULL)
+    fprintf (stderr, "methods compiled: %u (%u bytes of code)\n",
+	     i->jit->ncompiled, i->jit->code_size);
+}
+
+#else
+
+bool
+ijvm_run_jit (IJVM *i)
+{
+  return FALSE;
+}
+
+void
+ijvm_jit_fault (IJVM *i, void *context)
+{
+}
+
+void
+ijvm_jit_free (IJVMJit *jit)
+{
+}
+
+void
+ijvm_jit_print_statistics (IJVM *i)
+{
+}
+
+#endif
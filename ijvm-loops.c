@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ijvm.h"
+
+/* ijvm-loops.c
+ *
+ * The threaded engine with hot loop traces.  Every taken backward
+ * branch goes through an IJVM_DECODED_LOOP in front of its target,
+ * which counts an entry of the loop starting there.  When a loop has
+ * been entered IJVM_LOOP_THRESHOLD times, the threaded engine leaves
+ * at its head, and the switch engine runs the next iteration,
+ * recording the instructions.  If the iteration gets back to the
+ * loop head, the recording is compiled to a trace: a straight line of
+ * decoded instructions in which the gotos are gone and the
+ * conditional branches are guards, that stay on the trace when the
+ * branch goes the way it went when recorded.  The trace is added to
+ * the decoded code, and the branches to the loop head go to the trace
+ * instead.
+ *
+ * The threaded engine runs the traces like any other decoded code.
+ * When a guard fails, it takes a side exit: a jump to where the
+ * branch goes in the decoded code, which the engine carries on with
+ * until the next iteration enters the trace again.  So a loop whose
+ * branches go both ways runs at the speed of the threaded engine, and
+ * the iterations that follow the trace save a dispatch for each goto
+ * and use superinstructions across the branches.
+ *
+ * Iterations calling a method other than a builtin aren't traced, nor
+ * are loops whose iteration is longer than IJVM_LOOP_MAX_LENGTH
+ * instructions; the recording is given up, and the loop is never
+ * recorded again.  A trace ends at a call of a builtin, after which
+ * the iteration goes on in the decoded code. */
+
+#define IJVM_LOOP_THRESHOLD   1000
+#define IJVM_LOOP_MAX_LENGTH  256
+
+typedef struct IJVMLoop IJVMLoop;
+struct IJVMLoop
+{
+  uint32 pc;            /* Loop head */
+  IJVMInsn *insns;      /* Trace, then its side exits */
+  int ninsns;
+  int length;           /* Recorded instructions per iteration */
+  int guards;
+
+  IJVMLoop *next;
+};
+
+struct IJVMLoops
+{
+  IJVMInsn *plain;      /* The decoded code before it was fused */
+  IJVMInsn **heads;     /* The IJVM_DECODED_LOOP by loop head */
+  IJVMInsn *counters;   /* All of them */
+  IJVMSuperInsn **supers;  /* For ijvm_code_fuse */
+  IJVMLoop *list, **last;
+
+  bool skip;
+  uint32 recorded[IJVM_LOOP_MAX_LENGTH];
+  int nrecorded;
+};
+
+/* Return TRUE if insn, a branch or a superinstruction ending in one,
+ * branches back to decoded code. */
+
+static bool
+ijvm_loops_is_backward (IJVMInsn *insn)
+{
+  return (insn->target != NULL && insn->op != IJVM_DECODED_JUMP &&
+	  insn->target->op < IJVM_DECODED_JUMP &&
+	  insn->target->pc <= insn->pc);
+}
+
+/* Return the instruction at pc as it was decoded, or NULL. */
+
+static IJVMInsn *
+ijvm_loops_lookup (IJVMLoops *loops, IJVMCode *code, uint32 pc)
+{
+  IJVMInsn *insn;
+
+  insn = ijvm_code_lookup (code, pc);
+  return insn != NULL ? &loops->plain[insn - code->insns] : NULL;
+}
+
+/* Make every backward branch in code go through an
+ * IJVM_DECODED_LOOP in front of its target, one per loop head. */
+
+static void
+ijvm_loops_count (IJVMLoops *loops, IJVMCode *code)
+{
+  IJVMInsn *insn, *counter;
+  int k, n;
+
+  n = 0;
+  for (k = 0; k < code->ninsns; k++)
+    if (ijvm_loops_is_backward (&code->insns[k]))
+      n++;
+  loops->counters = calloc (MAX (n, 1), sizeof (IJVMInsn));
+
+  n = 0;
+  for (k = 0; k < code->ninsns; k++) {
+    insn = &code->insns[k];
+    if (!ijvm_loops_is_backward (insn))
+      continue;
+    counter = loops->heads[insn->target->pc];
+    if (counter == NULL) {
+      counter = &loops->counters[n++];
+      counter->op = IJVM_DECODED_LOOP;
+      counter->pc = insn->target->pc;
+      counter->target = insn->target;
+      counter->b = IJVM_LOOP_THRESHOLD;
+      counter->reserve = insn->target->reserve;
+      loops->heads[counter->pc] = counter;
+    }
+    insn->target = counter;
+  }
+  ijvm_code_add (code, loops->counters, n);
+}
+
+/* Make the IJVM_DECODED_LOOP at the head of a loop an
+ * IJVM_DECODED_JUMP to target. */
+
+static void
+ijvm_loops_jump (IJVMCode *code, IJVMInsn *counter, IJVMInsn *target)
+{
+  counter->op = IJVM_DECODED_JUMP;
+  counter->target = target;
+  if (code->linked != NULL)
+    counter->handler = code->linked[IJVM_DECODED_JUMP];
+}
+
+/* Set insn to leave the trace for the decoded code at pc. */
+
+static void
+ijvm_loops_exit (IJVMInsn *insn, IJVMCode *code, uint32 pc)
+{
+  memset (insn, 0, sizeof (IJVMInsn));
+  insn->pc = pc;
+  insn->target = ijvm_code_lookup (code, pc);
+  insn->op = insn->target != NULL ? IJVM_DECODED_JUMP : IJVM_DECODED_EXIT;
+}
+
+/* Turn the recorded iteration of the loop at head into a trace.  A
+ * guard that was taken when recorded branches to the rest of the
+ * trace, and falls through to its side exit; one that wasn't
+ * branches to a side exit after the trace.  The trace is counted for
+ * the budget and fused as decoded code is. */
+
+static IJVMLoop *
+ijvm_loops_compile (IJVMLoops *loops, IJVMCode *code, uint32 head)
+{
+  IJVMLoop *loop;
+  IJVMInsn *insn, *trace;
+  IJVMCode fused;
+  uint32 next;
+  int *exits, j, n, nexits;
+  bool ended;
+
+  loop = calloc (1, sizeof (IJVMLoop));
+  loop->pc = head;
+  loop->length = loops->nrecorded;
+  loop->insns = calloc (2 * loops->nrecorded + 1, sizeof (IJVMInsn));
+  exits = malloc (loops->nrecorded * sizeof (int));
+
+  trace = loop->insns;
+  n = 0;
+  nexits = 0;
+  ended = FALSE;
+  for (j = 0; j < loops->nrecorded && !ended; j++) {
+    insn = ijvm_loops_lookup (loops, code, loops->recorded[j]);
+    next = j + 1 < loops->nrecorded ? loops->recorded[j + 1] : head;
+
+    switch (insn->op) {
+    case IJVM_OPCODE_GOTO:
+    case IJVM_OPCODE_NOP:
+    case IJVM_OPCODE_WIDE:
+      continue;
+
+    case IJVM_OPCODE_IFEQ:
+    case IJVM_OPCODE_IFLT:
+    case IJVM_OPCODE_IF_ICMPEQ:
+      trace[n] = *insn;
+      loop->guards++;
+      if (next == (uint32) insn->a) {
+	trace[n].target = &trace[n + 2];
+	ijvm_loops_exit (&trace[n + 1], code, insn->pc + insn->length);
+	n += 2;
+      }
+      else
+	exits[nexits++] = n++;
+      continue;
+
+    case IJVM_OPCODE_INVOKEVIRTUAL:
+      ended = TRUE;
+      break;
+    }
+    trace[n++] = *insn;
+  }
+
+  if (!ended) {
+    trace[n].op = IJVM_DECODED_JUMP;
+    trace[n].pc = head;
+    trace[n].target = trace;
+    n++;
+  }
+  for (j = 0; j < nexits; j++) {
+    insn = &trace[exits[j]];
+    ijvm_loops_exit (&trace[n], code, insn->a);
+    insn->target = &trace[n++];
+  }
+  loop->ninsns = n;
+
+  ijvm_code_count (trace, n);
+  fused.insns = trace;
+  fused.ninsns = n;
+  ijvm_code_fuse (&fused, loops->supers);
+  ijvm_code_add (code, trace, n);
+  free (exits);
+
+  *loops->last = loop;
+  loops->last = &loop->next;
+
+  return loop;
+}
+
+/* Record the instruction at pc, which is about to be executed.
+ * Returns FALSE if it can't be traced. */
+
+static bool
+ijvm_loops_record (IJVMLoops *loops, IJVMCode *code, uint32 pc)
+{
+  IJVMInsn *insn;
+
+  /* The iload or istore of a folded wide */
+  if (loops->skip) {
+    loops->skip = FALSE;
+    return TRUE;
+  }
+
+  insn = ijvm_loops_lookup (loops, code, pc);
+  if (insn == NULL || loops->nrecorded == IJVM_LOOP_MAX_LENGTH)
+    return FALSE;
+
+  switch (insn->op) {
+  case IJVM_OPCODE_INVOKEVIRTUAL:
+    if (insn->a < 0x8000)
+      return FALSE;
+    break;
+
+  case IJVM_OPCODE_IRETURN:
+  case IJVM_DECODED_EXIT:
+    return FALSE;
+  }
+
+  loops->skip = insn->length == 4;
+  loops->recorded[loops->nrecorded++] = pc;
+
+  return TRUE;
+}
+
+/* Run an iteration of the loop at i->pc with the switch engine,
+ * recording it, and trace the loop if it can be traced.  If the
+ * budget runs out first, the loop is recorded the next time it is
+ * entered. */
+
+static void
+ijvm_loops_trace (IJVM *i, IJVMLoops *loops)
+{
+  IJVMCode *code;
+  IJVMInsn *counter;
+  IJVMLoop *loop;
+  uint32 head;
+
+  code = i->code;
+  head = i->pc;
+  counter = loops->heads[head];
+  loops->nrecorded = 0;
+  loops->skip = FALSE;
+
+  do {
+    if (i->budget <= 0) {
+      counter->b = 1;
+      return;
+    }
+    if (!ijvm_loops_record (loops, code, i->pc)) {
+      ijvm_loops_jump (code, counter, counter->target);
+      return;
+    }
+    ijvm_execute_opcode (i);
+    i->budget--;
+  } while (ijvm_active (i) && (i->pc != head || loops->skip));
+
+  if (!ijvm_active (i))
+    return;
+  loop = ijvm_loops_compile (loops, code, head);
+  ijvm_loops_jump (code, counter, loop->insns);
+}
+
+/* Run the program in i with the decoded code in i->code, see above,
+ * as far as the threaded engine goes.  The code is fused with supers,
+ * as by ijvm_code_fuse, and so are the traces.  The loop statistics
+ * are kept in i for ijvm_loops_print_statistics. */
+
+void
+ijvm_run_loops (IJVM *i, IJVMSuperInsn **supers)
+{
+  IJVMLoops *loops;
+  IJVMCode *code;
+  IJVMInsn *counter;
+
+  code = i->code;
+  loops = calloc (1, sizeof (IJVMLoops));
+  loops->plain = malloc (MAX (code->ninsns, 1) * sizeof (IJVMInsn));
+  memcpy (loops->plain, code->insns, code->ninsns * sizeof (IJVMInsn));
+  ijvm_code_fuse (code, supers);
+  loops->heads = calloc (code->size + 1, sizeof (IJVMInsn *));
+  loops->supers = supers;
+  loops->last = &loops->list;
+  i->loops = loops;
+  ijvm_loops_count (loops, code);
+
+  for (;;) {
+    ijvm_run_threaded (i, FALSE);
+    if (!ijvm_active (i) || i->pc >= code->size)
+      return;
+    counter = loops->heads[i->pc];
+    if (counter == NULL || counter->op != IJVM_DECODED_LOOP ||
+	counter->b != 0)
+      return;
+    ijvm_loops_trace (i, loops);
+  }
+}
+
+void
+ijvm_loops_free (IJVMLoops *loops)
+{
+  IJVMLoop *loop;
+
+  while (loops->list != NULL) {
+    loop = loops->list;
+    loops->list = loop->next;
+    free (loop->insns);
+    free (loop);
+  }
+  free (loops->plain);
+  free (loops->heads);
+  free (loops->counters);
+  free (loops);
+}
+
+/* Print the loops traced. */
+
+void
+ijvm_loops_print_statistics (IJVM *i)
+{
+  IJVMLoop *loop;
+
+  if (i->loops == NULL)
+    return;
+
+  for (loop = i->loops->list; loop != NULL; loop = loop->next)
+    fprintf (stderr, "loop at 0x%04x: %d instructions traced, "
+	     "%d guards, %d decoded instructions\n",
+	     loop->pc, loop->length, loop->guards, loop->ninsns);
+}
@@ -0,0 +1,711 @@
+#include <stdlib.h> 	/* for malloc, strtol and exit */
+#include <stdio.h>      /* for FILE, stdin, stdout, fprintf, printf
+                         * and fopen */
+#include <string.h>     /* for strcmp */
+#include <time.h>   	/* for time_t, time and ctime */
+#include <unistd.h>     /* for STDIN_FILENO */
+#include <limits.h>     /* for LONG_MAX */
+#include "ijvm.h"
+
+/* ijvm-main.c
+ *
+ * The ijvm program: options, the choice of engine and the reports at
+ * the end of a run.  The interpreter itself is in ijvm.c. */
+
+static struct { char *name; IJVMEngine engine; } ijvm_engines[] =
+{
+  { "switch",   IJVM_ENGINE_SWITCH },
+  { "threaded", IJVM_ENGINE_THREADED },
+  { "tos",      IJVM_ENGINE_TOS },
+  { "jit",      IJVM_ENGINE_JIT },
+  { "hot",      IJVM_ENGINE_HOT },
+  { NULL, 0 }
+};
+
+static void
+ijvm_print_result (IJVM *i)
+{
+  printf ("return value: %d\n", i->stack[i->sp]);
+  if (i->sink != NULL)
+    ijvm_sink_printf (i->sink, "return value: %d\n", i->stack[i->sp]);
+}
+
+static void
+ijvm_print_statistics (IJVM *i)
+{
+  fprintf (stderr, "dispatches eliminated by superinstructions: %lu\n",
+	   i->fused_dispatches);
+  ijvm_jit_print_statistics (i);
+  ijvm_loops_print_statistics (i);
+  fprintf (stderr, "memory resident: %lu KB of %lu KB\n",
+	   ijvm_memory_resident (i->method) >> 10, i->memory_size >> 10);
+}
+
+static IJVMEngine
+ijvm_engine_lookup (char *name)
+{
+  int j;
+
+  for (j = 0; ijvm_engines[j].name != NULL; j++)
+    if (strcmp (name, ijvm_engines[j].name) == 0)
+      return ijvm_engines[j].engine;
+
+  fprintf (stderr, "Unknown engine: `%s'\n", name);
+  exit (-1);
+  return 0;
+}
+
+/* Run the program in i with engine, as far as the engine goes.  What
+ * is left of the run is up to the caller, to finish with
+ * ijvm_execute_opcode. */
+
+void
+ijvm_run_engine (IJVM *i, IJVMImage *image, IJVMEngine engine,
+		 IJVMSuperInsn **supers, bool verbose)
+{
+  switch (engine) {
+  case IJVM_ENGINE_SWITCH:
+    break;
+
+  case IJVM_ENGINE_THREADED:
+    i->code = ijvm_code_decode (image);
+    if (!verbose) {
+      ijvm_code_fuse (i->code, supers);
+      ijvm_code_bind (i, image);
+    }
+    ijvm_run_threaded (i, verbose);
+    break;
+
+  case IJVM_ENGINE_TOS:
+    i->code = ijvm_code_decode (image);
+    if (!verbose) {
+      ijvm_code_fuse (i->code, supers);
+      ijvm_code_bind (i, image);
+    }
+    ijvm_run_tos (i, verbose);
+    break;
+
+  case IJVM_ENGINE_JIT:
+    /* Compiled code can't be traced; the threaded engine does that,
+     * and finishes the run if the compiled code bails out. */
+    i->code = ijvm_code_decode (image);
+    if (!verbose && !ijvm_run_jit (i))
+      fprintf (stderr, "No JIT compiler for this platform, using the threaded engine\n");
+    ijvm_run_threaded (i, verbose);
+    break;
+
+  case IJVM_ENGINE_HOT:
+    /* Traced runs are left to the switch engine below. */
+    if (!verbose) {
+      i->code = ijvm_code_decode (image);
+      ijvm_run_loops (i, supers);
+    }
+    break;
+  }
+}
+
+int 
+main (int argc, char *argv[])
+{
+  FILE *file;
+  IJVMImage *image;
+  IJVM *i;
+  IJVMEngine engine;
+  IJVMSuperInsn **supers;
+  FILE *pair_file, *profile_file, *coverage_file;
+  IJVMSink *sink;
+  IJVMSpec *spec;
+  IJVMProfile *profile;
+  IJVMCoverage *coverage;
+  unsigned long *pairs, memory_size, estimate;
+  int32 *args;
+  char *end_ptr, error[IJVM_ERROR_SIZE], why[IJVM_ERROR_SIZE];
+  char *batch, *checkpoint, *restore, *lines;
+  unsigned long checkpoint_at, steps, limit;
+  long input, output;
+  int verbose, statistics, verify, memo, cache, previous, nargs, invalid, j;
+  int nthreads, tail_calls;
+  bool memory_given;
+  uint8 opcode;
+  char *time_string;
+  time_t t;
+
+  spec = ijvm_print_init (&argc, argv);
+
+  verbose = TRUE;
+  statistics = FALSE;
+  verify = FALSE;
+  memo = FALSE;
+  cache = TRUE;
+  tail_calls = TRUE;
+  engine = IJVM_ENGINE_SWITCH;
+  supers = NULL;
+  pair_file = NULL;
+  sink = NULL;
+  pairs = NULL;
+  memory_size = IJVM_MEMORY_SIZE;
+  memory_given = FALSE;
+  batch = NULL;
+  nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+  checkpoint = NULL;
+  checkpoint_at = 0;
+  restore = NULL;
+  limit = 0;
+  profile_file = NULL;
+  profile = NULL;
+  coverage_file = NULL;
+  coverage = NULL;
+  lines = NULL;
+
+  while (argc > 1) {
+
+    if (strcmp (argv[1], "-s") == 0) {
+      verbose = FALSE;
+      argv = argv + 1;
+      argc = argc - 1;
+      continue;
+    }
+
+    if (strcmp (argv[1], "-e") == 0) {
+      if (argc > 2)
+	engine = ijvm_engine_lookup (argv[2]);
+      else {
+	fprintf (stderr, "Option -e requires an argument\n");
+	exit (-1);
+      }
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "--verify") == 0) {
+      verify = TRUE;
+      argv = argv + 1;
+      argc = argc - 1;
+      continue;
+    }
+
+    if (strcmp (argv[1], "--memo") == 0) {
+      memo = TRUE;
+      argv = argv + 1;
+      argc = argc - 1;
+      continue;
+    }
+
+    if (strcmp (argv[1], "--no-cache") == 0) {
+      cache = FALSE;
+      argv = argv + 1;
+      argc = argc - 1;
+      continue;
+    }
+
+    if (strcmp (argv[1], "--no-tail-calls") == 0) {
+      tail_calls = FALSE;
+      argv = argv + 1;
+      argc = argc - 1;
+      continue;
+    }
+
+    if (strcmp (argv[1], "-S") == 0) {
+      statistics = TRUE;
+      argv = argv + 1;
+      argc = argc - 1;
+      continue;
+    }
+
+    if (strcmp (argv[1], "-m") == 0 || strcmp (argv[1], "--memory") == 0) {
+      if (argc < 3) {
+	fprintf (stderr, "Option %s requires an argument\n", argv[1]);
+	exit (-1);
+      }
+      memory_size = ijvm_memory_parse_size (argv[2]);
+      if (memory_size == 0) {
+	fprintf (stderr, "Invalid memory size: `%s'\n", argv[2]);
+	exit (-1);
+      }
+      memory_given = TRUE;
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "-l") == 0 || strcmp (argv[1], "--limit") == 0) {
+      if (argc < 3) {
+	fprintf (stderr, "Option %s requires an argument\n", argv[1]);
+	exit (-1);
+      }
+      limit = strtoul (argv[2], &end_ptr, 0);
+      if (*end_ptr != '\0' || limit == 0 || limit > LONG_MAX) {
+	fprintf (stderr, "Invalid instruction limit: `%s'\n", argv[2]);
+	exit (-1);
+      }
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "--batch") == 0) {
+      if (argc < 3) {
+	fprintf (stderr, "Option --batch requires an argument\n");
+	exit (-1);
+      }
+      batch = argv[2];
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "-j") == 0) {
+      if (argc < 3) {
+	fprintf (stderr, "Option -j requires an argument\n");
+	exit (-1);
+      }
+      nthreads = atoi (argv[2]);
+      if (nthreads < 1) {
+	fprintf (stderr, "Invalid number of threads: `%s'\n", argv[2]);
+	exit (-1);
+      }
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "--checkpoint") == 0 ||
+	strcmp (argv[1], "--restore") == 0) {
+      if (argc < 3) {
+	fprintf (stderr, "Option %s requires an argument\n", argv[1]);
+	exit (-1);
+      }
+      if (strcmp (argv[1], "--checkpoint") == 0)
+	checkpoint = argv[2];
+      else
+	restore = argv[2];
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "--profile") == 0) {
+      if (argc < 3) {
+	fprintf (stderr, "Option --profile requires an argument\n");
+	exit (-1);
+      }
+      profile_file = fopen (argv[2], "w");
+      if (profile_file == NULL) {
+	fprintf (stderr, "Couldn't open `%s' for writing.\n", argv[2]);
+	exit (-1);
+      }
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "--coverage") == 0) {
+      if (argc < 3) {
+	fprintf (stderr, "Option --coverage requires an argument\n");
+	exit (-1);
+      }
+      coverage_file = fopen (argv[2], "w");
+      if (coverage_file == NULL) {
+	fprintf (stderr, "Couldn't open `%s' for writing.\n", argv[2]);
+	exit (-1);
+      }
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "--lines") == 0) {
+      if (argc < 3) {
+	fprintf (stderr, "Option --lines requires an argument\n");
+	exit (-1);
+      }
+      lines = argv[2];
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "--checkpoint-at") == 0) {
+      if (argc < 3) {
+	fprintf (stderr, "Option --checkpoint-at requires an argument\n");
+	exit (-1);
+      }
+      if (strcmp (argv[2], "input") == 0)
+	checkpoint_at = 0;
+      else {
+	checkpoint_at = strtoul (argv[2], &end_ptr, 0);
+	if (*end_ptr != '\0' || checkpoint_at == 0) {
+	  fprintf (stderr, "Invalid checkpoint: `%s'\n", argv[2]);
+	  exit (-1);
+	}
+      }
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "-T") == 0) {
+      if (argc < 3) {
+	fprintf (stderr, "Option -T requires an argument\n");
+	exit (-1);
+      }
+      file = fopen (argv[2], "wb");
+      if (file == NULL) {
+	fprintf (stderr, "Couldn't open `%s' for writing.\n", argv[2]);
+	exit (-1);
+      }
+      sink = ijvm_sink_new (file, spec);
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "-P") == 0 || strcmp (argv[1], "-F") == 0) {
+      if (argc < 3) {
+	fprintf (stderr, "Option %s requires an argument\n", argv[1]);
+	exit (-1);
+      }
+      if (strcmp (argv[1], "-P") == 0) {
+	pair_file = fopen (argv[2], "w");
+	if (pair_file == NULL) {
+	  fprintf (stderr, "Couldn't open `%s' for writing.\n", argv[2]);
+	  exit (-1);
+	}
+      }
+      else {
+	file = fopen (argv[2], "r");
+	if (file == NULL) {
+	  fprintf (stderr, "Couldn't read pair profile `%s'.\n", argv[2]);
+	  exit (-1);
+	}
+	supers = ijvm_super_insns_from_profile (file);
+	fclose (file);
+      }
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+    break;
+  }
+
+  if (argc < 2) {
+    fprintf (stderr, "Usage: ijvm [OPTION] FILENAME [PARAMETERS ...]\n\n");
+    fprintf (stderr, "Where OPTION is\n\n");
+    fprintf (stderr, "  -s            Silent mode.  No snapshot is produced.\n");
+    fprintf (stderr, "  -f SPEC-FILE  The IJVM specification file to use, instead of the\n");
+    fprintf (stderr, "                one built in.\n");
+    fprintf (stderr, "  -e ENGINE     Interpreter engine: `switch' (default), `threaded',\n");
+    fprintf (stderr, "                `tos', `hot' (hot loop traces) or `jit' (x86-64\n");
+    fprintf (stderr, "                Linux only).\n");
+    fprintf (stderr, "  -S            Print execution statistics on stderr.  The memory\n");
+    fprintf (stderr, "                resident is what the host has in core at exit, not\n");
+    fprintf (stderr, "                the most the program used.\n");
+    fprintf (stderr, "  --verify      Check the program before running it, and refuse to run\n");
+    fprintf (stderr, "                it if it fails; see ijvm-verify.c.  The threaded and tos\n");
+    fprintf (stderr, "                engines run the calls of a verified program unchecked.\n");
+    fprintf (stderr, "  --memo        Keep the results of calls of pure methods, those that\n");
+    fprintf (stderr, "                depend on nothing but their arguments, and look them up\n");
+    fprintf (stderr, "                instead of calling again; see ijvm-memo.c.  Implies\n");
+    fprintf (stderr, "                --verify and the switch engine.\n");
+    fprintf (stderr, "  --no-cache    Leave out the cache of verified programs.  A program\n");
+    fprintf (stderr, "                that passes --verify is kept in $XDG_CACHE_HOME/ijvm\n");
+    fprintf (stderr, "                with its stack sizes, and later runs of it with\n");
+    fprintf (stderr, "                --verify take them from there; see ijvm-cache.c.\n");
+    fprintf (stderr, "  --no-tail-calls\n");
+    fprintf (stderr, "                Give every call a frame of its own.  By default a call\n");
+    fprintf (stderr, "                followed by ireturn reuses the frame of its caller, so\n");
+    fprintf (stderr, "                tail recursion runs in constant memory.  The trace, -T,\n");
+    fprintf (stderr, "                -P, --profile, --coverage, --memo and the jit engine\n");
+    fprintf (stderr, "                turn tail calls off too, so a program recursing\n");
+    fprintf (stderr, "                deeply in tail calls may run out of memory with them\n");
+    fprintf (stderr, "                that finishes with -s.\n");
+    fprintf (stderr, "  -m, --memory SIZE\n");
+    fprintf (stderr, "                Size of the IJVM memory, in bytes or with a K, M or G\n");
+    fprintf (stderr, "                suffix, up to 4G.  The default is 640K, or the most the\n");
+    fprintf (stderr, "                program can need if the image records its stack sizes\n");
+    fprintf (stderr, "                and that is more.\n");
+    fprintf (stderr, "  -l, --limit N\n");
+    fprintf (stderr, "                Stop the program after N instructions, with exit status\n");
+    fprintf (stderr, "                3 rather than the -1 of an error.\n");
+    fprintf (stderr, "                Only the switch, threaded and tos engines keep to it.\n");
+    fprintf (stderr, "  -T FILE       Write a binary trace to FILE; see ijvm-trace.\n");
+    fprintf (stderr, "  -P FILE       Record the opcode pair profile of the run in FILE.\n");
+    fprintf (stderr, "  -F FILE       Use superinstructions for the pairs in profile FILE.\n");
+    fprintf (stderr, "  --profile FILE\n");
+    fprintf (stderr, "                Print the instructions run and the time spent per opcode\n");
+    fprintf (stderr, "                and per method on stderr, and write the time spent in\n");
+    fprintf (stderr, "                each call stack to FILE, in the folded format of flame\n");
+    fprintf (stderr, "                graph tools.\n");
+    fprintf (stderr, "  --coverage FILE\n");
+    fprintf (stderr, "                Count the runs of each basic block and both edges of\n");
+    fprintf (stderr, "                each branch, and write them to FILE.\n");
+    fprintf (stderr, "  --lines FILE  Refer to the source lines in FILE, written by\n");
+    fprintf (stderr, "                `ijvm-asm --lines', in the coverage report.\n");
+    fprintf (stderr, "  --batch JOBS  Run the program once for each line of the file JOBS,\n");
+    fprintf (stderr, "                which holds the arguments to main, optionally followed\n");
+    fprintf (stderr, "                by `< FILE' to read input from FILE.  The results are\n");
+    fprintf (stderr, "                printed in the order of the jobs.\n");
+    fprintf (stderr, "  -j N          Run N batch jobs at a time.  The default is the number\n");
+    fprintf (stderr, "                of processors.\n");
+    fprintf (stderr, "  --checkpoint FILE\n");
+    fprintf (stderr, "                Save the state of the program to FILE and stop, when it\n");
+    fprintf (stderr, "                first reads input or after the number of instructions\n");
+    fprintf (stderr, "                given with --checkpoint-at.\n");
+    fprintf (stderr, "  --checkpoint-at N|input\n");
+    fprintf (stderr, "                Where to save the checkpoint.  The default is `input'.\n");
+    fprintf (stderr, "  --restore FILE\n");
+    fprintf (stderr, "                Carry on from the checkpoint in FILE, which was saved\n");
+    fprintf (stderr, "                by a run of the same program, instead of calling main.\n");
+    fprintf (stderr, "                The input the program had read is skipped.\n\n");
+    fprintf (stderr, "If you pass `-' as the filename the simulator will read the bytecode\nfile from stdin.\n\n");
+    fprintf (stderr, "You must specify as many arguments as your main method requires, except\n");
+    fprintf (stderr, "one; the simulator will pass the initial object reference for you.\n");
+    exit (-1);
+  }
+
+  if (limit > 0 && (engine == IJVM_ENGINE_JIT || engine == IJVM_ENGINE_HOT)) {
+    fprintf (stderr, "Option --limit can't be used with the %s engine\n",
+	     engine == IJVM_ENGINE_JIT ? "jit" : "hot");
+    exit (-1);
+  }
+
+  /* Pair profiles are recorded by the switch engine, and so are
+   * profiles and coverage. */
+  if (pair_file != NULL) {
+    engine = IJVM_ENGINE_SWITCH;
+    pairs = calloc (256 * 256, sizeof (unsigned long));
+  }
+  if (profile_file != NULL || coverage_file != NULL || memo)
+    engine = IJVM_ENGINE_SWITCH;
+
+  if (strcmp (argv[1], "-") == 0)
+    file = stdin;
+  else
+    file = fopen (argv[1], "r");
+  if (file == NULL) {
+    printf ("Could not open bytecode file `%s'\n", argv[1]);
+    exit (-1);
+  }
+  image = ijvm_image_load (file);
+  fclose (file);
+
+  if ((verify || memo) &&
+      !(cache ? ijvm_verify_cached (image, spec, error) :
+	ijvm_verify (image, error))) {
+    printf ("%s: %s\n", argv[1], error);
+    exit (-1);
+  }
+
+  /* Give a program that doesn't recurse all the memory it can need,
+   * so that its calls run without stack checks, see ijvm_new. */
+  estimate = ijvm_stack_estimate (image, why);
+  if (!memory_given && estimate > memory_size &&
+      estimate <= IJVM_MEMORY_MAX_SIZE - 4095)
+    memory_size = (estimate + 4095) / 4096 * 4096;
+
+  if (batch != NULL) {
+    if (argc > 2 || sink != NULL || pair_file != NULL ||
+	checkpoint != NULL || restore != NULL || profile_file != NULL ||
+	coverage_file != NULL || memo) {
+      fprintf (stderr, "Option --batch takes the arguments from the jobs file, and can't be used with -T, -P, --checkpoint, --restore, --profile, --coverage or --memo\n");
+      exit (-1);
+    }
+    return ijvm_batch_run (image, batch, nthreads, memory_size, limit,
+			   engine, supers, tail_calls);
+  }
+
+  /* A restored run takes its arguments and memory from the checkpoint. */
+  if (restore != NULL) {
+    if (argc > 2) {
+      fprintf (stderr, "Option --restore takes the arguments from the checkpoint\n");
+      exit (-1);
+    }
+    file = fopen (restore, "rb");
+    if (file == NULL) {
+      printf ("Couldn't read checkpoint `%s'\n", restore);
+      exit (-1);
+    }
+    i = ijvm_checkpoint_read (file, image, &input, &output, error);
+    fclose (file);
+    if (i == NULL) {
+      printf ("%s: %s\n", restore, error);
+      exit (-1);
+    }
+  }
+  else {
+    /* Dont count argv[0] or argv[1]. */
+    nargs = argc - 2;
+    args = malloc (MAX (nargs, 1) * sizeof (int32));
+    invalid = -1;
+    for (j = 0; j < nargs; j++) {
+      args[j] = strtol (argv[j + 2], &end_ptr, 0);
+      if (argv[j + 2] == end_ptr && invalid < 0)
+	invalid = j + 2;
+    }
+
+    i = ijvm_new (image, memory_size, nargs, args, error);
+    if (i == NULL) {
+      printf ("%s\n", error);
+      exit (-1);
+    }
+    if (invalid >= 0) {
+      printf ("Invalid argument to main method: `%s'\n", argv[invalid]);
+      exit (-1);
+    }
+    free (args);
+  }
+  i->spec = spec;
+  if (memo)
+    i->memo = ijvm_memo_new (image);
+
+  /* A binary trace records what the text trace would print. */
+  if (sink != NULL) {
+    verbose = TRUE;
+    i->sink = sink;
+  }
+
+  /* Program output is only buffered when no trace is printed with it. */
+  i->io = ijvm_io_new (STDIN_FILENO, stdout, verbose && sink == NULL);
+  if (restore != NULL)
+    ijvm_io_skip (i->io, input, output);
+
+  if (verbose) {
+    t = time (NULL);
+    time_string = ctime (&t);
+    if (sink != NULL)
+      ijvm_sink_printf (sink, "IJVM Trace of %s %s\n", argv[1], time_string);
+    else
+      printf ("IJVM Trace of %s %s\n", argv[1], time_string);
+  }
+
+  /* This is the interpreter main loop.  It essentially excecutes
+   * ijvm_execute_opcode until the program terminates (which is when
+   * an ireturn from main is encountered).  In each step, the
+   * instruction, its arguments and the top 8 elements on the stack
+   * are printed.  If another engine was selected it runs first, and
+   * the loop finishes whatever it leaves behind. */
+
+  if (verbose)
+    ijvm_trace_stack (i, i->sp, TRUE);
+
+  /* A checkpoint is taken by the switch engine, which counts
+   * instructions; the rest of the run is left to a restored one. */
+  if (checkpoint != NULL) {
+    for (steps = 0; ijvm_active (i); steps++) {
+      if (checkpoint_at > 0 ? steps == checkpoint_at :
+	  ijvm_checkpoint_at_input (i))
+	break;
+      if (verbose)
+	ijvm_trace_insn (i, i->pc);
+      ijvm_execute_opcode (i);
+      if (verbose)
+	ijvm_trace_stack (i, i->sp, FALSE);
+    }
+    ijvm_io_flush (i->io);
+    if (!ijvm_active (i)) {
+      fprintf (stderr, "The program ended before the checkpoint\n");
+      exit (-1);
+    }
+    file = fopen (checkpoint, "wb");
+    if (file == NULL || !ijvm_checkpoint_write (i, image, file) ||
+	fclose (file) != 0) {
+      fprintf (stderr, "Couldn't write checkpoint `%s'.\n", checkpoint);
+      exit (-1);
+    }
+    if (statistics)
+      fprintf (stderr, "checkpoint after %lu instructions\n", steps);
+    if (sink != NULL)
+      ijvm_sink_close (sink);
+    return 0;
+  }
+
+  /* A tail call leaves out the ireturn after it, which the trace, the
+   * pair profile, the profile and the coverage report would miss, and
+   * the frame the memo table waits for.  Compiled code builds frames
+   * of its own.  See --no-tail-calls in the usage. */
+  i->tail_calls = tail_calls && !verbose && sink == NULL && pairs == NULL &&
+    profile_file == NULL && coverage_file == NULL && !memo &&
+    engine != IJVM_ENGINE_JIT;
+  if (limit > 0)
+    i->budget = limit;
+  ijvm_run_engine (i, image, engine, supers, verbose);
+  if (profile_file != NULL)
+    profile = ijvm_profile_new (i, image);
+  if (coverage_file != NULL) {
+    coverage = ijvm_coverage_new (image, spec);
+    if (lines != NULL) {
+      file = fopen (lines, "r");
+      if (file == NULL) {
+	fprintf (stderr, "Couldn't read line file `%s'.\n", lines);
+	exit (-1);
+      }
+      if (!ijvm_coverage_read_lines (coverage, file)) {
+	fprintf (stderr, "`%s' is not a line file of this program.\n", lines);
+	exit (-1);
+      }
+      fclose (file);
+    }
+  }
+
+  previous = -1;
+  while (ijvm_active (i) && i->budget > 0) {
+    if (verbose)
+      ijvm_trace_insn (i, i->pc);
+    if (pairs != NULL) {
+      opcode = i->method[i->pc];
+      if (previous >= 0)
+	pairs[previous * 256 + opcode]++;
+      previous = opcode;
+    }
+    if (profile != NULL)
+      ijvm_profile_step (profile, i);
+    if (coverage != NULL)
+      ijvm_coverage_step (coverage, i);
+    ijvm_execute_opcode (i);
+    i->budget--;
+    if (verbose)
+      ijvm_trace_stack (i, i->sp, FALSE);
+  }
+  if (profile != NULL)
+    ijvm_profile_finish (profile);
+  if (ijvm_active (i)) {
+    /* Not ijvm_error, so that the caller can tell the limit from a
+     * fault by the exit status. */
+    ijvm_io_flush (i->io);
+    if (i->sink != NULL)
+      ijvm_sink_flush (i->sink);
+    fflush (stdout);
+    fprintf (stderr, "Instruction limit of %lu reached\n", limit);
+    exit (IJVM_EXIT_LIMIT);
+  }
+
+  ijvm_io_flush (i->io);
+  ijvm_print_result (i);
+  if (statistics) {
+    ijvm_print_statistics (i);
+    ijvm_memo_print_statistics (i);
+    if (estimate > 0)
+      fprintf (stderr, "worst-case memory: %lu KB\n", (estimate + 1023) >> 10);
+    else
+      fprintf (stderr, "worst-case memory: unbounded, %s\n", why);
+  }
+  if (pair_file != NULL) {
+    ijvm_pair_profile_write (pair_file, pairs);
+    fclose (pair_file);
+  }
+  if (profile != NULL) {
+    ijvm_profile_print (profile, stderr);
+    ijvm_profile_write_folded (profile, profile_file);
+    fclose (profile_file);
+    ijvm_profile_free (profile);
+  }
+  if (coverage != NULL) {
+    ijvm_coverage_write (coverage, coverage_file);
+    fclose (coverage_file);
+    ijvm_coverage_free (coverage);
+  }
+  if (sink != NULL)
+    ijvm_sink_close (sink);
+  return 0;
+}
@@ -0,0 +1,449 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "ijvm.h"
+
+/* ijvm-memo.c
+ *
+ * Memoization of pure methods.  A method is pure if what it returns
+ * depends on nothing but its arguments: it calls no builtins and only
+ * pure methods, never reads a local variable before it has written
+ * it, on every path, and doesn't read local 0, the link pointer.  As
+ * the image has passed ijvm_verify, it can't write outside its frame
+ * either, so calling it has no effect but its result.
+ *
+ * The results of pure methods with at most IJVM_MEMO_MAX_ARGS
+ * arguments are kept in a hash table of IJVM_MEMO_SIZE entries, keyed
+ * by the address of the method and the arguments; an entry whose slot
+ * is wanted by another call is replaced.  ijvm_invoke_virtual asks the
+ * table before it builds a frame, and on a hit pops the arguments and
+ * pushes the result, as if the method had run.  On a miss the call is
+ * noted, and ijvm_ireturn stores the result when the frame it built
+ * returns.
+ *
+ * The skipped calls aren't counted as instructions, and leave nothing
+ * in the memory above the stack, where a call that doesn't skip leaves
+ * its frame.  Only a method that reads a local before writing it could
+ * tell, and such a method isn't pure. */
+
+#define IJVM_MEMO_SIZE      65536   /* Entries, a power of 2 */
+#define IJVM_MEMO_MAX_ARGS  4       /* Not counting the object reference */
+#define IJVM_MEMO_WHY_SIZE  80
+
+typedef struct IJVMMemoEntry IJVMMemoEntry;
+struct IJVMMemoEntry
+{
+  uint32 address;       /* Of the method plus 1, 0 if the entry is free */
+  int32 args[IJVM_MEMO_MAX_ARGS];
+  int32 result;
+};
+
+/* A call whose result is to be stored when it returns, by the LV of
+ * the frame it built. */
+
+typedef struct IJVMMemoCall IJVMMemoCall;
+struct IJVMMemoCall
+{
+  IJVMMemoEntry key;
+  uint32 slot, lv;
+};
+
+typedef struct IJVMMemoMethod IJVMMemoMethod;
+struct IJVMMemoMethod
+{
+  uint32 address;
+  int nargs, nlocals;
+  bool pure;
+  char why[IJVM_MEMO_WHY_SIZE];   /* If it isn't pure */
+  uint32 *callees;
+  int ncallees, callees_alloc;
+};
+
+struct IJVMMemo
+{
+  uint8 *cacheable;     /* By constant pool index */
+  uint32 ncacheable;
+  int nmethods, npure;
+  char **impure;        /* Which methods aren't pure and why, for -S */
+
+  IJVMMemoEntry *table;
+  IJVMMemoCall *calls;
+  int ncalls, calls_alloc;
+
+  unsigned long hits, misses, replaced;
+};
+
+/* The length of the instruction at pc, as in ijvm_verify_length. */
+
+static int
+ijvm_memo_length (IJVMImage *image, uint32 pc)
+{
+  uint8 *m;
+
+  m = image->method_area;
+  if (m[pc] == IJVM_OPCODE_WIDE &&
+      (pc + 1 >= image->method_area_size ||
+       (m[pc + 1] != IJVM_OPCODE_ILOAD && m[pc + 1] != IJVM_OPCODE_ISTORE)))
+    return 1;
+  return ijvm_stack_effect (m[pc])->length;
+}
+
+static IJVMMemoMethod *
+ijvm_memo_lookup (IJVMMemoMethod *methods, int nmethods, uint32 address)
+{
+  int j;
+
+  for (j = 0; j < nmethods; j++)
+    if (methods[j].address == address)
+      return &methods[j];
+  return NULL;
+}
+
+/* Note the method at address, unless it is in methods already. */
+
+static void
+ijvm_memo_add (IJVMMemoMethod **methods, int *nmethods, int *alloc,
+	       IJVMImage *image, uint32 address)
+{
+  IJVMMemoMethod *method;
+
+  if (ijvm_memo_lookup (*methods, *nmethods, address) != NULL)
+    return;
+  if (*nmethods == *alloc) {
+    *alloc = MAX (*alloc * 2, 16);
+    *methods = realloc (*methods, *alloc * sizeof (IJVMMemoMethod));
+  }
+  method = &(*methods)[(*nmethods)++];
+  memset (method, 0, sizeof (IJVMMemoMethod));
+  method->address = address;
+  method->nargs = image->method_area[address] * 256 +
+    image->method_area[address + 1];
+  method->nlocals = image->method_area[address + 2] * 256 +
+    image->method_area[address + 3];
+}
+
+/* Note that method isn't pure, and why, unless that is known. */
+
+static void
+ijvm_memo_impure (IJVMMemoMethod *method, char *format, ...)
+{
+  va_list ap;
+
+  if (!method->pure)
+    return;
+  method->pure = FALSE;
+  va_start (ap, format);
+  vsnprintf (method->why, IJVM_MEMO_WHY_SIZE, format, ap);
+  va_end (ap);
+}
+
+/* Follow the code of method, noting the methods it calls, and find
+ * whether it is pure but for its callees.  assigned holds, for each
+ * instruction reached, the locals written on every path to it, one
+ * bit for each of the first 32 locals after the arguments; seen tells
+ * which are reached.  The others are taken as never written. */
+
+static void
+ijvm_memo_method (IJVMImage *image, IJVMMemoMethod *method,
+		  uint32 *assigned, uint8 *seen)
+{
+  uint32 *work, pc, mask, next[2], varnum, bit;
+  int nwork, work_alloc, nnext, length, j;
+  int16 offset;
+  uint8 *m, op;
+
+  m = image->method_area;
+  method->pure = TRUE;
+  work_alloc = 64;
+  work = malloc (work_alloc * sizeof (uint32));
+  nwork = 0;
+  seen[method->address + 4] = TRUE;
+  assigned[method->address + 4] = 0;
+  work[nwork++] = method->address + 4;
+  varnum = 0;
+
+  while (nwork > 0) {
+    pc = work[--nwork];
+    mask = assigned[pc];
+    op = m[pc];
+    length = ijvm_memo_length (image, pc);
+    nnext = 0;
+
+    switch (op) {
+    case IJVM_OPCODE_WIDE:
+      if (length == 4) {
+	op = m[pc + 1];
+	varnum = m[pc + 2] * 256 + m[pc + 3];
+      }
+      break;
+    case IJVM_OPCODE_ILOAD:
+    case IJVM_OPCODE_ISTORE:
+    case IJVM_OPCODE_IINC:
+      varnum = m[pc + 1];
+      break;
+    }
+
+    /* The bit of the local, 0 for an argument or one not tracked. */
+    bit = 0;
+    if (varnum >= method->nargs && varnum - method->nargs < 32)
+      bit = 1UL << (varnum - method->nargs);
+
+    switch (op) {
+    case IJVM_OPCODE_ILOAD:
+    case IJVM_OPCODE_IINC:
+      if (varnum == 0)
+	ijvm_memo_impure (method, "reads the link pointer at 0x%04x", pc);
+      else if (varnum >= method->nargs && !(mask & bit))
+	ijvm_memo_impure (method, "reads local %u before writing it at 0x%04x",
+			  varnum, pc);
+      next[nnext++] = pc + length;
+      break;
+
+    case IJVM_OPCODE_ISTORE:
+      mask |= bit;
+      next[nnext++] = pc + length;
+      break;
+
+    case IJVM_OPCODE_INVOKEVIRTUAL:
+      j = m[pc + 1] * 256 + m[pc + 2];
+      if (j >= 0x8000)
+	ijvm_memo_impure (method, "calls a builtin at 0x%04x", pc);
+      else {
+	if (method->ncallees == method->callees_alloc) {
+	  method->callees_alloc = MAX (method->callees_alloc * 2, 4);
+	  method->callees = realloc (method->callees,
+				     method->callees_alloc * sizeof (uint32));
+	}
+	method->callees[method->ncallees++] = image->cpool[j];
+      }
+      next[nnext++] = pc + length;
+      break;
+
+    case IJVM_OPCODE_IRETURN:
+      break;
+
+    case IJVM_OPCODE_GOTO:
+    case IJVM_OPCODE_IFEQ:
+    case IJVM_OPCODE_IFLT:
+    case IJVM_OPCODE_IF_ICMPEQ:
+      offset = m[pc + 1] * 256 + m[pc + 2];
+      next[nnext++] = pc + offset;
+      if (op != IJVM_OPCODE_GOTO)
+	next[nnext++] = pc + length;
+      break;
+
+    default:
+      next[nnext++] = pc + length;
+    }
+
+    for (j = 0; j < nnext; j++) {
+      if (!seen[next[j]]) {
+	seen[next[j]] = TRUE;
+	assigned[next[j]] = mask;
+      }
+      else if ((assigned[next[j]] & mask) != assigned[next[j]])
+	assigned[next[j]] &= mask;
+      else
+	continue;
+      if (nwork == work_alloc) {
+	work_alloc *= 2;
+	work = realloc (work, work_alloc * sizeof (uint32));
+      }
+      work[nwork++] = next[j];
+    }
+  }
+
+  free (work);
+}
+
+/* Find the pure methods of image, which must have passed ijvm_verify,
+ * and make an empty table for their results. */
+
+IJVMMemo *
+ijvm_memo_new (IJVMImage *image)
+{
+  IJVMMemo *memo;
+  IJVMMemoMethod *methods, *callee;
+  uint32 *assigned;
+  uint8 *seen;
+  int nmethods, alloc, j, k;
+  bool changed;
+
+  /* The methods reachable from main, in the order they are found;
+   * every method the verifier passed is whole and a method. */
+  methods = NULL;
+  nmethods = 0;
+  alloc = 0;
+  assigned = malloc (image->method_area_size * sizeof (uint32));
+  seen = calloc (image->method_area_size, 1);
+  ijvm_memo_add (&methods, &nmethods, &alloc, image,
+		 image->cpool[image->main_index]);
+  for (j = 0; j < nmethods; j++) {
+    ijvm_memo_method (image, &methods[j], assigned, seen);
+    for (k = 0; k < methods[j].ncallees; k++)
+      ijvm_memo_add (&methods, &nmethods, &alloc, image,
+		     methods[j].callees[k]);
+  }
+  free (assigned);
+  free (seen);
+
+  /* A method that calls an impure method is impure. */
+  do {
+    changed = FALSE;
+    for (j = 0; j < nmethods; j++)
+      for (k = 0; methods[j].pure && k < methods[j].ncallees; k++) {
+	callee = ijvm_memo_lookup (methods, nmethods, methods[j].callees[k]);
+	if (!callee->pure) {
+	  ijvm_memo_impure (&methods[j], "calls the method at 0x%04x, "
+			    "which isn't pure", callee->address);
+	  changed = TRUE;
+	}
+      }
+  } while (changed);
+
+  memo = calloc (1, sizeof (IJVMMemo));
+  memo->ncacheable = image->cpool_size;
+  memo->cacheable = calloc (MAX (image->cpool_size, 1), 1);
+  memo->nmethods = nmethods;
+  memo->impure = calloc (nmethods + 1, sizeof (char *));
+  for (j = 0, k = 0; j < nmethods; j++)
+    if (!methods[j].pure) {
+      memo->impure[k] = malloc (IJVM_MEMO_WHY_SIZE + 32);
+      snprintf (memo->impure[k++], IJVM_MEMO_WHY_SIZE + 32,
+		"the method at 0x%04x %s", methods[j].address,
+		methods[j].why);
+    }
+  for (j = 0; j < nmethods; j++) {
+    if (!methods[j].pure)
+      continue;
+    memo->npure++;
+    if (methods[j].nargs - 1 > IJVM_MEMO_MAX_ARGS)
+      continue;
+    for (k = 0; k < image->cpool_size; k++)
+      if (image->cpool[k] == (int32) methods[j].address)
+	memo->cacheable[k] = methods[j].nargs;
+  }
+  memo->table = calloc (IJVM_MEMO_SIZE, sizeof (IJVMMemoEntry));
+
+  for (j = 0; j < nmethods; j++)
+    free (methods[j].callees);
+  free (methods);
+
+  return memo;
+}
+
+/* The slot of key in the table, from a 32 bit FNV-1a hash of the
+ * address and arguments. */
+
+static uint32
+ijvm_memo_slot (IJVMMemoEntry *key, int nargs)
+{
+  uint32 hash;
+  int j, k;
+
+  hash = 2166136261U;
+  for (j = 0; j < nargs; j++)
+    for (k = 0; k < 32; k += 8) {
+      hash ^= ((j == 0 ? key->address : (uint32) key->args[j - 1]) >> k) & 255;
+      hash *= 16777619U;
+    }
+  return hash & (IJVM_MEMO_SIZE - 1);
+}
+
+/* Called by ijvm_invoke_virtual for a call of the method at constant
+ * pool index, with its arguments on the stack.  Returns TRUE if the
+ * result was in the table, and the call is done. */
+
+bool
+ijvm_memo_call (IJVMMemo *memo, IJVM *i, uint16 index)
+{
+  IJVMMemoEntry key, *entry;
+  IJVMMemoCall *call;
+  uint32 slot;
+  int nargs, j;
+
+  if (index >= memo->ncacheable || memo->cacheable[index] == 0)
+    return FALSE;
+
+  nargs = memo->cacheable[index];
+  memset (&key, 0, sizeof (key));
+  key.address = i->cpp[index] + 1;
+  for (j = 1; j < nargs; j++)
+    key.args[j - 1] = i->stack[i->sp - nargs + 1 + j];
+  slot = ijvm_memo_slot (&key, nargs);
+  entry = &memo->table[slot];
+
+  if (entry->address == key.address &&
+      memcmp (entry->args, key.args, sizeof (key.args)) == 0) {
+    memo->hits++;
+    i->sp -= nargs - 1;
+    i->stack[i->sp] = entry->result;
+    return TRUE;
+  }
+
+  memo->misses++;
+  if (memo->ncalls == memo->calls_alloc) {
+    memo->calls_alloc = MAX (memo->calls_alloc * 2, 64);
+    memo->calls = realloc (memo->calls,
+			   memo->calls_alloc * sizeof (IJVMMemoCall));
+  }
+  call = &memo->calls[memo->ncalls++];
+  call->key = key;
+  call->slot = slot;
+  call->lv = i->sp - nargs + 1;
+
+  return FALSE;
+}
+
+/* Called by ijvm_ireturn before the frame at i->lv returns, with the
+ * result on top of the stack. */
+
+void
+ijvm_memo_return (IJVMMemo *memo, IJVM *i)
+{
+  IJVMMemoCall *call;
+  IJVMMemoEntry *entry;
+
+  if (memo->ncalls == 0 || memo->calls[memo->ncalls - 1].lv != i->lv)
+    return;
+
+  call = &memo->calls[--memo->ncalls];
+  entry = &memo->table[call->slot];
+  if (entry->address != 0)
+    memo->replaced++;
+  *entry = call->key;
+  entry->result = i->stack[i->sp];
+}
+
+void
+ijvm_memo_print_statistics (IJVM *i)
+{
+  IJVMMemo *memo;
+  int j;
+
+  memo = i->memo;
+  if (memo == NULL)
+    return;
+
+  fprintf (stderr, "pure methods: %d of %d\n", memo->npure, memo->nmethods);
+  for (j = 0; memo->impure[j] != NULL; j++)
+    fprintf (stderr, "not pure: %s\n", memo->impure[j]);
+  fprintf (stderr, "memoized calls: %lu hits, %lu misses, %lu results replaced\n",
+	   memo->hits, memo->misses, memo->replaced);
+}
+
+void
+ijvm_memo_free (IJVMMemo *memo)
+{
+  int j;
+
+  for (j = 0; memo->impure[j] != NULL; j++)
+    free (memo->impure[j]);
+  free (memo->impure);
+  free (memo->cacheable);
+  free (memo->table);
+  free (memo->calls);
+  free (memo);
+}
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE     /* for memfd_create */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "ijvm-memory.h"
+
+/* ijvm-memory.c
+ *
+ * Guarded memory, see ijvm-memory.h.  On a 64 bit host each guard
+ * area is 16 GB, which covers any 32 bit word index whether it is
+ * taken as signed or unsigned; the areas are only reserved address
+ * space and cost nothing.  If the host won't reserve that much, a
+ * single guard page on each side still catches the common case, a
+ * stack running off the end of memory.
+ *
+ * The signal handler finds the memory a fault is in on a list of all
+ * memories in the process, which threads creating and freeing
+ * memories change under a spin lock.  The handler walks the list
+ * without the lock, so entries are never freed, only marked unused
+ * and used again.
+ *
+ * Memories that start with the same contents, such as the method area
+ * and constant pool of one program run many times, can share the
+ * whole pages of them: see ijvm_memory_share.  The shared pages are
+ * mapped read only from one file, so they are in the host memory only
+ * once, and a program writing to them faults like one writing to a
+ * guard area. */
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#define IJVM_MEMORY_GUARD_SIZE \
+  (sizeof (void *) >= 8 ? (size_t) 1 << 34 : (size_t) 1 << 16)
+#define IJVM_MEMORY_SIGNAL_STACK_SIZE (64 << 10)
+
+typedef struct IJVMMemoryRegion IJVMMemoryRegion;
+struct IJVMMemoryRegion
+{
+  uint8 *memory;        /* What ijvm_memory_new returned, NULL if unused */
+  uint8 *base;          /* Start of the mapping, first guard area */
+  size_t length;        /* Length of the mapping, guard areas included */
+  size_t mapped;        /* Length of the accessible part */
+  IJVMMemoryFault fault;
+  void *data;
+  IJVMMemoryRegion *next;
+};
+
+static IJVMMemoryRegion *volatile ijvm_memory_regions;
+static volatile int ijvm_memory_lock_word;
+static bool ijvm_memory_handler_installed;
+static struct sigaction ijvm_memory_old_segv, ijvm_memory_old_bus;
+static pthread_key_t ijvm_memory_stack_key;
+static pthread_once_t ijvm_memory_stack_once = PTHREAD_ONCE_INIT;
+
+static void
+ijvm_memory_lock (void)
+{
+#ifdef __GNUC__
+  while (__sync_lock_test_and_set (&ijvm_memory_lock_word, 1))
+    ;
+#endif
+}
+
+static void
+ijvm_memory_unlock (void)
+{
+#ifdef __GNUC__
+  __sync_lock_release (&ijvm_memory_lock_word);
+#endif
+}
+
+/* Return the region of memory, or NULL. */
+
+static IJVMMemoryRegion *
+ijvm_memory_region (uint8 *memory)
+{
+  IJVMMemoryRegion *region;
+
+  for (region = ijvm_memory_regions; region != NULL; region = region->next)
+    if (region->memory == memory)
+      return region;
+  return NULL;
+}
+
+static void
+ijvm_memory_handler (int signal_number, siginfo_t *info, void *context)
+{
+  IJVMMemoryRegion *region;
+  struct sigaction *old;
+  uint8 *address;
+
+  address = info->si_addr;
+  for (region = ijvm_memory_regions; region != NULL; region = region->next)
+    if (region->memory != NULL &&
+	region->base <= address && address < region->base + region->length) {
+      if (region->fault != NULL)
+	region->fault (region->data, address - region->memory, context);
+      fprintf (stderr, "Memory fault at address %ld\n",
+	       (long) (address - region->memory));
+      exit (-1);
+    }
+
+  /* Not ours; pass it on to the handler there was before. */
+  old = signal_number == SIGBUS ?
+    &ijvm_memory_old_bus : &ijvm_memory_old_segv;
+  if ((old->sa_flags & SA_SIGINFO) && old->sa_sigaction != NULL)
+    old->sa_sigaction (signal_number, info, context);
+  else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN)
+    old->sa_handler (signal_number);
+  else {
+    /* Put it back and fault again, or for a signal that was sent
+     * rather than a fault, have it delivered again on return. */
+    sigaction (signal_number, old, NULL);
+    if (info->si_code <= 0)
+      raise (signal_number);
+  }
+}
+
+/* Run as a thread that was given a signal stack exits. */
+
+static void
+ijvm_memory_free_stack (void *memory)
+{
+  stack_t stack;
+
+  if (sigaltstack (NULL, &stack) == 0 && stack.ss_sp == memory) {
+    stack.ss_sp = NULL;
+    stack.ss_size = 0;
+    stack.ss_flags = SS_DISABLE;
+    sigaltstack (&stack, NULL);
+  }
+  free (memory);
+}
+
+static void
+ijvm_memory_create_stack_key (void)
+{
+  pthread_key_create (&ijvm_memory_stack_key, ijvm_memory_free_stack);
+}
+
+/* Called with the lock held. */
+
+static void
+ijvm_memory_install_handler (void)
+{
+  struct sigaction action;
+  stack_t stack;
+
+  /* The handler needs a stack of its own if the fault is the C stack
+   * overflowing, as it can in the JIT engine.  Each thread has its
+   * own, which is freed when the thread exits. */
+  if (sigaltstack (NULL, &stack) == 0 && (stack.ss_flags & SS_DISABLE)) {
+    stack.ss_sp = malloc (IJVM_MEMORY_SIGNAL_STACK_SIZE);
+    stack.ss_size = IJVM_MEMORY_SIGNAL_STACK_SIZE;
+    stack.ss_flags = 0;
+    if (stack.ss_sp != NULL && sigaltstack (&stack, NULL) == 0) {
+      pthread_once (&ijvm_memory_stack_once, ijvm_memory_create_stack_key);
+      pthread_setspecific (ijvm_memory_stack_key, stack.ss_sp);
+    }
+    else
+      free (stack.ss_sp);
+  }
+
+  if (ijvm_memory_handler_installed)
+    return;
+  ijvm_memory_handler_installed = TRUE;
+
+  memset (&action, 0, sizeof (action));
+  action.sa_sigaction = ijvm_memory_handler;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGSEGV, &action, &ijvm_memory_old_segv);
+  sigaction (SIGBUS, &action, &ijvm_memory_old_bus);
+}
+
+/* Return size bytes of zeroed memory between guard areas, or NULL if
+ * there isn't room for it. */
+
+uint8 *
+ijvm_memory_new (unsigned long size)
+{
+  IJVMMemoryRegion *region;
+  size_t page, mapped, guard;
+  void *base;
+
+  page = sysconf (_SC_PAGESIZE);
+  mapped = ((size_t) size + page - 1) / page * page;
+  guard = IJVM_MEMORY_GUARD_SIZE;
+
+  base = mmap (NULL, mapped + 2 * guard, PROT_NONE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    guard = page;
+    base = mmap (NULL, mapped + 2 * guard, PROT_NONE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  if (base == MAP_FAILED)
+    return NULL;
+  if (mprotect ((uint8 *) base + guard, mapped, PROT_READ | PROT_WRITE) != 0) {
+    munmap (base, mapped + 2 * guard);
+    return NULL;
+  }
+
+  ijvm_memory_lock ();
+  region = ijvm_memory_region (NULL);
+  if (region == NULL) {
+    region = malloc (sizeof (IJVMMemoryRegion));
+    region->memory = NULL;
+    region->next = ijvm_memory_regions;
+    ijvm_memory_regions = region;
+  }
+  region->base = base;
+  region->length = mapped + 2 * guard;
+  region->mapped = mapped;
+  region->fault = NULL;
+  region->data = NULL;
+  region->memory = (uint8 *) base + guard;
+  ijvm_memory_install_handler ();
+  ijvm_memory_unlock ();
+
+  return region->memory;
+}
+
+struct IJVMMemoryShared
+{
+  int fd;               /* The whole pages */
+  size_t pages_length;
+  uint8 *tail;          /* The rest, copied to each memory */
+  size_t tail_length;
+};
+
+/* Prepare memories starting with the length bytes at data, see
+ * ijvm_memory_new_shared.  Returns NULL if there's no file to share
+ * them from. */
+
+IJVMMemoryShared *
+ijvm_memory_share (uint8 *data, unsigned long length)
+{
+  IJVMMemoryShared *shared;
+  size_t page, done;
+  ssize_t n;
+  FILE *file;
+  int fd;
+
+  page = sysconf (_SC_PAGESIZE);
+#ifdef MFD_CLOEXEC
+  fd = memfd_create ("ijvm", MFD_CLOEXEC);
+#else
+  fd = -1;
+#endif
+  if (fd < 0) {
+    file = tmpfile ();
+    if (file == NULL)
+      return NULL;
+    fd = dup (fileno (file));
+    fclose (file);
+    if (fd < 0)
+      return NULL;
+  }
+
+  shared = malloc (sizeof (IJVMMemoryShared));
+  shared->fd = fd;
+  shared->pages_length = length / page * page;
+  shared->tail_length = length - shared->pages_length;
+  shared->tail = malloc (shared->tail_length + 1);
+  memcpy (shared->tail, data + shared->pages_length, shared->tail_length);
+
+  for (done = 0; done < shared->pages_length; done += n) {
+    n = write (fd, data + done, shared->pages_length - done);
+    if (n <= 0) {
+      ijvm_memory_share_free (shared);
+      return NULL;
+    }
+  }
+
+  return shared;
+}
+
+/* Return size bytes of memory like ijvm_memory_new, starting with the
+ * data given to ijvm_memory_share, or NULL. */
+
+uint8 *
+ijvm_memory_new_shared (unsigned long size, IJVMMemoryShared *shared)
+{
+  uint8 *memory;
+
+  if (size < shared->pages_length + shared->tail_length)
+    return NULL;
+  memory = ijvm_memory_new (size);
+  if (memory == NULL)
+    return NULL;
+
+  if (shared->pages_length > 0 &&
+      mmap (memory, shared->pages_length, PROT_READ, MAP_SHARED | MAP_FIXED,
+	    shared->fd, 0) == MAP_FAILED) {
+    ijvm_memory_free (memory);
+    return NULL;
+  }
+  memcpy (memory + shared->pages_length, shared->tail, shared->tail_length);
+
+  return memory;
+}
+
+/* Free shared, which the memories made from it don't need anymore. */
+
+void
+ijvm_memory_share_free (IJVMMemoryShared *shared)
+{
+  close (shared->fd);
+  free (shared->tail);
+  free (shared);
+}
+
+/* Call fault with data and the address relative to memory when the
+ * program touches a guard area of memory.  fault isn't expected to
+ * return. */
+
+void
+ijvm_memory_set_fault (uint8 *memory, IJVMMemoryFault fault, void *data)
+{
+  IJVMMemoryRegion *region;
+
+  ijvm_memory_lock ();
+  region = ijvm_memory_region (memory);
+  if (region != NULL) {
+    region->fault = fault;
+    region->data = data;
+  }
+  ijvm_memory_unlock ();
+}
+
+/* Return a vector with an entry for each page of memory, of
+ * *page_size bytes, that is nonzero if the page is resident, as
+ * mincore says, or NULL if the host can't tell.  Free it with free. */
+
+unsigned char *
+ijvm_memory_resident_pages (uint8 *memory, unsigned long *page_size)
+{
+  IJVMMemoryRegion *region;
+  unsigned char *vector;
+  size_t page, pages, j;
+
+  region = ijvm_memory_region (memory);
+  if (region == NULL)
+    return NULL;
+
+  page = sysconf (_SC_PAGESIZE);
+  pages = region->mapped / page;
+  vector = malloc (pages + 1);
+  if (mincore (region->memory, region->mapped, (void *) vector) != 0) {
+    free (vector);
+    return NULL;
+  }
+  for (j = 0; j < pages; j++)
+    vector[j] &= 1;
+  *page_size = page;
+
+  return vector;
+}
+
+/* Return the number of bytes of memory in resident pages.  That is
+ * the residency the host reports, not the most the program used:
+ * pages the program only read count, though they may all share the
+ * zero page, pages shared with other runs by ijvm_memory_new_shared
+ * count in each of them, and pages the host has swapped out don't
+ * count at all. */
+
+unsigned long
+ijvm_memory_resident (uint8 *memory)
+{
+  IJVMMemoryRegion *region;
+  unsigned char *vector;
+  unsigned long page, resident;
+  size_t j;
+
+  region = ijvm_memory_region (memory);
+  vector = ijvm_memory_resident_pages (memory, &page);
+  if (vector == NULL)
+    return 0;
+
+  resident = 0;
+  for (j = 0; j < region->mapped / page; j++)
+    if (vector[j])
+      resident += page;
+  free (vector);
+
+  return resident;
+}
+
+/* Parse a memory size: a number of bytes, optionally followed by K, M
+ * or G for kilobytes, megabytes or gigabytes.  Returns 0 if string
+ * isn't a size or the size is larger than IJVM_MEMORY_MAX_SIZE. */
+
+unsigned long
+ijvm_memory_parse_size (char *string)
+{
+  unsigned long size;
+  char *end;
+
+  size = strtoul (string, &end, 0);
+  if (end == string)
+    return 0;
+
+  switch (*end) {
+  case 'g': case 'G':
+    if (size > IJVM_MEMORY_MAX_SIZE >> 30)
+      return 0;
+    size <<= 10;
+    /* Fall through */
+  case 'm': case 'M':
+    if (size > IJVM_MEMORY_MAX_SIZE >> 20)
+      return 0;
+    size <<= 10;
+    /* Fall through */
+  case 'k': case 'K':
+    if (size > IJVM_MEMORY_MAX_SIZE >> 10)
+      return 0;
+    size <<= 10;
+    end++;
+  }
+
+  if (*end != '\0' || size > IJVM_MEMORY_MAX_SIZE)
+    return 0;
+  return size;
+}
+
+void
+ijvm_memory_free (uint8 *memory)
+{
+  IJVMMemoryRegion *region;
+
+  ijvm_memory_lock ();
+  region = ijvm_memory_region (memory);
+  if (region != NULL) {
+    region->memory = NULL;
+    munmap (region->base, region->length);
+  }
+  ijvm_memory_unlock ();
+}
@@ -0,0 +1,38 @@
+#ifndef IJVM_MEMORY_H
+#define IJVM_MEMORY_H
+
+#include "types.h"
+
+/* ijvm-memory.h
+ *
+ * The memory of a simulated machine, shared by ijvm and mic1.  The
+ * memory is mapped with inaccessible guard areas on both sides, large
+ * enough on 64 bit hosts that no 32 bit word index from the memory
+ * can reach past them.  A stray access ends up in a guard area, and
+ * the SIGSEGV handler passes the offending address, relative to the
+ * start of the memory, to the fault function registered for it,
+ * with the machine context of the fault (the ucontext_t the handler
+ * got).
+ * That way the simulators need no range checks of their own.
+ *
+ * The memory is anonymous mapped memory, so pages the program never
+ * touches are never committed or cleared, and a large memory costs
+ * no more to set up than a small one. */
+
+#define IJVM_MEMORY_MAX_SIZE (4UL << 30)
+
+typedef void (*IJVMMemoryFault) (void *data, long address, void *context);
+typedef struct IJVMMemoryShared IJVMMemoryShared;
+
+uint8 *ijvm_memory_new (unsigned long size);
+IJVMMemoryShared *ijvm_memory_share (uint8 *data, unsigned long length);
+uint8 *ijvm_memory_new_shared (unsigned long size, IJVMMemoryShared *shared);
+void ijvm_memory_share_free (IJVMMemoryShared *shared);
+void ijvm_memory_set_fault (uint8 *memory, IJVMMemoryFault fault, void *data);
+unsigned char *ijvm_memory_resident_pages (uint8 *memory,
+					   unsigned long *page_size);
+unsigned long ijvm_memory_resident (uint8 *memory);
+unsigned long ijvm_memory_parse_size (char *string);
+void ijvm_memory_free (uint8 *memory);
+
+#endif
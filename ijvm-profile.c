@@ -0,0 +1,446 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ijvm.h"
+
+/* ijvm-profile.c
+ *
+ * The profiler of `ijvm --profile'.  It runs along with the switch
+ * engine, which calls ijvm_profile_step before each instruction.
+ * Time is read from the time stamp counter on x86, in cycles, and
+ * from the monotonic clock elsewhere, in nanoseconds.  Either takes
+ * longer to read than most instructions take to run, so the clock is
+ * only read where the program calls or returns, which is enough to
+ * charge each method exactly for its time.  The time per opcode is
+ * estimated from samples instead: about one in 64 instructions, at
+ * random, is timed on its own, and each opcode is charged the average
+ * of its samples for every time it ran.
+ *
+ * Methods are known by their constant pool index, as passed to
+ * invokevirtual; the builtins get an index each after the constant
+ * pool.  The profiler keeps the tree of call stacks the program has
+ * run: a node for each method called from each call stack, with the
+ * number of calls, the instructions run in the method itself and the
+ * time spent there.  At the end the flat profile is printed from the
+ * tree, and the call stacks can be written in the folded format of
+ * flame graph tools: one line per call stack, the methods separated
+ * by semicolons, followed by the time. */
+
+typedef struct IJVMProfileNode IJVMProfileNode;
+struct IJVMProfileNode
+{
+  int method;
+  int parent, child, sibling;     /* Node numbers, or -1 */
+  unsigned long calls, instructions, time;
+};
+
+struct IJVMProfile
+{
+  IJVMImage *image;
+  IJVMSpec *spec;
+  int nmethods;                   /* Constant pool size and builtins */
+
+  unsigned long count[256], samples[256], time[256];
+  int sampled;                    /* Opcode of the running sample, or -1 */
+  int countdown;                  /* Instructions to the next sample */
+  uint32 seed;
+  unsigned long start;            /* Time the sample started */
+  unsigned long overhead;         /* Time it takes to read the clock */
+
+  IJVMProfileNode *nodes;
+  int nnodes, alloc;
+  int current;                    /* Node of the running method */
+  int builtin;                    /* Node of the running builtin, or -1 */
+  unsigned long last;             /* Time of the last call or return */
+};
+
+static char *ijvm_profile_builtins[] =
+{ "getchar", "putchar", "readblock", "writeblock" };
+
+#define IJVM_PROFILE_NBUILTINS 4
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define IJVM_PROFILE_UNIT "cycles"
+
+static inline unsigned long
+ijvm_profile_now (void)
+{
+  uint32 low, high;
+
+  __asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+  return (unsigned long) high << 16 << 16 | low;
+}
+#else
+#define IJVM_PROFILE_UNIT "ns"
+
+static unsigned long
+ijvm_profile_now (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (unsigned long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
+
+/* The method number of the invokevirtual constant pool index, or -1
+ * if it isn't one. */
+
+static int
+ijvm_profile_method (IJVMProfile *p, uint16 index)
+{
+  if (index < p->image->cpool_size)
+    return index;
+  if (index >= 0x8000 && index < 0x8000 + IJVM_PROFILE_NBUILTINS)
+    return p->image->cpool_size + index - 0x8000;
+  return -1;
+}
+
+static char *
+ijvm_profile_method_name (IJVMProfile *p, int method, char *buffer)
+{
+  if (method == p->image->main_index)
+    return "main";
+  if (method >= p->image->cpool_size)
+    return ijvm_profile_builtins[method - p->image->cpool_size];
+  sprintf (buffer, "method_%d", method);
+  return buffer;
+}
+
+/* The node for a call of method from node parent, made if needed. */
+
+static int
+ijvm_profile_child (IJVMProfile *p, int parent, int method)
+{
+  IJVMProfileNode *node;
+  int n;
+
+  if (parent >= 0)
+    for (n = p->nodes[parent].child; n >= 0; n = p->nodes[n].sibling)
+      if (p->nodes[n].method == method)
+	return n;
+
+  if (p->nnodes == p->alloc) {
+    p->alloc = MAX (p->alloc * 2, 64);
+    p->nodes = realloc (p->nodes, p->alloc * sizeof (IJVMProfileNode));
+  }
+  n = p->nnodes++;
+  node = &p->nodes[n];
+  node->method = method;
+  node->parent = parent;
+  node->child = -1;
+  node->sibling = -1;
+  node->calls = 0;
+  node->instructions = 0;
+  node->time = 0;
+  if (parent >= 0) {
+    node->sibling = p->nodes[parent].child;
+    p->nodes[parent].child = n;
+  }
+
+  return n;
+}
+
+/* Make the call stack of i, found from the frames on its stack, the
+ * current one.  The method of a frame is the one its caller's
+ * invokevirtual called; the frame of main returns to
+ * IJVM_INITIAL_PC. */
+
+static void
+ijvm_profile_enter_frames (IJVMProfile *p, IJVM *i)
+{
+  uint32 lv, link, pc;
+  int *methods, nmethods, alloc, node;
+
+  methods = NULL;
+  nmethods = alloc = 0;
+  for (lv = i->lv; ; lv = i->stack[link + 1]) {
+    link = i->stack[lv];
+    pc = i->stack[link];
+    if (nmethods == alloc) {
+      alloc = MAX (alloc * 2, 16);
+      methods = realloc (methods, alloc * sizeof (int));
+    }
+    if (pc == IJVM_INITIAL_PC) {
+      methods[nmethods++] = p->image->main_index;
+      break;
+    }
+    methods[nmethods++] =
+      ijvm_profile_method (p, i->method[pc - 2] * 256 + i->method[pc - 1]);
+  }
+
+  node = -1;
+  while (nmethods > 0) {
+    node = ijvm_profile_child (p, node, methods[--nmethods]);
+    p->nodes[node].calls++;
+  }
+  free (methods);
+  p->current = node;
+}
+
+/* The number of instructions to the next sample, 1 to 128. */
+
+static int
+ijvm_profile_period (IJVMProfile *p)
+{
+  p->seed = p->seed * 1103515245 + 12345;
+  return 1 + ((p->seed >> 16) & 127);
+}
+
+IJVMProfile *
+ijvm_profile_new (IJVM *i, IJVMImage *image)
+{
+  IJVMProfile *p;
+  unsigned long before, after;
+  int j;
+
+  p = calloc (1, sizeof (IJVMProfile));
+  p->image = image;
+  p->spec = i->spec;
+  p->nmethods = image->cpool_size + IJVM_PROFILE_NBUILTINS;
+  p->sampled = -1;
+  p->seed = 1;
+  p->countdown = ijvm_profile_period (p);
+  p->nodes = NULL;
+  p->nnodes = p->alloc = 0;
+  p->builtin = -1;
+  ijvm_profile_enter_frames (p, i);
+
+  /* Samples are measured with two reads of the clock; take off what
+   * the reads take themselves. */
+  p->overhead = ~0UL;
+  for (j = 0; j < 16; j++) {
+    before = ijvm_profile_now ();
+    after = ijvm_profile_now ();
+    p->overhead = MIN (p->overhead, after - before);
+  }
+  p->last = ijvm_profile_now ();
+
+  return p;
+}
+
+/* Called before i runs the instruction at its pc. */
+
+void
+ijvm_profile_step (IJVMProfile *p, IJVM *i)
+{
+  unsigned long now, time;
+  bool timed;
+  int opcode, method;
+
+  timed = FALSE;
+  now = 0;
+  if (p->sampled >= 0 || p->builtin >= 0) {
+    now = ijvm_profile_now ();
+    timed = TRUE;
+  }
+  if (p->sampled >= 0) {
+    time = now - p->start;
+    p->time[p->sampled] += time > p->overhead ? time - p->overhead : 0;
+    p->samples[p->sampled]++;
+    p->sampled = -1;
+  }
+  /* A builtin runs within its invokevirtual, and is charged for it. */
+  if (p->builtin >= 0) {
+    p->nodes[p->builtin].time += now - p->last;
+    p->last = now;
+    p->builtin = -1;
+  }
+
+  opcode = i->method[i->pc];
+  p->count[opcode]++;
+  p->nodes[p->current].instructions++;
+
+  if (opcode == IJVM_OPCODE_INVOKEVIRTUAL || opcode == IJVM_OPCODE_IRETURN) {
+    if (!timed) {
+      now = ijvm_profile_now ();
+      timed = TRUE;
+    }
+    p->nodes[p->current].time += now - p->last;
+    p->last = now;
+
+    if (opcode == IJVM_OPCODE_IRETURN) {
+      if (p->nodes[p->current].parent >= 0)
+	p->current = p->nodes[p->current].parent;
+    }
+    else {
+      method = ijvm_profile_method (p, i->method[i->pc + 1] * 256 +
+				    i->method[i->pc + 2]);
+      if (method >= p->image->cpool_size) {
+	p->builtin = ijvm_profile_child (p, p->current, method);
+	p->nodes[p->builtin].calls++;
+      }
+      else if (method >= 0) {
+	p->current = ijvm_profile_child (p, p->current, method);
+	p->nodes[p->current].calls++;
+      }
+    }
+  }
+
+  if (--p->countdown == 0) {
+    p->countdown = ijvm_profile_period (p);
+    p->sampled = opcode;
+    p->start = timed ? now : ijvm_profile_now ();
+  }
+}
+
+/* Called when the run is over, to charge the last instruction. */
+
+void
+ijvm_profile_finish (IJVMProfile *p)
+{
+  unsigned long now;
+
+  now = ijvm_profile_now ();
+  p->nodes[p->builtin >= 0 ? p->builtin : p->current].time += now - p->last;
+  p->last = now;
+  p->builtin = -1;
+  p->sampled = -1;
+}
+
+/* Print the flat profile on file: the instructions run and the time
+ * spent per opcode and per method.  The time of an opcode is the
+ * average of its samples times its count, or 0 if it wasn't sampled.
+ * The total time of a method includes its callees, and a recursive
+ * method is counted once per outermost call. */
+
+void
+ijvm_profile_print (IJVMProfile *p, FILE *file)
+{
+  IJVMInsnTemplate *tmpl;
+  unsigned long *calls, *instructions, *self, *total, *subtree;
+  unsigned long count, time, estimate[256];
+  double average;
+  int *active, *stack, depth, n, m, j;
+  char buffer[32], *name;
+
+  count = time = 0;
+  for (j = 0; j < 256; j++) {
+    estimate[j] = p->samples[j] > 0 ?
+      (double) p->time[j] / p->samples[j] * p->count[j] : 0;
+    count += p->count[j];
+    time += estimate[j];
+  }
+
+  fprintf (file, "%-14s %12s %9s %14s %8s %7s\n", "opcode", "count",
+	   "samples", IJVM_PROFILE_UNIT, "average", "%time");
+  for (j = 0; j < 256; j++) {
+    if (p->count[j] == 0)
+      continue;
+    tmpl = p->spec != NULL ?
+      ijvm_spec_lookup_template_by_opcode (p->spec, j) : NULL;
+    if (tmpl != NULL)
+      name = tmpl->mnemonic;
+    else {
+      sprintf (buffer, "0x%02x", j);
+      name = buffer;
+    }
+    average = p->samples[j] > 0 ? (double) p->time[j] / p->samples[j] : 0;
+    fprintf (file, "%-14s %12lu %9lu %14lu %8.1f %6.1f%%\n", name,
+	     p->count[j], p->samples[j], estimate[j], average,
+	     time > 0 ? 100.0 * estimate[j] / time : 0.0);
+  }
+  fprintf (file, "%-14s %12lu %9s %14lu\n\n", "total", count, "", time);
+
+  /* The time of each subtree of calls; a child always comes after its
+   * parent. */
+  subtree = malloc (MAX (p->nnodes, 1) * sizeof (unsigned long));
+  time = 0;
+  for (n = 0; n < p->nnodes; n++) {
+    subtree[n] = p->nodes[n].time;
+    time += p->nodes[n].time;
+  }
+  for (n = p->nnodes - 1; n > 0; n--)
+    if (p->nodes[n].parent >= 0)
+      subtree[p->nodes[n].parent] += subtree[n];
+
+  calls = calloc (p->nmethods, sizeof (unsigned long));
+  instructions = calloc (p->nmethods, sizeof (unsigned long));
+  self = calloc (p->nmethods, sizeof (unsigned long));
+  total = calloc (p->nmethods, sizeof (unsigned long));
+  active = calloc (p->nmethods, sizeof (int));
+  stack = malloc (2 * MAX (p->nnodes, 1) * sizeof (int));
+
+  /* Walk the tree depth first, keeping count of the calls of each
+   * method on the way down, so that only outermost calls add to the
+   * total time. */
+  depth = 0;
+  for (n = 0; n < p->nnodes; n++)
+    if (p->nodes[n].parent < 0)
+      stack[depth++] = n;
+  while (depth > 0) {
+    n = stack[--depth];
+    if (n < 0) {
+      active[p->nodes[-n - 1].method]--;
+      continue;
+    }
+    m = p->nodes[n].method;
+    calls[m] += p->nodes[n].calls;
+    instructions[m] += p->nodes[n].instructions;
+    self[m] += p->nodes[n].time;
+    if (active[m]++ == 0)
+      total[m] += subtree[n];
+    stack[depth++] = -n - 1;
+    for (j = p->nodes[n].child; j >= 0; j = p->nodes[j].sibling)
+      stack[depth++] = j;
+  }
+
+  fprintf (file, "%-14s %7s %10s %12s %14s %14s %7s\n", "method", "address",
+	   "calls", "instructions", "self " IJVM_PROFILE_UNIT,
+	   "total " IJVM_PROFILE_UNIT, "%self");
+  for (m = 0; m < p->nmethods; m++) {
+    if (calls[m] == 0 && instructions[m] == 0)
+      continue;
+    name = ijvm_profile_method_name (p, m, buffer);
+    if (m < p->image->cpool_size)
+      fprintf (file, "%-14s  0x%04x", name, p->image->cpool[m]);
+    else
+      fprintf (file, "%-14s %7s", name, "-");
+    fprintf (file, " %10lu %12lu %14lu %14lu %6.1f%%\n", calls[m],
+	     instructions[m], self[m], total[m],
+	     time > 0 ? 100.0 * self[m] / time : 0.0);
+  }
+
+  free (calls);
+  free (instructions);
+  free (self);
+  free (total);
+  free (active);
+  free (stack);
+  free (subtree);
+}
+
+/* Write the call stacks to file in the folded format, with the time
+ * spent in the last method of each. */
+
+void
+ijvm_profile_write_folded (IJVMProfile *p, FILE *file)
+{
+  int *path, depth, n, j;
+  char buffer[32];
+
+  path = malloc (MAX (p->nnodes, 1) * sizeof (int));
+  for (n = 0; n < p->nnodes; n++) {
+    if (p->nodes[n].time == 0)
+      continue;
+    depth = 0;
+    for (j = n; j >= 0; j = p->nodes[j].parent)
+      path[depth++] = j;
+    while (depth > 0) {
+      j = path[--depth];
+      fputs (ijvm_profile_method_name (p, p->nodes[j].method, buffer), file);
+      putc (depth > 0 ? ';' : ' ', file);
+    }
+    fprintf (file, "%lu\n", p->nodes[n].time);
+  }
+  free (path);
+}
+
+void
+ijvm_profile_free (IJVMProfile *p)
+{
+  free (p->nodes);
+  free (p);
+}
@@ -0,0 +1,402 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "ijvm-util.h"
+#include "ijvm-sink.h"
+
+/* ijvm-sink.c
+ *
+ * The binary trace format.  A trace file starts with the 8 bytes
+ * "IJTRACE" and a version byte, followed by records until the end of
+ * the file.  Each record starts with a tag byte:
+ *
+ *   0x01  instruction: pc, n, the n bytes ijvm_print_snapshot prints
+ *   0x02  stack: sp, length, mask, values
+ *   0x03  the same, printed indented
+ *   0x04  SP out of range (mic1): sp
+ *   0x05  one character of program output
+ *   0x06  text: n, n bytes
+ *
+ * Numbers are unsigned LEB128 varints; signed ones are zigzag encoded
+ * first.  The pc of an instruction is stored as the difference from
+ * the end of the previous instruction, and sp as the difference from
+ * the previous stack record, so straight line code costs one byte
+ * each.  A stack record only carries the values of the top length
+ * slots that differ from what the reader already knows: bit k of
+ * mask is set if a value for slot sp - k follows.  Both sides keep a
+ * shadow of the memory seen in stack records to make this work.  The
+ * shadow is kept by pages of IJVM_SINK_SHADOW_PAGE words, allocated
+ * when a stack record first reaches them, so that it takes the memory
+ * the trace has seen rather than all the memory below the highest
+ * SP. */
+
+#define IJVM_SINK_VERSION 1
+#define IJVM_SINK_BUFFER_SIZE (1 << 20)
+#define IJVM_SINK_MAX_RECORD 64
+#define IJVM_SINK_SHADOW_PAGE 1024
+
+#define IJVM_SINK_INSN          0x01
+#define IJVM_SINK_STACK         0x02
+#define IJVM_SINK_STACK_INDENT  0x03
+#define IJVM_SINK_SP_RANGE      0x04
+#define IJVM_SINK_CHAR          0x05
+#define IJVM_SINK_TEXT          0x06
+
+static char ijvm_sink_magic[] = "IJTRACE";
+
+typedef struct IJVMSinkShadow IJVMSinkShadow;
+struct IJVMSinkShadow
+{
+  int32 **pages;        /* By word index / IJVM_SINK_SHADOW_PAGE, or NULL */
+  uint32 npages;
+};
+
+struct IJVMSink
+{
+  FILE *file;
+  uint8 *buffer;
+  int length;
+
+  uint32 next_pc, sp;
+  IJVMSinkShadow shadow;
+
+  IJVMSpec *spec;
+  int8 lengths[256];    /* Snapshot length by opcode, 0 if not known */
+};
+
+/* Write out what is buffered, for a run that ends without
+ * ijvm_sink_close. */
+
+void
+ijvm_sink_flush (IJVMSink *sink)
+{
+  fwrite (sink->buffer, 1, sink->length, sink->file);
+  sink->length = 0;
+  fflush (sink->file);
+}
+
+/* Make room for a record of up to n bytes. */
+
+static void
+ijvm_sink_reserve (IJVMSink *sink, int n)
+{
+  if (sink->length + n > IJVM_SINK_BUFFER_SIZE)
+    ijvm_sink_flush (sink);
+}
+
+static void
+ijvm_sink_put_uint (IJVMSink *sink, uint32 value)
+{
+  while (value >= 0x80) {
+    sink->buffer[sink->length++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  sink->buffer[sink->length++] = value;
+}
+
+static void
+ijvm_sink_put_int (IJVMSink *sink, int32 value)
+{
+  ijvm_sink_put_uint (sink, ((uint32) value << 1) ^ (uint32) (value >> 31));
+}
+
+/* Return the word of a shadow of IJVM memory at index, adding the
+ * page it is in, all zero, if it isn't there yet. */
+
+static int32 *
+ijvm_sink_shadow_word (IJVMSinkShadow *shadow, uint32 index)
+{
+  uint32 page, n;
+
+  page = index / IJVM_SINK_SHADOW_PAGE;
+  if (page >= shadow->npages) {
+    n = MAX (shadow->npages * 2, 64);
+    while (n <= page)
+      n *= 2;
+    shadow->pages = realloc (shadow->pages, n * sizeof (int32 *));
+    memset (shadow->pages + shadow->npages, 0,
+	    (n - shadow->npages) * sizeof (int32 *));
+    shadow->npages = n;
+  }
+  if (shadow->pages[page] == NULL)
+    shadow->pages[page] = calloc (IJVM_SINK_SHADOW_PAGE, sizeof (int32));
+
+  return &shadow->pages[page][index % IJVM_SINK_SHADOW_PAGE];
+}
+
+static void
+ijvm_sink_shadow_free (IJVMSinkShadow *shadow)
+{
+  uint32 page;
+
+  for (page = 0; page < shadow->npages; page++)
+    free (shadow->pages[page]);
+  free (shadow->pages);
+}
+
+IJVMSink *
+ijvm_sink_new (FILE *file, IJVMSpec *spec)
+{
+  IJVMSink *sink;
+
+  sink = malloc (sizeof (IJVMSink));
+  memset (sink, 0, sizeof (IJVMSink));
+  sink->file = file;
+  sink->spec = spec;
+  sink->buffer = malloc (IJVM_SINK_BUFFER_SIZE);
+  sink->length = 0;
+
+  memcpy (sink->buffer, ijvm_sink_magic, 7);
+  sink->buffer[7] = IJVM_SINK_VERSION;
+  sink->length = 8;
+
+  return sink;
+}
+
+void
+ijvm_sink_insn (IJVMSink *sink, uint32 pc, uint8 *opcodes)
+{
+  int n;
+
+  n = sink->lengths[opcodes[0]];
+  if (n == 0) {
+    n = ijvm_snapshot_length (sink->spec, opcodes[0]);
+    sink->lengths[opcodes[0]] = n;
+  }
+
+  ijvm_sink_reserve (sink, IJVM_SINK_MAX_RECORD);
+  sink->buffer[sink->length++] = IJVM_SINK_INSN;
+  ijvm_sink_put_int (sink, pc - sink->next_pc);
+  sink->buffer[sink->length++] = n;
+  memcpy (sink->buffer + sink->length, opcodes, n);
+  sink->length += n;
+  sink->next_pc = pc + n;
+}
+
+/* Record the stack as ijvm_print_stack (memory + sp, length, indent)
+ * would print it. */
+
+void
+ijvm_sink_stack (IJVMSink *sink, int32 *memory, uint32 sp,
+		 int length, bool indent)
+{
+  int32 values[8], *word;
+  uint8 mask;
+  int k, n;
+
+  if (length < 0)
+    length = 0;
+  if ((uint32) length > sp + 1)
+    length = sp + 1;
+
+  mask = 0;
+  n = 0;
+  for (k = 0; k < length; k++) {
+    word = ijvm_sink_shadow_word (&sink->shadow, sp - k);
+    if (*word != memory[sp - k]) {
+      *word = memory[sp - k];
+      values[n++] = memory[sp - k];
+      mask |= 1 << k;
+    }
+  }
+
+  ijvm_sink_reserve (sink, IJVM_SINK_MAX_RECORD);
+  sink->buffer[sink->length++] = indent ? IJVM_SINK_STACK_INDENT : IJVM_SINK_STACK;
+  ijvm_sink_put_int (sink, sp - sink->sp);
+  sink->buffer[sink->length++] = length;
+  sink->buffer[sink->length++] = mask;
+  for (k = 0; k < n; k++)
+    ijvm_sink_put_int (sink, values[k]);
+  sink->sp = sp;
+}
+
+void
+ijvm_sink_sp_out_of_range (IJVMSink *sink, int32 sp)
+{
+  ijvm_sink_reserve (sink, IJVM_SINK_MAX_RECORD);
+  sink->buffer[sink->length++] = IJVM_SINK_SP_RANGE;
+  ijvm_sink_put_int (sink, sp);
+}
+
+void
+ijvm_sink_char (IJVMSink *sink, int c)
+{
+  ijvm_sink_reserve (sink, 2);
+  sink->buffer[sink->length++] = IJVM_SINK_CHAR;
+  sink->buffer[sink->length++] = c;
+}
+
+void
+ijvm_sink_vprintf (IJVMSink *sink, const char *format, va_list ap)
+{
+  va_list aq;
+  char *text;
+  int n;
+
+  va_copy (aq, ap);
+  n = vsnprintf (NULL, 0, format, aq);
+  va_end (aq);
+  text = malloc (n + 1);
+  vsprintf (text, format, ap);
+
+  ijvm_sink_reserve (sink, IJVM_SINK_MAX_RECORD);
+  sink->buffer[sink->length++] = IJVM_SINK_TEXT;
+  ijvm_sink_put_uint (sink, n);
+  if (sink->length + n > IJVM_SINK_BUFFER_SIZE) {
+    ijvm_sink_flush (sink);
+    fwrite (text, 1, n, sink->file);
+  }
+  else {
+    memcpy (sink->buffer + sink->length, text, n);
+    sink->length += n;
+  }
+  free (text);
+}
+
+void
+ijvm_sink_printf (IJVMSink *sink, const char *format, ...)
+{
+  va_list ap;
+
+  va_start (ap, format);
+  ijvm_sink_vprintf (sink, format, ap);
+  va_end (ap);
+}
+
+void
+ijvm_sink_close (IJVMSink *sink)
+{
+  ijvm_sink_flush (sink);
+  fclose (sink->file);
+  free (sink->buffer);
+  ijvm_sink_shadow_free (&sink->shadow);
+  free (sink);
+}
+
+/* Reading traces. */
+
+static bool
+ijvm_sink_get_uint (FILE *file, uint32 *value)
+{
+  int c, shift;
+
+  *value = 0;
+  for (shift = 0; shift < 35; shift += 7) {
+    c = getc (file);
+    if (c == EOF)
+      return FALSE;
+    *value |= (uint32) (c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+static bool
+ijvm_sink_get_int (FILE *file, int32 *value)
+{
+  uint32 u;
+
+  if (!ijvm_sink_get_uint (file, &u))
+    return FALSE;
+  *value = (int32) (u >> 1) ^ -(int32) (u & 1);
+  return TRUE;
+}
+
+/* Print the records that follow the header of a trace in file, with
+ * shadow as the memory seen so far.  Returns FALSE if they are cut
+ * short or make no sense. */
+
+static bool
+ijvm_sink_render_records (FILE *file, IJVMSpec *spec, IJVMSinkShadow *shadow)
+{
+  uint8 opcodes[256];
+  int32 delta, value, window[8], *word;
+  uint32 sp, n;
+  int tag, c, length, mask, k;
+
+  sp = 0;
+  while ((tag = getc (file)) != EOF) {
+    switch (tag) {
+    case IJVM_SINK_INSN:
+      if (!ijvm_sink_get_int (file, &delta) ||
+	  (length = getc (file)) == EOF ||
+	  fread (opcodes, 1, length, file) != (size_t) length)
+	return FALSE;
+      ijvm_print_snapshot (spec, opcodes);
+      break;
+
+    case IJVM_SINK_STACK:
+    case IJVM_SINK_STACK_INDENT:
+      if (!ijvm_sink_get_int (file, &delta) ||
+	  (length = getc (file)) == EOF ||
+	  (mask = getc (file)) == EOF ||
+	  length > 8 || (uint32) length > sp + delta + 1)
+	return FALSE;
+      sp += delta;
+      /* The slots from sp down, as ijvm_print_stack walks them */
+      for (k = 0; k < length; k++) {
+	word = ijvm_sink_shadow_word (shadow, sp - k);
+	if (mask & 1 << k) {
+	  if (!ijvm_sink_get_int (file, &value))
+	    return FALSE;
+	  *word = value;
+	}
+	window[7 - k] = *word;
+      }
+      ijvm_print_stack (window + 7, length, tag == IJVM_SINK_STACK_INDENT);
+      break;
+
+    case IJVM_SINK_SP_RANGE:
+      if (!ijvm_sink_get_int (file, &value))
+	return FALSE;
+      printf ("SP out of range (SP = %d)\n", value);
+      break;
+
+    case IJVM_SINK_CHAR:
+      if ((c = getc (file)) == EOF)
+	return FALSE;
+      putchar (c);
+      break;
+
+    case IJVM_SINK_TEXT:
+      if (!ijvm_sink_get_uint (file, &n))
+	return FALSE;
+      for (; n > 0; n--) {
+	if ((c = getc (file)) == EOF)
+	  return FALSE;
+	putchar (c);
+      }
+      break;
+
+    default:
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Print the text trace recorded in file on stdout, disassembling with
+ * spec.  Returns FALSE if the file isn't a trace or is truncated. */
+
+bool
+ijvm_sink_render (FILE *file, IJVMSpec *spec)
+{
+  IJVMSinkShadow shadow;
+  uint8 header[8];
+  bool ok;
+
+  if (fread (header, 1, 8, file) != 8 ||
+      memcmp (header, ijvm_sink_magic, 7) != 0 ||
+      header[7] != IJVM_SINK_VERSION)
+    return FALSE;
+
+  memset (&shadow, 0, sizeof (shadow));
+  ok = ijvm_sink_render_records (file, spec, &shadow);
+  ijvm_sink_shadow_free (&shadow);
+
+  return ok;
+}
@@ -0,0 +1,30 @@
+#ifndef IJVM_SINK_H
+#define IJVM_SINK_H
+
+#include <stdarg.h>
+#include "types.h"
+#include "ijvm-spec.h"
+
+/* ijvm-sink.h
+ *
+ * Binary traces.  Instead of printing a snapshot and the stack for
+ * every instruction, ijvm and mic1 can write what the snapshot would
+ * be computed from to a trace sink, and ijvm-trace renders the text
+ * trace from that file later. */
+
+typedef struct IJVMSink IJVMSink;
+
+IJVMSink *ijvm_sink_new (FILE *file, IJVMSpec *spec);
+void ijvm_sink_insn (IJVMSink *sink, uint32 pc, uint8 *opcodes);
+void ijvm_sink_stack (IJVMSink *sink, int32 *memory, uint32 sp,
+		      int length, bool indent);
+void ijvm_sink_sp_out_of_range (IJVMSink *sink, int32 sp);
+void ijvm_sink_char (IJVMSink *sink, int c);
+void ijvm_sink_vprintf (IJVMSink *sink, const char *format, va_list ap);
+void ijvm_sink_printf (IJVMSink *sink, const char *format, ...);
+void ijvm_sink_flush (IJVMSink *sink);
+void ijvm_sink_close (IJVMSink *sink);
+
+bool ijvm_sink_render (FILE *file, IJVMSpec *spec);
+
+#endif
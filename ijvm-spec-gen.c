@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "ijvm-spec.h"
+
+/* ijvm-spec-gen.c
+ *
+ * Compiles a specification file into C, for the spec the tools use
+ * unless they are given one with -f or IJVM_SPEC_FILE.  The output,
+ * ijvm-spec-table.h, is included by ijvm-spec.c and defines
+ * ijvm_builtin_spec: the templates, their operands and the lookup
+ * tables of IJVMSpec as they are after ijvm_spec_parse, so that the
+ * tools need not read and parse the file each time they start.  This
+ * program is linked with its own copy of ijvm-spec.c, compiled with
+ * IJVM_SPEC_GEN defined, which leaves the table out.
+ *
+ * Usage: ijvm-spec-gen SPEC-FILE > ijvm-spec-table.h */
+
+static char *operand_kinds[] =
+{
+  "IJVM_OPERAND_BYTE",
+  "IJVM_OPERAND_LABEL",
+  "IJVM_OPERAND_METHOD",
+  "IJVM_OPERAND_VARNUM",
+  "IJVM_OPERAND_VARNUM_WIDE",
+  "IJVM_OPERAND_CONSTANT"
+};
+
+/* Print a reference to tmpl, the way the table names it. */
+
+static void
+print_template (IJVMSpec *spec, IJVMInsnTemplate *tmpl)
+{
+  int i;
+
+  if (tmpl == NULL) {
+    printf ("NULL");
+    return;
+  }
+  for (i = 0; spec->templates[i] != tmpl; i++)
+    ;
+  printf ("&ijvm_builtin_templates[%d]", i);
+}
+
+static void
+print_string (char *str)
+{
+  putchar ('"');
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      putchar ('\\');
+    putchar (*str);
+  }
+  putchar ('"');
+}
+
+int
+main (int argc, char *argv[])
+{
+  IJVMSpec *spec;
+  IJVMInsnTemplate *tmpl;
+  FILE *f;
+  int i, j;
+
+  if (argc != 2) {
+    fprintf (stderr, "Usage: ijvm-spec-gen SPEC-FILE\n");
+    exit (-1);
+  }
+  f = fopen (argv[1], "r");
+  if (f == NULL) {
+    fprintf (stderr, "Couldn't read specification file `%s'.\n", argv[1]);
+    exit (-1);
+  }
+  spec = ijvm_spec_parse (f);
+  fclose (f);
+
+  printf ("/* ijvm-spec-table.h, generated from %s by ijvm-spec-gen.\n"
+	  " * Do not edit. */\n\n", argv[1]);
+
+  for (i = 0; i < spec->ntemplates; i++) {
+    tmpl = spec->templates[i];
+    if (tmpl->noperands == 0)
+      continue;
+    printf ("static IJVMOperandKind ijvm_builtin_operands_%d[] = {", i);
+    for (j = 0; j < tmpl->noperands; j++)
+      printf ("%s %s", j ? "," : "", operand_kinds[tmpl->operands[j]]);
+    printf (" };\n");
+  }
+
+  printf ("\nstatic IJVMInsnTemplate ijvm_builtin_templates[] =\n{\n");
+  for (i = 0; i < spec->ntemplates; i++) {
+    tmpl = spec->templates[i];
+    printf ("  { 0x%02x, ", tmpl->opcode);
+    print_string (tmpl->mnemonic);
+    if (tmpl->noperands == 0)
+      printf (", NULL, 0, 0 }");
+    else
+      printf (", ijvm_builtin_operands_%d, %d, %d }", i,
+	      tmpl->noperands, tmpl->noperands);
+    printf ("%s\n", i + 1 < spec->ntemplates ? "," : "");
+  }
+  printf ("};\n");
+
+  printf ("\nstatic IJVMInsnTemplate *ijvm_builtin_template_list[] =\n{\n");
+  for (i = 0; i < spec->ntemplates; i++) {
+    printf ("  ");
+    print_template (spec, spec->templates[i]);
+    printf ("%s\n", i + 1 < spec->ntemplates ? "," : "");
+  }
+  printf ("};\n");
+
+  printf ("\nstatic IJVMInsnTemplate *ijvm_builtin_by_mnemonic[%d] =\n{\n",
+	  spec->nbuckets);
+  for (i = 0; i < spec->nbuckets; i++) {
+    printf ("  ");
+    print_template (spec, spec->by_mnemonic[i]);
+    printf ("%s\n", i + 1 < spec->nbuckets ? "," : "");
+  }
+  printf ("};\n");
+
+  printf ("\nstatic IJVMSpec ijvm_builtin_spec =\n{\n");
+  printf ("  ijvm_builtin_template_list, %d, %d,\n",
+	  spec->ntemplates, spec->ntemplates);
+  printf ("  {\n");
+  for (i = 0; i < 256; i++) {
+    printf ("    ");
+    print_template (spec, spec->by_opcode[i]);
+    printf ("%s\n", i < 255 ? "," : "");
+  }
+  printf ("  },\n");
+  printf ("  ijvm_builtin_by_mnemonic, %d\n", spec->nbuckets);
+  printf ("};\n");
+
+  return 0;
+}
@@ -5,6 +5,11 @@
 
 #include "ijvm-spec.h"
 
+/* The spec of ijvm.spec, compiled in by ijvm-spec-gen. */
+#ifndef IJVM_SPEC_GEN
+#include "ijvm-spec-table.h"
+#endif
+
 #define MAX_LINESIZE 80
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 
@@ -17,13 +22,59 @@ ijvm_spec_new ()
   spec->templates = NULL;
   spec->ntemplates = 0;
   spec->allocation = 0;
+  memset (spec->by_opcode, 0, sizeof (spec->by_opcode));
+  spec->by_mnemonic = NULL;
+  spec->nbuckets = 0;
 
   return spec;
 }    
 
+/* Case insensitive hash of a mnemonic (32 bit FNV-1a of the lower
+ * case letters). */
+
+static unsigned int
+ijvm_spec_hash (char *mnemonic)
+{
+  unsigned int hash;
+
+  hash = 2166136261u;
+  for (; *mnemonic; mnemonic++)
+    hash = (hash ^ tolower ((unsigned char) *mnemonic)) * 16777619;
+
+  return hash;
+}
+
+/* The bucket of by_mnemonic that holds mnemonic, or the free one
+ * where it would go. */
+
+static int
+ijvm_spec_bucket (IJVMSpec *spec, char *mnemonic)
+{
+  int i;
+
+  i = ijvm_spec_hash (mnemonic) & (spec->nbuckets - 1);
+  while (spec->by_mnemonic[i] != NULL &&
+	 strcasecmp (mnemonic, spec->by_mnemonic[i]->mnemonic) != 0)
+    i = (i + 1) & (spec->nbuckets - 1);
+
+  return i;
+}
+
+static void
+ijvm_spec_index_mnemonic (IJVMSpec *spec, IJVMInsnTemplate *tmpl)
+{
+  int i;
+
+  i = ijvm_spec_bucket (spec, tmpl->mnemonic);
+  if (spec->by_mnemonic[i] == NULL)
+    spec->by_mnemonic[i] = tmpl;
+}
+
 void
 ijvm_spec_add_template (IJVMSpec *spec, IJVMInsnTemplate *tmpl)
 {
+  int i;
+
   if (spec->ntemplates == spec->allocation) {
     spec->allocation = MAX (16, spec->allocation * 2);
     spec->templates = realloc (spec->templates, 
@@ -31,17 +82,30 @@ ijvm_spec_add_template (IJVMSpec *spec, IJVMInsnTemplate *tmpl)
   }
   spec->templates[spec->ntemplates] = tmpl;
   spec->ntemplates++;
+
+  if (tmpl->opcode >= 0 && tmpl->opcode < 256 &&
+      spec->by_opcode[tmpl->opcode] == NULL)
+    spec->by_opcode[tmpl->opcode] = tmpl;
+
+  /* Keep the hash table at most half full, rebuilding it in the
+   * order of the templates when it grows. */
+  if (2 * spec->ntemplates > spec->nbuckets) {
+    free (spec->by_mnemonic);
+    spec->nbuckets = MAX (64, spec->nbuckets * 2);
+    spec->by_mnemonic = calloc (spec->nbuckets, sizeof (IJVMInsnTemplate *));
+    for (i = 0; i < spec->ntemplates; i++)
+      ijvm_spec_index_mnemonic (spec, spec->templates[i]);
+  }
+  else
+    ijvm_spec_index_mnemonic (spec, tmpl);
 }
 
 IJVMInsnTemplate *
 ijvm_spec_lookup_template_by_mnemonic (IJVMSpec *spec, char *mnemonic)
 {
-  int i;
-
-  for (i = 0; i < spec->ntemplates; i++)
-    if (strcasecmp (mnemonic, spec->templates[i]->mnemonic) == 0)
-      return spec->templates[i];
-  return NULL;
+  if (spec->nbuckets == 0)
+    return NULL;
+  return spec->by_mnemonic[ijvm_spec_bucket (spec, mnemonic)];
 }
 
 IJVMInsnTemplate *
@@ -49,6 +113,9 @@ ijvm_spec_lookup_template_by_opcode (IJVMSpec *spec, int opcode)
 {
   int i;
 
+  if (opcode >= 0 && opcode < 256)
+    return spec->by_opcode[opcode];
+
   for (i = 0; i < spec->ntemplates; i++)
     if (opcode == spec->templates[i]->opcode)
       return spec->templates[i];
@@ -249,9 +316,10 @@ ijvm_spec_parse (FILE *f)
 }
 
 /* Search command line for `-f' option, then look in environment
- * variable IJVM_SPEC_FILE and eventually fall back on compiled in
- * default in order to determine name of spec file.  The parse the
- * file and return the specification.
+ * variable IJVM_SPEC_FILE in order to determine name of spec file.
+ * Then parse the file and return the specification.  Without either,
+ * return the spec compiled in from ijvm.spec, which must not be
+ * added to.
  */
 
 IJVMSpec *
@@ -285,8 +353,13 @@ ijvm_spec_init (int *argc, char *argv[])
   if (spec_file == NULL) {
     if (getenv ("IJVM_SPEC_FILE") != NULL)
       spec_file = getenv ("IJVM_SPEC_FILE");
-    else
+    else {
+#ifndef IJVM_SPEC_GEN
+      return &ijvm_builtin_spec;
+#else
       spec_file = IJVM_DATADIR "/ijvm.spec";
+#endif
+    }
   }
 
   f = fopen (spec_file, "r");
@@ -5,9 +5,18 @@ typedef struct IJVMSpec IJVMSpec;
 typedef enum IJVMOperandKind IJVMOperandKind;
 typedef struct IJVMInsnTemplate IJVMInsnTemplate;
 
+/* Besides the templates in the order of the file, a spec keeps them
+ * by opcode and by mnemonic, for the lookups below; where two
+ * templates have the same opcode or mnemonic, the first one counts.
+ * by_mnemonic is a hash table of nbuckets entries, a power of two,
+ * with open addressing and at most half of them in use. */
+
 struct IJVMSpec {
   IJVMInsnTemplate **templates;
   int ntemplates, allocation;
+  IJVMInsnTemplate *by_opcode[256];
+  IJVMInsnTemplate **by_mnemonic;
+  int nbuckets;
 };
 
 enum IJVMOperandKind
@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ijvm.h"
+
+/* ijvm-stack.c
+ *
+ * Stack sizes.  The header of a method only tells how many arguments
+ * and locals its frame has; how far its operand stack grows is
+ * recorded in the image by ijvm-asm or found by ijvm_verify (see
+ * IJVMMaxStack).  With it, a call can check once that the whole frame
+ * of the method it calls fits in the memory, rather than leave it to
+ * the pushes to run into the end of it, and the memory a run can need
+ * at most is known for a program that doesn't recurse.  Such a
+ * program needs no checks at all once it is given that much memory.
+ *
+ * A frame takes nlocals + 2 words on top of the arguments, for the
+ * locals, the return address and the caller's LV, and then the
+ * operand stack.  The arguments of a call are part of the operand
+ * stack of the caller.
+ *
+ * What is found from the table is kept in the image, the first time
+ * it is asked for, and found again only when the table changes; see
+ * ijvm_image_set_max_stack.  A program running many times, in batch
+ * jobs or from the library, walks its calls once. */
+
+/* The words a call to the method at address needs above the stack
+ * of its caller, or -1 if its stack size isn't known. */
+
+static int32
+ijvm_stack_frame (IJVMImage *image, uint32 address)
+{
+  int32 words;
+
+  words = ijvm_image_max_stack (image, address);
+  if (words < 0 || address + 4 > image->method_area_size)
+    return -1;
+  return (image->method_area[address + 2] * 256 +
+	  image->method_area[address + 3] + 2 + words);
+}
+
+
+typedef struct IJVMStackWalk IJVMStackWalk;
+struct IJVMStackWalk
+{
+  IJVMImage *image;
+  uint8 *state;         /* Per max_stack entry: 0, 1 on the path, 2 done */
+  unsigned long *worst; /* Words the call needs at most, when done */
+  int *reached;         /* Per byte: 1 + the entry that last reached it */
+  uint32 *work;         /* Instructions left to look at, of all walks */
+  int nwork, work_alloc;
+  char *why;
+};
+
+/* Reach the instruction at pc from the method that is entry j. */
+
+static void
+ijvm_stack_reach (IJVMStackWalk *w, uint32 pc, int j)
+{
+  if (pc < w->image->method_area_size) {
+    if (w->reached[pc] == j + 1)
+      return;
+    w->reached[pc] = j + 1;
+  }
+
+  if (w->nwork == w->work_alloc) {
+    w->work_alloc = MAX (w->work_alloc * 2, 16);
+    w->work = realloc (w->work, w->work_alloc * sizeof (uint32));
+  }
+  w->work[w->nwork++] = pc;
+}
+
+/* The most words a call to the method that is entry j of the max
+ * stack table can need, with the calls it makes, or 0 if there is no
+ * telling. */
+
+static unsigned long
+ijvm_stack_walk (IJVMStackWalk *w, int j)
+{
+  IJVMImage *image;
+  IJVMStackEffect *effect;
+  uint8 *m;
+  uint32 address, pc, index;
+  unsigned long callee, most;
+  int base, k;
+
+  image = w->image;
+  m = image->method_area;
+  address = image->max_stack[j].address;
+  if (w->state[j] == 2)
+    return w->worst[j];
+  if (w->state[j] == 1) {
+    snprintf (w->why, IJVM_ERROR_SIZE,
+	      "the method at 0x%04x is recursive", address);
+    return 0;
+  }
+  w->state[j] = 1;
+
+  /* The method area has no record of where a method ends, so its code
+   * is followed from the start, through the branches, as far as it
+   * goes, as ijvm_verify does.  The work list is shared with the walks
+   * of the methods it calls, which leave it as they found it. */
+  base = w->nwork;
+  ijvm_stack_reach (w, address + 4, j);
+
+  most = 0;
+  while (w->nwork > base) {
+    pc = w->work[--w->nwork];
+    effect = pc < image->method_area_size ? ijvm_stack_effect (m[pc]) : NULL;
+    if (effect == NULL || pc + effect->length > image->method_area_size) {
+      snprintf (w->why, IJVM_ERROR_SIZE,
+		"the method at 0x%04x has code that isn't IJVM at 0x%04x",
+		address, pc);
+      return 0;
+    }
+    if (m[pc] == IJVM_OPCODE_WIDE &&
+	m[pc + 1] != IJVM_OPCODE_ILOAD && m[pc + 1] != IJVM_OPCODE_ISTORE)
+      effect = ijvm_stack_effect (IJVM_OPCODE_NOP);
+
+    switch (m[pc]) {
+    case IJVM_OPCODE_GOTO:
+    case IJVM_OPCODE_IFEQ:
+    case IJVM_OPCODE_IFLT:
+    case IJVM_OPCODE_IF_ICMPEQ:
+      ijvm_stack_reach (w, pc + (int16) (m[pc + 1] * 256 + m[pc + 2]), j);
+      break;
+    }
+    if (m[pc] != IJVM_OPCODE_GOTO && m[pc] != IJVM_OPCODE_IRETURN)
+      ijvm_stack_reach (w, pc + effect->length, j);
+    if (m[pc] != IJVM_OPCODE_INVOKEVIRTUAL)
+      continue;
+
+    index = m[pc + 1] * 256 + m[pc + 2];
+    if (index >= 0x8000)
+      continue;
+    k = index < image->cpool_size ?
+      ijvm_image_max_stack_entry (image, image->cpool[index]) : -1;
+    if (k < 0) {
+      snprintf (w->why, IJVM_ERROR_SIZE,
+		"the stack size of the method invoked at 0x%04x isn't known",
+		pc);
+      return 0;
+    }
+    callee = ijvm_stack_walk (w, k);
+    if (callee == 0)
+      return 0;
+    most = MAX (most, callee);
+  }
+
+  w->state[j] = 2;
+  w->worst[j] = ijvm_stack_frame (image, address) + most;
+  return w->worst[j];
+}
+
+/* The most bytes of memory a run of image can need, see
+ * ijvm_stack_estimate, or 0 with the reason in why. */
+
+static unsigned long
+ijvm_stack_walk_main (IJVMImage *image, char *why)
+{
+  IJVMStackWalk w;
+  uint32 address;
+  unsigned long words;
+  int j;
+
+  strcpy (why, "no stack sizes are recorded in the image");
+  if (image->main_index >= image->cpool_size)
+    return 0;
+  address = image->cpool[image->main_index];
+  j = ijvm_image_max_stack_entry (image, address);
+  if (j < 0)
+    return 0;
+
+  w.image = image;
+  w.state = calloc (image->nmax_stack, 1);
+  w.worst = calloc (image->nmax_stack, sizeof (unsigned long));
+  w.reached = calloc (image->method_area_size + 1, sizeof (int));
+  w.work = NULL;
+  w.nwork = w.work_alloc = 0;
+  w.why = why;
+  words = ijvm_stack_walk (&w, j);
+  free (w.state);
+  free (w.worst);
+  free (w.reached);
+  free (w.work);
+  if (words == 0)
+    return 0;
+
+  /* The object reference and arguments of main. */
+  words += image->method_area[address] * 256 + image->method_area[address + 1];
+  words += (image->method_area_size + 3) / 4 + image->cpool_size;
+
+  return words * 4;
+}
+
+/* Find the estimate and the frames of image from its table. */
+
+static void
+ijvm_stack_find (IJVMImage *image)
+{
+  char why[IJVM_ERROR_SIZE];
+  int32 words;
+  int j;
+
+  image->stack_estimate = ijvm_stack_walk_main (image, why);
+  free (image->stack_why);
+  image->stack_why = strdup (why);
+
+  free (image->frames);
+  image->frames = NULL;
+  if (image->nmax_stack > 0) {
+    image->frames = calloc (MAX (image->cpool_size, 1), sizeof (uint32));
+    for (j = 0; j < image->cpool_size; j++) {
+      words = ijvm_stack_frame (image, image->cpool[j]);
+      if (words > 0)
+	image->frames[j] = words;
+    }
+  }
+
+  image->stack_found = TRUE;
+}
+
+/* The most bytes of memory a run of image can need: the method area,
+ * the constant pool and the deepest frames its calls can stack up.
+ * Returns 0 if that can't be told, because a method is recursive or
+ * its stack size isn't known, and says why in why, which has room for
+ * IJVM_ERROR_SIZE characters. */
+
+unsigned long
+ijvm_stack_estimate (IJVMImage *image, char *why)
+{
+  if (!image->stack_found)
+    ijvm_stack_find (image);
+  strcpy (why, image->stack_why);
+  return image->stack_estimate;
+}
+
+/* The words each constant pool index needs for a call, see
+ * ijvm_invoke_virtual, or 0 where it isn't known or isn't a method.
+ * Returns NULL if nothing is known.  The frames belong to image. */
+
+uint32 *
+ijvm_stack_frames (IJVMImage *image)
+{
+  if (!image->stack_found)
+    ijvm_stack_find (image);
+  return image->frames;
+}
@@ -0,0 +1,44 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "ijvm-util.h"
+#include "ijvm-sink.h"
+
+/* ijvm-trace.c
+ *
+ * Render a binary trace written by `ijvm -T' or `mic1 -T' as the text
+ * trace the simulator would have printed. */
+
+int
+main (int argc, char *argv[])
+{
+  FILE *file;
+  IJVMSpec *spec;
+
+  spec = ijvm_print_init (&argc, argv);
+
+  if (argc != 2) {
+    fprintf (stderr, "Usage: ijvm-trace [-f SPEC-FILE] TRACE-FILE\n\n");
+    fprintf (stderr, "Print the binary trace in TRACE-FILE as text.  Use the same\n");
+    fprintf (stderr, "specification file as the run that wrote the trace.\n");
+    exit (-1);
+  }
+
+  if (strcmp (argv[1], "-") == 0)
+    file = stdin;
+  else
+    file = fopen (argv[1], "rb");
+  if (file == NULL) {
+    printf ("Could not open trace file `%s'\n", argv[1]);
+    exit (-1);
+  }
+
+  if (!ijvm_sink_render (file, spec)) {
+    fflush (stdout);
+    fprintf (stderr, "`%s' is not a trace file or is truncated\n", argv[1]);
+    exit (-1);
+  }
+  fclose (file);
+
+  return 0;
+}
@@ -1,7 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 #include <termios.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "ijvm-spec.h"
 #include "ijvm-util.h"
@@ -9,10 +14,9 @@
 /* ijvm-util.c
  *
  * This file contains functions to disassemble and print IJVM
- * instructions as defined in the configuration file. */
-
-static IJVMSpec *ijvm_spec;
-
+ * instructions as defined in the configuration file.  The
+ * specification is passed to each function that needs it, so the
+ * only state kept here is the terminal setup of the programs. */
 
 IJVMImage *ijvm_image_new (uint16 main_index, 
 			   uint8 *method_area, uint32 method_area_size,
@@ -28,75 +32,779 @@ IJVMImage *ijvm_image_new (uint16 main_index,
   image->cpool = malloc (cpool_size * sizeof (int32));
   memcpy (image->cpool, cpool, cpool_size * sizeof (int32));
   image->cpool_size = cpool_size;
+  image->verified = FALSE;
+  image->max_stack = NULL;
+  image->nmax_stack = 0;
+  image->stack_found = FALSE;
+  image->stack_estimate = 0;
+  image->stack_why = NULL;
+  image->frames = NULL;
+  image->mapping = NULL;
+  image->mapping_size = 0;
 
   return image;
 }
 
-IJVMImage *
-ijvm_image_load (FILE *file)
+/* The binary image format.  A binary image starts with a header page
+ * that holds the sizes and offsets of the sections after it; the
+ * method area and the constant pool each start on a page of their
+ * own, so that a loader can map the file and use them where they
+ * are.  The stack sizes follow the constant pool, as pairs of words.
+ * All numbers are in the byte order of the machine that wrote the
+ * image; a machine of the other byte order doesn't take it.  The
+ * checksum covers everything after the header.
+ *
+ * Text images start with `main index', so the first byte of magic
+ * tells the two formats apart. */
+
+#define IJVM_IMAGE_MAGIC      "\177IJVM\r\n\032"
+#define IJVM_IMAGE_BYTE_ORDER 0x01020304
+#define IJVM_IMAGE_VERSION    1
+#define IJVM_IMAGE_PAGE       4096
+
+#define IJVM_IMAGE_ALIGN(n, size) (((n) + (size) - 1) / (size) * (size))
+
+typedef struct IJVMImageHeader IJVMImageHeader;
+struct IJVMImageHeader {
+  char magic[8];
+  uint32 byte_order;
+  uint32 version;
+  uint32 main_index;
+  uint32 method_area_offset, method_area_size;
+  uint32 cpool_offset, cpool_size;        /* In words */
+  uint32 max_stack_offset, nmax_stack;
+  uint32 size;                            /* Of the whole file */
+  uint32 checksum;
+};
+
+/* 32 bit FNV-1a of length bytes at data. */
+
+static uint32
+ijvm_image_checksum (uint8 *data, unsigned long length)
+{
+  uint32 hash;
+  unsigned long j;
+
+  hash = 2166136261u;
+  for (j = 0; j < length; j++)
+    hash = (hash ^ data[j]) * 16777619;
+
+  return hash;
+}
+
+/* Why an image couldn't be read, see ijvm_image_read_error. */
+
+#define IJVM_IMAGE_ERROR_SIZE 256
+
+/* Take the binary image of size bytes at data, or return NULL if it
+ * isn't a sound one and say why in error.  If mapped, data is a
+ * mapping of the file that the image keeps and points into;
+ * otherwise its sections are copied out and data stays with the
+ * caller. */
+
+static IJVMImage *
+ijvm_image_from_binary (uint8 *data, unsigned long size, bool mapped,
+			char *error)
 {
+  IJVMImageHeader *header;
   IJVMImage *image;
-  int j, fields;
-  uint32 byte, method_area_size, cpool_size, main_index;
-  int32 word;
+  uint32 *pairs;
+  int j;
+
+  header = (IJVMImageHeader *) data;
+  if (size < sizeof (IJVMImageHeader) ||
+      memcmp (header->magic, IJVM_IMAGE_MAGIC, 8) != 0) {
+    strcpy (error, "not an IJVM image");
+    return NULL;
+  }
+  if (header->byte_order != IJVM_IMAGE_BYTE_ORDER) {
+    strcpy (error, "the image was written with the other byte order");
+    return NULL;
+  }
+  if (header->version != IJVM_IMAGE_VERSION) {
+    snprintf (error, IJVM_IMAGE_ERROR_SIZE,
+	      "the image is of version %u, not %u",
+	      header->version, IJVM_IMAGE_VERSION);
+    return NULL;
+  }
+  if (header->size != size) {
+    snprintf (error, IJVM_IMAGE_ERROR_SIZE,
+	      "the image is %lu bytes, the header says %u",
+	      size, header->size);
+    return NULL;
+  }
+  if (header->main_index > 0xffff ||
+      header->method_area_offset % IJVM_IMAGE_PAGE != 0 ||
+      header->cpool_offset % IJVM_IMAGE_PAGE != 0 ||
+      header->max_stack_offset % 4 != 0 ||
+      header->method_area_offset < sizeof (IJVMImageHeader) ||
+      header->method_area_offset > size ||
+      header->method_area_size > size - header->method_area_offset ||
+      header->cpool_offset > size ||
+      header->cpool_size > (size - header->cpool_offset) / 4 ||
+      header->max_stack_offset > size ||
+      header->nmax_stack > (size - header->max_stack_offset) / 8) {
+    strcpy (error, "the header of the image is damaged");
+    return NULL;
+  }
+  if (header->checksum !=
+      ijvm_image_checksum (data + sizeof (IJVMImageHeader),
+			   size - sizeof (IJVMImageHeader))) {
+    strcpy (error, "the checksum of the image doesn't match");
+    return NULL;
+  }
 
   image = malloc (sizeof (IJVMImage));
+  image->main_index = header->main_index;
+  image->method_area_size = header->method_area_size;
+  image->cpool_size = header->cpool_size;
+  image->verified = FALSE;
+  image->max_stack = NULL;
+  image->nmax_stack = 0;
+  image->stack_found = FALSE;
+  image->stack_estimate = 0;
+  image->stack_why = NULL;
+  image->frames = NULL;
+  if (mapped) {
+    image->method_area = data + header->method_area_offset;
+    image->cpool = (int32 *) (data + header->cpool_offset);
+    image->mapping = data;
+    image->mapping_size = size;
+  }
+  else {
+    image->method_area = malloc (MAX (header->method_area_size, 1));
+    memcpy (image->method_area, data + header->method_area_offset,
+	    header->method_area_size);
+    image->cpool = malloc (MAX (header->cpool_size, 1) * sizeof (int32));
+    memcpy (image->cpool, data + header->cpool_offset,
+	    header->cpool_size * sizeof (int32));
+    image->mapping = NULL;
+    image->mapping_size = 0;
+  }
 
-  fields = fscanf (file, "main index: %d\n", &main_index);
-  if (fields == 0) {
-    printf ("Bytecode file not recognized\n");
-    exit (-1);
+  /* The table is small and may grow, see ijvm_image_set_max_stack. */
+  pairs = (uint32 *) (data + header->max_stack_offset);
+  for (j = 0; j < header->nmax_stack; j++)
+    ijvm_image_set_max_stack (image, pairs[2 * j], pairs[2 * j + 1]);
+
+  return image;
+}
+
+/* Read the rest of file into memory, with a 0 after it.  Sets size
+ * to the number of bytes read. */
+
+static uint8 *
+ijvm_image_slurp (FILE *file, unsigned long *size)
+{
+  uint8 *data;
+  unsigned long alloc;
+  size_t n;
+
+  data = NULL;
+  *size = alloc = 0;
+  do {
+    if (*size + 1 >= alloc) {
+      alloc = MAX (alloc * 2, IJVM_IMAGE_PAGE);
+      data = realloc (data, alloc);
+    }
+    n = fread (data + *size, 1, alloc - *size - 1, file);
+    *size += n;
+  } while (n > 0);
+  data[*size] = 0;
+
+  return data;
+}
+
+/* Read a binary image from file.  A regular file is mapped as it is;
+ * anything else, such as a pipe, is read into memory first. */
+
+static IJVMImage *
+ijvm_image_read_binary (FILE *file, char *error)
+{
+  IJVMImage *image;
+  struct stat st;
+  uint8 *data;
+  unsigned long size;
+  void *mapping;
+
+  if (fstat (fileno (file), &st) == 0 && S_ISREG (st.st_mode) &&
+      ftell (file) == 0 && st.st_size > 0) {
+    mapping = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		    fileno (file), 0);
+    if (mapping != MAP_FAILED) {
+      image = ijvm_image_from_binary (mapping, st.st_size, TRUE, error);
+      if (image == NULL)
+	munmap (mapping, st.st_size);
+      return image;
+    }
   }
-  image->main_index = main_index;
-    
-  fields = fscanf (file, "method area: %d bytes\n", &method_area_size);
-  if (fields == 0) {
-    printf ("Bytecode file not recognized\n");
-    exit (-1);
+
+  data = ijvm_image_slurp (file, &size);
+  image = ijvm_image_from_binary (data, size, FALSE, error);
+  free (data);
+
+  return image;
+}
+
+/* The text image format, as ijvm_image_write writes it:
+ *
+ *   main index: 0
+ *   method area: 49 bytes
+ *   00 01 00 00 10 0c ...       (16 bytes to a line, in hex)
+ *   constant pool: 2 words
+ *   00000000                    (a word to a line, in hex)
+ *   00000026
+ *   max stack: 2 methods        (optional)
+ *   0000 3                      (method address in hex, words)
+ *   0026 2
+ *
+ * Any white space may separate the numbers.  The file is read into
+ * memory in one go and parsed there, the bytes of the method area
+ * with the digit table below; an error says at which line and column
+ * the input stops making sense. */
+
+typedef struct IJVMImageParser IJVMImageParser;
+struct IJVMImageParser {
+  uint8 *p, *end;
+  uint8 *line_start;
+  int line;
+  char *error;
+};
+
+/* The value of each character as a digit, or -1. */
+
+static const signed char ijvm_image_digits[256] =
+{
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+#define IJVM_IMAGE_SPACE(c) ((c) == ' ' || (c) == '\n' || (c) == '\t' || \
+			     (c) == '\r')
+
+/* Say in the parser's error what is wrong at the current position.
+ * Returns FALSE, for the caller to return. */
+
+static bool
+ijvm_image_parse_error (IJVMImageParser *parser, char *format, ...)
+{
+  va_list ap;
+  int n;
+
+  n = snprintf (parser->error, IJVM_IMAGE_ERROR_SIZE, "line %d, column %d: ",
+		parser->line, (int) (parser->p - parser->line_start) + 1);
+  va_start (ap, format);
+  vsnprintf (parser->error + n, IJVM_IMAGE_ERROR_SIZE - n, format, ap);
+  va_end (ap);
+
+  return FALSE;
+}
+
+static void
+ijvm_image_parse_space (IJVMImageParser *parser)
+{
+  while (parser->p < parser->end && IJVM_IMAGE_SPACE (*parser->p)) {
+    if (*parser->p == '\n') {
+      parser->line++;
+      parser->line_start = parser->p + 1;
+    }
+    parser->p++;
   }
+}
 
-  image->method_area = malloc (method_area_size);
-  image->method_area_size = method_area_size;
-  for (j = 0; j < method_area_size; j++) {
-    fscanf (file, "%x", &byte);
+/* Skip white space and then text, where a space stands for any
+ * amount of white space. */
+
+static bool
+ijvm_image_parse_text (IJVMImageParser *parser, char *text)
+{
+  char *t;
+
+  ijvm_image_parse_space (parser);
+  for (t = text; *t != 0; t++) {
+    if (*t == ' ')
+      ijvm_image_parse_space (parser);
+    else if (parser->p < parser->end && *parser->p == *t)
+      parser->p++;
+    else
+      return ijvm_image_parse_error (parser, "expected `%s'", text);
+  }
+
+  return TRUE;
+}
+
+/* Skip white space and parse a number of at most digits digits in
+ * base (10 or 16), followed by white space or the end of the file. */
+
+static bool
+ijvm_image_parse_number (IJVMImageParser *parser, int base, int digits,
+			 uint32 *value)
+{
+  unsigned long n;
+  uint8 *start;
+  int d;
+
+  ijvm_image_parse_space (parser);
+  start = parser->p;
+  n = 0;
+  while (parser->p < parser->end &&
+	 (d = ijvm_image_digits[*parser->p]) >= 0 && d < base) {
+    n = n * base + d;
+    parser->p++;
+    if (parser->p - start > digits || n > 0xffffffffUL) {
+      parser->p = start;
+      return ijvm_image_parse_error (parser, "number out of range");
+    }
+  }
+  if (parser->p == start)
+    return ijvm_image_parse_error (parser, base == 16 ?
+				   "expected a hexadecimal number" :
+				   "expected a number");
+  if (parser->p < parser->end && !IJVM_IMAGE_SPACE (*parser->p))
+    return ijvm_image_parse_error (parser, "unexpected `%c'", *parser->p);
+
+  *value = n;
+  return TRUE;
+}
+
+/* Parse the method area of image: its bytes as two hex digits and a
+ * space each go through the fast path, anything else through
+ * ijvm_image_parse_number. */
+
+static bool
+ijvm_image_parse_method_area (IJVMImageParser *parser, IJVMImage *image)
+{
+  uint8 *p;
+  uint32 j, byte;
+  int high, low;
+
+  p = parser->p;
+  for (j = 0; j < image->method_area_size; j++) {
+    /* The buffer ends in a 0, so p[1] and p[2] can always be read. */
+    if (*p == ' ')
+      p++;
+    high = ijvm_image_digits[p[0]];
+    low = ijvm_image_digits[p[1]];
+    if (high >= 0 && low >= 0 && (p[2] == ' ' || p[2] == '\n')) {
+      image->method_area[j] = high * 16 + low;
+      p += 2;
+      continue;
+    }
+
+    parser->p = p;
+    if (!ijvm_image_parse_number (parser, 16, 2, &byte))
+      return FALSE;
     image->method_area[j] = byte;
+    p = parser->p;
   }
+  parser->p = p;
 
-  fields = fscanf (file, "\nconstant pool: %d words\n", &cpool_size);
-  if (fields == 0) {
-    printf ("Bytecode file not recognized\n");
-    exit (-1);
+  return TRUE;
+}
+
+static IJVMImage *
+ijvm_image_parse (IJVMImageParser *parser)
+{
+  IJVMImage *image;
+  uint32 main_index, size, address, words, word, n, j;
+
+  if (!ijvm_image_parse_text (parser, "main index:") ||
+      !ijvm_image_parse_number (parser, 10, 5, &main_index))
+    return NULL;
+  if (main_index > 0xffff) {
+    ijvm_image_parse_error (parser, "main index out of range");
+    return NULL;
+  }
+  if (!ijvm_image_parse_text (parser, "method area:") ||
+      !ijvm_image_parse_number (parser, 10, 10, &size))
+    return NULL;
+  /* Each byte takes at least two characters, so a size the file can't
+   * hold is caught before it is allocated. */
+  if (size > (parser->end - parser->p) / 2) {
+    ijvm_image_parse_error (parser, "the file is too short for %u bytes",
+			    size);
+    return NULL;
   }
+  if (!ijvm_image_parse_text (parser, " bytes"))
+    return NULL;
 
-  image->cpool = malloc (cpool_size * sizeof(int32));
-  image->cpool_size = cpool_size;
-  for (j = 0; j < cpool_size; j++) {
-    fscanf (file, "%x", &word);
+  image = malloc (sizeof (IJVMImage));
+  image->main_index = main_index;
+  image->method_area = malloc (MAX (size, 1));
+  image->method_area_size = size;
+  image->cpool = NULL;
+  image->cpool_size = 0;
+  image->verified = FALSE;
+  image->max_stack = NULL;
+  image->nmax_stack = 0;
+  image->stack_found = FALSE;
+  image->stack_estimate = 0;
+  image->stack_why = NULL;
+  image->frames = NULL;
+  image->mapping = NULL;
+  image->mapping_size = 0;
+
+  if (!ijvm_image_parse_method_area (parser, image) ||
+      !ijvm_image_parse_text (parser, "constant pool:") ||
+      !ijvm_image_parse_number (parser, 10, 10, &size)) {
+    ijvm_image_free (image);
+    return NULL;
+  }
+  if (size > (parser->end - parser->p) / 2) {
+    ijvm_image_parse_error (parser, "the file is too short for %u words",
+			    size);
+    ijvm_image_free (image);
+    return NULL;
+  }
+  if (!ijvm_image_parse_text (parser, " words")) {
+    ijvm_image_free (image);
+    return NULL;
+  }
+
+  image->cpool = malloc (MAX (size, 1) * sizeof (int32));
+  image->cpool_size = size;
+  for (j = 0; j < size; j++) {
+    if (!ijvm_image_parse_number (parser, 16, 8, &word)) {
+      ijvm_image_free (image);
+      return NULL;
+    }
     image->cpool[j] = word;
   }
 
+  /* The stack sizes ijvm-asm records after the constant pool are
+   * optional, and readers that don't know them stop before them. */
+  ijvm_image_parse_space (parser);
+  if (parser->end - parser->p < 10 || memcmp (parser->p, "max stack:", 10) != 0)
+    return image;
+  if (!ijvm_image_parse_text (parser, "max stack:") ||
+      !ijvm_image_parse_number (parser, 10, 10, &n) ||
+      !ijvm_image_parse_text (parser, " methods")) {
+    ijvm_image_free (image);
+    return NULL;
+  }
+  for (j = 0; j < n; j++) {
+    if (!ijvm_image_parse_number (parser, 16, 8, &address) ||
+	!ijvm_image_parse_number (parser, 10, 10, &words)) {
+      ijvm_image_free (image);
+      return NULL;
+    }
+    ijvm_image_set_max_stack (image, address, words);
+  }
+
+  return image;
+}
+
+/* Read a bytecode image, in the text format or the binary one, or
+ * return NULL if file doesn't hold one and say why in error, which
+ * has room for IJVM_IMAGE_ERROR_SIZE characters. */
+
+static IJVMImage *
+ijvm_image_read_error (FILE *file, char *error)
+{
+  IJVMImageParser parser;
+  IJVMImage *image;
+  unsigned long size;
+  uint8 *data;
+  int c;
+
+  c = getc (file);
+  if (c == EOF) {
+    strcpy (error, "the file is empty");
+    return NULL;
+  }
+  ungetc (c, file);
+  if (c == IJVM_IMAGE_MAGIC[0])
+    return ijvm_image_read_binary (file, error);
+
+  data = ijvm_image_slurp (file, &size);
+  parser.p = parser.line_start = data;
+  parser.end = data + size;
+  parser.line = 1;
+  parser.error = error;
+  image = ijvm_image_parse (&parser);
+  free (data);
+
+  return image;
+}
+
+/* Read a bytecode image, in the text format or the binary one, or
+ * return NULL if file doesn't hold one. */
+
+IJVMImage *
+ijvm_image_read (FILE *file)
+{
+  char error[IJVM_IMAGE_ERROR_SIZE];
+
+  return ijvm_image_read_error (file, error);
+}
+
+IJVMImage *
+ijvm_image_load (FILE *file)
+{
+  IJVMImage *image;
+  char error[IJVM_IMAGE_ERROR_SIZE];
+
+  image = ijvm_image_read_error (file, error);
+  if (image == NULL) {
+    printf ("Bytecode file not recognized: %s\n", error);
+    exit (-1);
+  }
+
   return image;
 }
 
 void
-ijvm_image_write (FILE *file, IJVMImage *image)
+ijvm_image_free (IJVMImage *image)
 {
-  int i;
+  if (image->mapping != NULL)
+    munmap (image->mapping, image->mapping_size);
+  else {
+    free (image->method_area);
+    free (image->cpool);
+  }
+  free (image->max_stack);
+  free (image->stack_why);
+  free (image->frames);
+  free (image);
+}
 
-  fprintf (file, "main index: %d\n", image->main_index);
-  fprintf (file, "method area: %d bytes\n", image->method_area_size);
+/* Write image in the text format, see IJVMImageParser.  The whole
+ * image is formatted into one buffer and written at once. */
+
+void
+ijvm_image_write (FILE *file, IJVMImage *image)
+{
+  static const char hex[] = "0123456789abcdef";
+  char *buffer, *p;
+  uint32 word;
+  int i, k;
+
+  /* Three characters to a byte, nine to a word, at most 21 to a max
+   * stack entry and 64 to a line of text. */
+  buffer = malloc (4 * 64 + 3 * image->method_area_size +
+		   9 * image->cpool_size + 21 * image->nmax_stack);
+  p = buffer;
+
+  p += sprintf (p, "main index: %d\n", image->main_index);
+  p += sprintf (p, "method area: %d bytes\n", image->method_area_size);
   for (i = 0; i < image->method_area_size; i++) {
-    fprintf (file, "%02x", image->method_area[i] & 255);
-    if ((i & 15) == 15 && i < image->method_area_size - 1)
-      fprintf (file, "\n");
+    *p++ = hex[image->method_area[i] >> 4];
+    *p++ = hex[image->method_area[i] & 15];
+    *p++ = (i & 15) == 15 && i < image->method_area_size - 1 ? '\n' : ' ';
+  }
+  if (i > 0)
+    *p++ = '\n';
+  p += sprintf (p, "constant pool: %d words\n", image->cpool_size);
+  for (i = 0; i < image->cpool_size; i++) {
+    word = image->cpool[i];
+    for (k = 28; k >= 0; k -= 4)
+      *p++ = hex[(word >> k) & 15];
+    *p++ = '\n';
+  }
+  if (image->nmax_stack > 0) {
+    p += sprintf (p, "max stack: %d methods\n", image->nmax_stack);
+    for (i = 0; i < image->nmax_stack; i++)
+      p += sprintf (p, "%04x %d\n", image->max_stack[i].address,
+		    image->max_stack[i].words);
+  }
+
+  fwrite (buffer, 1, p - buffer, file);
+  free (buffer);
+}
+
+/* Write image in the binary format, see IJVMImageHeader. */
+
+void
+ijvm_image_write_binary (FILE *file, IJVMImage *image)
+{
+  IJVMImageHeader *header;
+  uint8 *data;
+  uint32 *pairs;
+  unsigned long size;
+  int j;
+
+  data = calloc (1, IJVM_IMAGE_PAGE);
+  header = (IJVMImageHeader *) data;
+  memcpy (header->magic, IJVM_IMAGE_MAGIC, 8);
+  header->byte_order = IJVM_IMAGE_BYTE_ORDER;
+  header->version = IJVM_IMAGE_VERSION;
+  header->main_index = image->main_index;
+  header->method_area_offset = IJVM_IMAGE_PAGE;
+  header->method_area_size = image->method_area_size;
+  header->cpool_offset =
+    IJVM_IMAGE_ALIGN (IJVM_IMAGE_PAGE + image->method_area_size,
+		      IJVM_IMAGE_PAGE);
+  header->cpool_size = image->cpool_size;
+  header->max_stack_offset = header->cpool_offset + image->cpool_size * 4;
+  header->nmax_stack = image->nmax_stack;
+  size = header->max_stack_offset + image->nmax_stack * 8;
+  header->size = size;
+
+  data = realloc (data, size);
+  header = (IJVMImageHeader *) data;
+  memset (data + IJVM_IMAGE_PAGE, 0, size - IJVM_IMAGE_PAGE);
+  memcpy (data + header->method_area_offset, image->method_area,
+	  image->method_area_size);
+  memcpy (data + header->cpool_offset, image->cpool,
+	  image->cpool_size * sizeof (int32));
+  pairs = (uint32 *) (data + header->max_stack_offset);
+  for (j = 0; j < image->nmax_stack; j++) {
+    pairs[2 * j] = image->max_stack[j].address;
+    pairs[2 * j + 1] = image->max_stack[j].words;
+  }
+  header->checksum = ijvm_image_checksum (data + sizeof (IJVMImageHeader),
+					  size - sizeof (IJVMImageHeader));
+
+  fwrite (data, 1, size, file);
+  free (data);
+}
+
+/* The index in image->max_stack of the method at address, or -1 if
+ * there is none. */
+
+int
+ijvm_image_max_stack_entry (IJVMImage *image, uint32 address)
+{
+  int low, high, middle;
+
+  low = 0;
+  high = image->nmax_stack;
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (image->max_stack[middle].address < address)
+      low = middle + 1;
     else
-      fprintf (file, " ");
+      high = middle;
   }
-  if ((i & 15) != 0)
-    fprintf (file, "\n");
-  fprintf (file, "constant pool: %d words\n", image->cpool_size);
-  for (i = 0; i < image->cpool_size; i++)
-    fprintf (file, "%08x\n", image->cpool[i]);
+  if (low < image->nmax_stack && image->max_stack[low].address == address)
+    return low;
+  return -1;
+}
+
+/* The recorded maximum operand stack of the method at address, or -1
+ * if there is none. */
+
+int32
+ijvm_image_max_stack (IJVMImage *image, uint32 address)
+{
+  int j;
+
+  j = ijvm_image_max_stack_entry (image, address);
+  return j >= 0 ? (int32) image->max_stack[j].words : -1;
+}
+
+/* Record words as the maximum operand stack of the method at address,
+ * keeping the table in address order. */
+
+void
+ijvm_image_set_max_stack (IJVMImage *image, uint32 address, uint32 words)
+{
+  int j;
+
+  /* What ijvm-stack.c found from the table is out of date. */
+  image->stack_found = FALSE;
+  free (image->frames);
+  image->frames = NULL;
+
+  for (j = image->nmax_stack; j > 0; j--)
+    if (image->max_stack[j - 1].address <= address)
+      break;
+  if (j > 0 && image->max_stack[j - 1].address == address) {
+    image->max_stack[j - 1].words = words;
+    return;
+  }
+
+  image->max_stack = realloc (image->max_stack, (image->nmax_stack + 1) *
+			      sizeof (IJVMMaxStack));
+  memmove (image->max_stack + j + 1, image->max_stack + j,
+	   (image->nmax_stack - j) * sizeof (IJVMMaxStack));
+  image->max_stack[j].address = address;
+  image->max_stack[j].words = words;
+  image->nmax_stack++;
+}
+
+/* The arguments of each builtin, counting the object reference. */
+
+int ijvm_builtin_nargs[IJVM_NBUILTINS] = { 1, 2, 3, 3 };
+
+/* Indexed by opcode; the opcodes that aren't in the instruction set
+ * have no name. */
+
+#define EFFECT(op, name, length, pops, pushes)				\
+  [IJVM_OPCODE_##op] = { IJVM_OPCODE_##op, name, length, pops, pushes }
+
+static IJVMStackEffect ijvm_stack_effects[256] =
+{
+  EFFECT (BIPUSH,        "bipush",        2, 0, 1),
+  EFFECT (DUP,           "dup",           1, 1, 2),
+  EFFECT (GOTO,          "goto",          3, 0, 0),
+  EFFECT (IADD,          "iadd",          1, 2, 1),
+  EFFECT (IAND,          "iand",          1, 2, 1),
+  EFFECT (IFEQ,          "ifeq",          3, 1, 0),
+  EFFECT (IFLT,          "iflt",          3, 1, 0),
+  EFFECT (IF_ICMPEQ,     "if_icmpeq",     3, 2, 0),
+  EFFECT (IINC,          "iinc",          3, 0, 0),
+  EFFECT (ILOAD,         "iload",         2, 0, 1),
+  EFFECT (INVOKEVIRTUAL, "invokevirtual", 3, 0, 1),
+  EFFECT (IOR,           "ior",           1, 2, 1),
+  EFFECT (IRETURN,       "ireturn",       1, 1, 0),
+  EFFECT (ISTORE,        "istore",        2, 1, 0),
+  EFFECT (ISUB,          "isub",          1, 2, 1),
+  EFFECT (LDC_W,         "ldc_w",         3, 0, 1),
+  EFFECT (NOP,           "nop",           1, 0, 0),
+  EFFECT (POP,           "pop",           1, 1, 0),
+  EFFECT (SWAP,          "swap",          1, 2, 2),
+  EFFECT (WIDE,          "wide",          4, 0, 0)
+};
+
+#undef EFFECT
+
+/* The stack effect of opcode, or NULL if it isn't in the standard
+ * instruction set. */
+
+IJVMStackEffect *
+ijvm_stack_effect (uint8 opcode)
+{
+  return ijvm_stack_effects[opcode].name != NULL ?
+    &ijvm_stack_effects[opcode] : NULL;
+}
+
+/* A hash of the contents of image (32 bit FNV-1a), to tell whether
+ * files made for a program, such as checkpoints, belong to it. */
+
+uint32
+ijvm_image_hash (IJVMImage *image)
+{
+  uint32 hash;
+  int i;
+
+  hash = 2166136261u;
+  hash = (hash ^ (image->main_index & 255)) * 16777619;
+  hash = (hash ^ (image->main_index >> 8)) * 16777619;
+  for (i = 0; i < image->method_area_size; i++)
+    hash = (hash ^ image->method_area[i]) * 16777619;
+  for (i = 0; i < image->cpool_size; i++) {
+    hash = (hash ^ (image->cpool[i] & 255)) * 16777619;
+    hash = (hash ^ ((image->cpool[i] >> 8) & 255)) * 16777619;
+    hash = (hash ^ ((image->cpool[i] >> 16) & 255)) * 16777619;
+    hash = (hash ^ ((uint32) image->cpool[i] >> 24)) * 16777619;
+  }
+
+  return hash;
 }
 
 static void
@@ -143,19 +851,26 @@ ijvm_print_setup_terminal (void)
   tcsetattr (STDIN_FILENO, TCSAFLUSH, &attr);
 }
 
-void
+/* Load the specification selected by the -f option in argv, and set
+ * up the terminal.  Returns the specification. */
+
+IJVMSpec *
 ijvm_print_init (int *argc, char *argv[])
 {
-  ijvm_spec = ijvm_spec_init (argc, argv);
+  IJVMSpec *spec;
+
+  spec = ijvm_spec_init (argc, argv);
   ijvm_print_setup_terminal ();
+
+  return spec;
 }
 
 int
-ijvm_get_opcode (char *mnemonic)
+ijvm_get_opcode (IJVMSpec *spec, char *mnemonic)
 {
   IJVMInsnTemplate *tmpl;
 
-  tmpl = ijvm_spec_lookup_template_by_mnemonic (ijvm_spec, mnemonic);
+  tmpl = ijvm_spec_lookup_template_by_mnemonic (spec, mnemonic);
   if (tmpl == NULL)
     return -1;
   else
@@ -193,8 +908,38 @@ ijvm_print_opcodes (uint8 *opcodes, int length)
   fill ((3 - length) * 3);
 }
 
+/* The number of bytes ijvm_print_snapshot prints for an instruction
+ * with the given opcode. */
+
+int
+ijvm_snapshot_length (IJVMSpec *spec, uint8 opcode)
+{
+  IJVMInsnTemplate *tmpl;
+  int j, length;
+
+  tmpl = ijvm_spec_lookup_template_by_opcode (spec, opcode);
+  if (tmpl == NULL)
+    return 1;
+
+  length = 1;
+  for (j = 0; j < tmpl->noperands; j++)
+    switch (tmpl->operands[j]) {
+    case IJVM_OPERAND_LABEL:
+    case IJVM_OPERAND_METHOD:
+    case IJVM_OPERAND_CONSTANT:
+      length += 2;
+      break;
+
+    default:
+      length += 1;
+      break;
+    }
+
+  return length;
+}
+
 void
-ijvm_print_snapshot (uint8 *opcodes)
+ijvm_print_snapshot (IJVMSpec *spec, uint8 *opcodes)
 {
   IJVMInsnTemplate *tmpl;
   uint8 opcode, byte;
@@ -205,7 +950,7 @@ ijvm_print_snapshot (uint8 *opcodes)
 
 
   opcode = opcodes[0];
-  tmpl = ijvm_spec_lookup_template_by_opcode (ijvm_spec, opcode);
+  tmpl = ijvm_spec_lookup_template_by_opcode (spec, opcode);
   if (tmpl == NULL) {
     printf ("unknown opcode: 0x%02x\n", opcode); 
     return;
@@ -3,6 +3,7 @@
 
 #include "types.h"
 #include "ijvm-spec.h"
+#include "libijvm.h"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -32,13 +33,43 @@
 #define IJVM_OPCODE_SWAP          0x5F
 #define IJVM_OPCODE_WIDE          0xC4
 
-typedef struct IJVMImage IJVMImage;
+/* The operand stack each instruction of the standard instruction set
+ * uses: the number of words it takes from the stack and puts back,
+ * and its length in the method area (4 for wide, which goes with an
+ * iload or istore).  invokevirtual takes the arguments of the method
+ * it invokes as well. */
+
+typedef struct IJVMStackEffect IJVMStackEffect;
+struct IJVMStackEffect {
+  uint8 opcode;
+  char *name;
+  int length, pops, pushes;
+};
+
+/* The most words a method has on its operand stack at once, as
+ * recorded by ijvm-asm or found by ijvm_verify. */
+
+typedef struct IJVMMaxStack IJVMMaxStack;
+struct IJVMMaxStack {
+  uint32 address;       /* Of the method header */
+  uint32 words;
+};
+
 struct IJVMImage {
   uint16 main_index;
   uint8 *method_area;
   uint32 method_area_size;
   int32 *cpool;
   uint32 cpool_size;
+  bool verified;        /* Passed ijvm_verify, see ijvm-verify.c */
+  IJVMMaxStack *max_stack;  /* By address, for the methods known */
+  uint32 nmax_stack;
+  bool stack_found;     /* The three below are up to date */
+  unsigned long stack_estimate;  /* See ijvm_stack_estimate */
+  char *stack_why;
+  uint32 *frames;       /* See ijvm_stack_frames */
+  void *mapping;        /* Binary image the areas point into, or NULL */
+  unsigned long mapping_size;
 };
 
 /* extern IJVMSpec *ijvm_spec; */
@@ -48,11 +79,26 @@ IJVMImage *ijvm_image_new (uint16 main_index,
 			   int32 *cpool, uint32 cpool_size);
 IJVMImage *ijvm_image_load (FILE *file);
 void ijvm_image_write (FILE *file, IJVMImage *image);
-int ijvm_get_opcode (char *mnemonic);
+void ijvm_image_write_binary (FILE *file, IJVMImage *image);
+uint32 ijvm_image_hash (IJVMImage *image);
+int ijvm_image_max_stack_entry (IJVMImage *image, uint32 address);
+int32 ijvm_image_max_stack (IJVMImage *image, uint32 address);
+void ijvm_image_set_max_stack (IJVMImage *image, uint32 address,
+			       uint32 words);
+IJVMStackEffect *ijvm_stack_effect (uint8 opcode);
+
+/* The builtin methods, invoked with constant pool indices from 0x8000
+ * on; see ijvm_builtins in ijvm-emit.c. */
+
+#define IJVM_NBUILTINS 4
+
+extern int ijvm_builtin_nargs[];
+int ijvm_get_opcode (IJVMSpec *spec, char *mnemonic);
 
-void ijvm_print_init (int *argc, char *argv[]);
+IJVMSpec *ijvm_print_init (int *argc, char *argv[]);
 void ijvm_print_stack (int32 *stack, int length, int indent);
 void ijvm_print_opcodes (uint8 *opcodes, int length);
-void ijvm_print_snapshot (uint8 *opcodes);
+void ijvm_print_snapshot (IJVMSpec *spec, uint8 *opcodes);
+int ijvm_snapshot_length (IJVMSpec *spec, uint8 opcode);
 
 #endif
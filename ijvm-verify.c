@@ -0,0 +1,367 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "ijvm.h"
+
+/* ijvm-verify.c
+ *
+ * The bytecode verifier.  It checks, before a program runs, what the
+ * engines would otherwise have to take on trust or check as they go:
+ * that every method reachable from main is made of whole instructions
+ * that stay inside it, that the operand stack has the same depth
+ * wherever two paths meet and never drops below the start of the
+ * method's operand stack, that the local variables used are in the
+ * frame the method header asks for, and that the constant pool
+ * indices and methods named by ldc_w and invokevirtual exist.
+ *
+ * As for the decoder, the method area has no record of where methods
+ * begin and end, so the verifier follows the code from main and the
+ * methods named by invokevirtual.  Every byte it reaches is claimed by
+ * the method that reached it, as a header or as part of an
+ * instruction, so two methods that share code, a branch into the
+ * middle of an instruction and code that runs on into the next
+ * method are all caught as one byte claimed twice.
+ *
+ * A program that passes can't write outside the frames of its
+ * methods, nor reach code that wasn't decoded, so the engines may run
+ * its calls without the checks in ijvm_invoke_virtual; see
+ * ijvm_code_bind.  The most words each method has on its operand
+ * stack are recorded in the image, unless ijvm-asm did so already, in
+ * which case the recorded size is checked.  Local 0 is not a variable
+ * but the link pointer of the frame, and may be read but not
+ * written. */
+
+#define IJVM_VERIFY_FREE    0   /* Not reached */
+#define IJVM_VERIFY_HEADER  1   /* Part of a method header */
+#define IJVM_VERIFY_START   2   /* First byte of an instruction */
+#define IJVM_VERIFY_INSIDE  3   /* Other byte of an instruction */
+
+typedef struct IJVMVerifier IJVMVerifier;
+struct IJVMVerifier
+{
+  IJVMImage *image;
+  uint8 *kind;          /* IJVM_VERIFY_* for each byte */
+  uint32 *owner;        /* Method each byte was claimed by */
+  int32 *depth;         /* Stack depth before each instruction */
+  uint32 *work;         /* Instructions left to check */
+  int nwork, work_alloc;
+  uint32 *methods;      /* Methods whose code is left to check */
+  int nmethods, methods_alloc;
+  uint32 method;        /* Method being checked, and its frame */
+  int nargs, nlocals;
+  int32 max_stack;      /* Most words on its stack so far */
+  char *error;
+};
+
+static bool
+ijvm_verify_error (IJVMVerifier *v, uint32 pc, char *format, ...)
+{
+  va_list args;
+  int n;
+
+  n = snprintf (v->error, IJVM_ERROR_SIZE, "method at 0x%04x, pc 0x%04x: ",
+		v->method, pc);
+  va_start (args, format);
+  vsnprintf (v->error + n, IJVM_ERROR_SIZE - n, format, args);
+  va_end (args);
+
+  return FALSE;
+}
+
+/* Claim the length bytes from pc for the method at owner, as kind,
+ * or complain at from about the first byte that is taken. */
+
+static bool
+ijvm_verify_claim (IJVMVerifier *v, uint32 pc, int length, uint8 kind,
+		   uint32 owner, uint32 from)
+{
+  uint32 j;
+
+  for (j = pc; j < pc + length; j++) {
+    if (v->kind[j] == IJVM_VERIFY_FREE)
+      continue;
+    if (v->owner[j] != owner)
+      return ijvm_verify_error (v, from, "0x%04x belongs to the method at 0x%04x",
+				j, v->owner[j]);
+    if (v->kind[j] == IJVM_VERIFY_HEADER)
+      return ijvm_verify_error (v, from, "0x%04x is in the method header", j);
+    return ijvm_verify_error (v, from, "0x%04x is not the start of an instruction",
+			      j);
+  }
+
+  for (j = pc; j < pc + length; j++) {
+    if (j == pc || kind == IJVM_VERIFY_HEADER)
+      v->kind[j] = kind;
+    else
+      v->kind[j] = IJVM_VERIFY_INSIDE;
+    v->owner[j] = owner;
+  }
+
+  return TRUE;
+}
+
+/* The length of the instruction at pc, or 0 if it isn't one. */
+
+static int
+ijvm_verify_length (IJVMVerifier *v, uint32 pc)
+{
+  IJVMStackEffect *effect;
+  uint8 *m;
+
+  m = v->image->method_area;
+  effect = ijvm_stack_effect (m[pc]);
+  if (effect == NULL)
+    return 0;
+  if (m[pc] == IJVM_OPCODE_WIDE) {
+    /* Only iload and istore take a wide operand; before anything
+     * else a wide is a nop, as in ijvm_execute_opcode. */
+    if (pc + 1 >= v->image->method_area_size ||
+	(m[pc + 1] != IJVM_OPCODE_ILOAD && m[pc + 1] != IJVM_OPCODE_ISTORE))
+      return 1;
+  }
+  return effect->length;
+}
+
+/* Note that the instruction at pc is reached, from the instruction at
+ * from, with depth words on the operand stack. */
+
+static bool
+ijvm_verify_reach (IJVMVerifier *v, uint32 pc, int32 depth, uint32 from)
+{
+  uint32 size;
+  int length;
+
+  size = v->image->method_area_size;
+  if (pc >= size)
+    return ijvm_verify_error (v, from, "0x%04x is outside the method area",
+			      pc);
+
+  if (v->kind[pc] == IJVM_VERIFY_START && v->owner[pc] == v->method) {
+    if (v->depth[pc] != depth)
+      return ijvm_verify_error (v, pc, "the stack holds %d words on one path here and %d on another",
+				v->depth[pc], depth);
+    return TRUE;
+  }
+
+  length = ijvm_verify_length (v, pc);
+  if (length == 0)
+    return ijvm_verify_error (v, pc, "unknown opcode 0x%02x",
+			      v->image->method_area[pc]);
+  if (pc + length > size)
+    return ijvm_verify_error (v, pc, "%s runs off the end of the method area",
+			      ijvm_stack_effect (v->image->method_area[pc])->name);
+  if (!ijvm_verify_claim (v, pc, length, IJVM_VERIFY_START, v->method, from))
+    return FALSE;
+
+  v->depth[pc] = depth;
+  if (v->nwork == v->work_alloc) {
+    v->work_alloc = MAX (v->work_alloc * 2, 64);
+    v->work = realloc (v->work, v->work_alloc * sizeof (uint32));
+  }
+  v->work[v->nwork++] = pc;
+
+  return TRUE;
+}
+
+/* Note a call from pc to the method at address, which is checked
+ * once the method being checked is done. */
+
+static bool
+ijvm_verify_method (IJVMVerifier *v, uint32 address, uint32 pc)
+{
+  uint8 *m;
+
+  m = v->image->method_area;
+  if (address + 4 > v->image->method_area_size || address + 4 < address)
+    return ijvm_verify_error (v, pc, "there is no method at 0x%04x", address);
+  if (v->kind[address] == IJVM_VERIFY_HEADER && v->owner[address] == address)
+    return TRUE;
+  if (m[address] * 256 + m[address + 1] == 0)
+    return ijvm_verify_error (v, pc, "the method at 0x%04x takes no arguments, not even the object reference",
+			      address);
+  if (v->kind[address] != IJVM_VERIFY_FREE)
+    return ijvm_verify_error (v, pc, "the method at 0x%04x overlaps the method at 0x%04x",
+			      address, v->owner[address]);
+  if (!ijvm_verify_claim (v, address, 4, IJVM_VERIFY_HEADER, address, pc))
+    return FALSE;
+
+  if (v->nmethods == v->methods_alloc) {
+    v->methods_alloc = MAX (v->methods_alloc * 2, 16);
+    v->methods = realloc (v->methods, v->methods_alloc * sizeof (uint32));
+  }
+  v->methods[v->nmethods++] = address;
+
+  return TRUE;
+}
+
+/* Check the instruction at pc, of the method being checked, and
+ * reach the instructions that follow it. */
+
+static bool
+ijvm_verify_insn (IJVMVerifier *v, uint32 pc)
+{
+  IJVMImage *image;
+  IJVMStackEffect *effect;
+  uint8 *m;
+  char *name;
+  int32 depth, a;
+  uint32 address;
+  int length, pops, pushes, nargs;
+  uint8 op;
+
+  image = v->image;
+  m = image->method_area;
+  depth = v->depth[pc];
+  length = ijvm_verify_length (v, pc);
+  op = length == 4 ? m[pc + 1] : m[pc];
+  effect = ijvm_stack_effect (op);
+  name = effect->name;
+  pops = effect->pops;
+  pushes = effect->pushes;
+
+  switch (op) {
+  case IJVM_OPCODE_ILOAD:
+  case IJVM_OPCODE_ISTORE:
+  case IJVM_OPCODE_IINC:
+    a = length == 4 ? m[pc + 2] * 256 + m[pc + 3] : m[pc + 1];
+    if (a >= v->nargs + v->nlocals)
+      return ijvm_verify_error (v, pc, "%s of local %d, outside the frame of locals 0 to %d",
+				name, a, v->nargs + v->nlocals - 1);
+    if (a == 0 && op != IJVM_OPCODE_ILOAD)
+      return ijvm_verify_error (v, pc, "%s of local 0, which holds the link pointer",
+				name);
+    break;
+
+  case IJVM_OPCODE_LDC_W:
+    a = m[pc + 1] * 256 + m[pc + 2];
+    if (a >= image->cpool_size)
+      return ijvm_verify_error (v, pc, "ldc_w of constant %d, but the constant pool has only %d words",
+				a, image->cpool_size);
+    break;
+
+  case IJVM_OPCODE_INVOKEVIRTUAL:
+    a = m[pc + 1] * 256 + m[pc + 2];
+    if (a >= 0x8000) {
+      if (a - 0x8000 >= IJVM_NBUILTINS)
+	return ijvm_verify_error (v, pc, "invokevirtual of builtin 0x%04x, which doesn't exist",
+				  a);
+      pops = ijvm_builtin_nargs[a - 0x8000];
+      break;
+    }
+    if (a >= image->cpool_size)
+      return ijvm_verify_error (v, pc, "invokevirtual of constant %d, but the constant pool has only %d words",
+				a, image->cpool_size);
+    address = image->cpool[a];
+    if (!ijvm_verify_method (v, address, pc))
+      return FALSE;
+    nargs = m[address] * 256 + m[address + 1];
+    pops = nargs;
+    break;
+  }
+
+  if (depth < pops)
+    return ijvm_verify_error (v, pc, "stack underflow: %s takes %d, the stack holds %d",
+			      name, pops, depth);
+  depth += pushes - pops;
+  v->max_stack = MAX (v->max_stack, MAX (depth, v->depth[pc]));
+
+  switch (op) {
+  case IJVM_OPCODE_GOTO:
+  case IJVM_OPCODE_IFEQ:
+  case IJVM_OPCODE_IFLT:
+  case IJVM_OPCODE_IF_ICMPEQ:
+    a = pc + (int16) (m[pc + 1] * 256 + m[pc + 2]);
+    if (a < 0)
+      return ijvm_verify_error (v, pc, "%s to %d, before the method area",
+				name, a);
+    if (!ijvm_verify_reach (v, a, depth, pc))
+      return FALSE;
+    break;
+  }
+
+  if (op == IJVM_OPCODE_GOTO || op == IJVM_OPCODE_IRETURN)
+    return TRUE;
+  if (pc + length >= image->method_area_size)
+    return ijvm_verify_error (v, pc, "%s runs off the end of the method area",
+			      name);
+  return ijvm_verify_reach (v, pc + length, depth, pc);
+}
+
+/* Check that image can be run without runtime checks, see above.  If
+ * it can't, the first thing found wrong is written to error, which has
+ * room for IJVM_ERROR_SIZE characters, and FALSE is returned.  A
+ * verified image is marked as such, for ijvm_code_bind. */
+
+bool
+ijvm_verify (IJVMImage *image, char *error)
+{
+  IJVMVerifier v;
+  uint32 size, address, pc;
+  int32 words;
+  uint8 *m;
+  bool ok;
+
+  size = image->method_area_size;
+  m = image->method_area;
+  memset (&v, 0, sizeof (v));
+  v.image = image;
+  v.kind = calloc (size + 1, 1);
+  v.owner = calloc (size + 1, sizeof (uint32));
+  v.depth = calloc (size + 1, sizeof (int32));
+  v.error = error;
+
+  if (image->main_index >= image->cpool_size) {
+    snprintf (error, IJVM_ERROR_SIZE,
+	      "main index %d is outside the constant pool of %d words",
+	      image->main_index, image->cpool_size);
+    ok = FALSE;
+  }
+  else {
+    address = image->cpool[image->main_index];
+    ok = address + 4 <= size && address + 4 > address &&
+      m[address] * 256 + m[address + 1] > 0;
+    if (ok)
+      ok = ijvm_verify_method (&v, address, address);
+    else
+      snprintf (error, IJVM_ERROR_SIZE,
+		"main at 0x%04x is not a method", address);
+  }
+
+  while (ok && v.nmethods > 0) {
+    address = v.methods[--v.nmethods];
+    v.method = address;
+    v.nargs = m[address] * 256 + m[address + 1];
+    v.nlocals = m[address + 2] * 256 + m[address + 3];
+    v.max_stack = 0;
+    ok = ijvm_verify_reach (&v, address + 4, 0, address);
+    while (ok && v.nwork > 0) {
+      pc = v.work[--v.nwork];
+      ok = ijvm_verify_insn (&v, pc);
+    }
+    if (!ok)
+      break;
+
+    /* The engines may rely on a recorded stack size, see
+     * ijvm_stack_frames, so it must not be too small. */
+    words = ijvm_image_max_stack (image, address);
+    if (words < 0)
+      ijvm_image_set_max_stack (image, address, v.max_stack);
+    else if (words < v.max_stack) {
+      snprintf (error, IJVM_ERROR_SIZE,
+		"method at 0x%04x: the image records a stack of %d words, but the method uses %d",
+		address, words, v.max_stack);
+      ok = FALSE;
+    }
+  }
+
+  free (v.kind);
+  free (v.owner);
+  free (v.depth);
+  free (v.work);
+  free (v.methods);
+
+  image->verified = ok;
+  return ok;
+}
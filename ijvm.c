@@ -1,31 +1,16 @@
-#include <stdlib.h> 	/* for malloc and atoi */
-#include <stdio.h>      /* for FILE, fgetc, fputc, stdin, stdout, 
-                         * fprintf, printf, fopen and fscanf */
-#include <time.h>   	/* for time_t, time and ctime */
-#include "ijvm-util.h"
-
-typedef struct IJVM IJVM;
-struct IJVM 
-{
-  uint32 sp, lv, pc, wide;
-  int32 *stack;
-  int32 *cpp;
-  uint8 *method;
-
-  uint32 initial_sp;
-};
-
-int8   ijvm_fetch_int8 (IJVM *i);
-uint8  ijvm_fetch_uint8 (IJVM *i);
-int16  ijvm_fetch_int16 (IJVM *i);
-uint16 ijvm_fetch_uint16 (IJVM *i);
-void   ijvm_push (IJVM *i, int32 word);
-int32  ijvm_pop (IJVM *i);
-void   ijvm_invoke_virtual (IJVM *i, uint16 index);
-void   ijvm_ireturn (IJVM *i);
-void   ijvm_execute_opcode (IJVM *i);
-int    ijvm_active (IJVM *i);
-IJVM  *ijvm_new (IJVMImage *image, int argc, char *argv[]);
+#include <stdlib.h> 	/* for malloc and free */
+#include <stdio.h>      /* for FILE, stdout, fprintf and printf */
+#include <stdarg.h>     /* for va_list */
+#include <string.h>     /* for memcpy and memset */
+#include <limits.h>     /* for LONG_MAX */
+#include "ijvm.h"
+
+/* ijvm.c
+ *
+ * The interpreter proper, shared by the ijvm program (ijvm-main.c)
+ * and the library (libijvm.c).  Everything the interpreter needs is
+ * reached through the IJVM it is given, so any number of them can
+ * run at once, in as many threads. */
 
 int8
 ijvm_fetch_int8 (IJVM *i)
@@ -85,31 +70,92 @@ ijvm_pop (IJVM *i)
   return result;
 }
 
-void ijvm_invoke_builtin (IJVM *i, uint16 index)
+/* Check that the count locals from varnum on are in the frame of the
+ * current method, for the block builtins.  Local 0 holds the link
+ * pointer, which points just past the last local. */
+
+static void
+ijvm_check_block (IJVM *i, char *name, int32 varnum, int32 count)
+{
+  if (varnum < 1 || count < 0 ||
+      count > (int32) (i->stack[i->lv] - i->lv) - varnum)
+    ijvm_error (i, "%s: locals %d to %d are outside the frame",
+		name, varnum, varnum + count - 1);
+}
+
+/* The builtin methods, see ijvm_builtins in ijvm-emit.c.  readblock
+ * and writeblock take a local variable number and a count, and read
+ * into or write from that many locals of the caller, one character
+ * per local.  readblock returns the number of characters read, which
+ * is less than count only at the end of the input. */
+
+void
+ijvm_invoke_builtin (IJVM *i, uint16 index)
 {
-  int c;
+  uint8 buffer[256], *block;
+  int32 varnum, count, *locals;
+  int c, j;
 
   switch (index) {
   case 0:
     ijvm_pop (i);  /* Remove object ref. from stack. */
-    c = fgetc (stdin);
+    c = ijvm_io_getc (i->io);
     if (c == EOF)
       ijvm_push (i, -1); /* Return -1 as end of file */
     else
       ijvm_push (i, c);  /* Place return value on stack */
     break;
   case 1:
-    c = fputc (ijvm_pop (i), stdout);
+    c = ijvm_pop (i);
+    c = ijvm_io_putc (i->io, c);
+    if (i->sink != NULL && c != EOF)
+      ijvm_sink_char (i->sink, c);
     ijvm_pop (i);  /* Remove object ref. from stack. */
     ijvm_push (i, c);  /* Place return value on stack */
+    break;
+  case 2:
+  case 3:
+    count = ijvm_pop (i);
+    varnum = ijvm_pop (i);
+    ijvm_pop (i);  /* Remove object ref. from stack. */
+    ijvm_check_block (i, index == 2 ? "readblock" : "writeblock",
+		      varnum, count);
+    locals = i->stack + i->lv + varnum;
+    block = count <= (int32) sizeof (buffer) ? buffer : malloc (count);
+    if (index == 2) {
+      c = ijvm_io_read (i->io, block, count);
+      for (j = 0; j < c; j++)
+	locals[j] = block[j];
+    }
+    else {
+      for (j = 0; j < count; j++)
+	block[j] = locals[j];
+      c = ijvm_io_write (i->io, block, count);
+      if (i->sink != NULL)
+	for (j = 0; j < count && c != EOF; j++)
+	  ijvm_sink_char (i->sink, block[j]);
+    }
+    if (block != buffer)
+      free (block);
+    ijvm_push (i, c);
+    break;
   }
 }
 
+/* Invoke the method at constant pool index, or the builtin.  If
+ * i->tail_calls is set and the call is followed by an ireturn, the
+ * frame of the calling method is reused: it is popped as the ireturn
+ * would, and the arguments moved down to where it was, so the method
+ * invoked returns straight to the caller's caller.  The ireturn is
+ * charged to the budget, for the instruction counts to come out the
+ * same, and a tail call is only made if the budget covers it. */
+
 void
 ijvm_invoke_virtual (IJVM *i, uint16 index)
 {
-  uint32 address;
+  uint32 address, link, pc, lv;
   uint16 nargs, nlocals;
+  int j;
 
   if (index >= 0x8000) {
     ijvm_invoke_builtin (i, index - 0x8000);
@@ -120,6 +166,28 @@ ijvm_invoke_virtual (IJVM *i, uint16 index)
   nargs = i->method[address] * 256 + i->method[address + 1];
   nlocals  = i->method[address + 2] * 256 + i->method[address + 3];
 
+  if (i->memo != NULL && ijvm_memo_call (i->memo, i, index))
+    return;
+
+  if (i->tail_calls && i->budget >= 2 &&
+      i->method[i->pc] == IJVM_OPCODE_IRETURN) {
+    /* The arguments may be moved over the link of the frame. */
+    link = i->stack[i->lv];
+    pc = i->stack[link];
+    lv = i->stack[link + 1];
+    for (j = 0; j < nargs; j++)
+      i->stack[i->lv + j] = i->stack[i->sp - nargs + 1 + j];
+    i->sp = i->lv + nargs - 1;
+    i->pc = pc;
+    i->lv = lv;
+    i->budget--;
+  }
+
+  /* The frame is checked once here, if its size is known, so the
+   * pushes of the method needn't be. */
+  if (index < i->nframes && i->sp + i->frames[index] >= i->memory_size / 4)
+    ijvm_stack_overflow (i, address, i->frames[index]);
+
   i->sp += nlocals;
   ijvm_push (i, i->pc);
   ijvm_push (i, i->lv);
@@ -128,11 +196,26 @@ ijvm_invoke_virtual (IJVM *i, uint16 index)
   i->pc = address + 4;
 }
 
+/* Stop the program at a call of the method at address, whose frame
+ * needs more words than are left.  PC and SP are reported as by
+ * ijvm_fault. */
+
+void
+ijvm_stack_overflow (IJVM *i, uint32 address, uint32 words)
+{
+  ijvm_error (i, "Stack overflow: the method at 0x%04x needs %u words, %lu are left (PC = 0x%04x, SP = %d)",
+	      address, words, i->memory_size / 4 - i->sp - 1, i->insn_pc,
+	      (int32) i->insn_sp);
+}
+
 void
 ijvm_ireturn (IJVM *i)
 {
   int linkptr;
 
+  if (i->memo != NULL)
+    ijvm_memo_return (i->memo, i);
+
   linkptr = i->stack[i->lv];
   i->stack[i->lv] = i->stack[i->sp]; /* Leave result on top of stack */
   i->sp = i->lv;
@@ -150,6 +233,9 @@ ijvm_execute_opcode (IJVM *i)
   uint32 opc;
 
   opc = i->pc;
+  if (!i->wide)
+    i->insn_pc = opc;
+  i->insn_sp = i->sp;
   opcode = ijvm_fetch_uint8 (i);
 
   switch (opcode) {
@@ -285,130 +371,1184 @@ ijvm_active (IJVM *i)
   return i->pc != IJVM_INITIAL_PC;
 }
 
+/* Trace the instruction at pc, or the stack with sp as top of stack,
+ * either as text on stdout or in the binary trace. */
+
+void
+ijvm_trace_insn (IJVM *i, uint32 pc)
+{
+  if (i->sink != NULL)
+    ijvm_sink_insn (i->sink, pc, i->method + pc);
+  else
+    ijvm_print_snapshot (i->spec, i->method + pc);
+}
+
+void
+ijvm_trace_stack (IJVM *i, uint32 sp, bool indent)
+{
+  if (i->sink != NULL)
+    ijvm_sink_stack (i->sink, i->stack, sp, MIN (sp - i->initial_sp, 8),
+		     indent);
+  else
+    ijvm_print_stack (i->stack + sp, MIN (sp - i->initial_sp, 8), indent);
+}
+
+/* Direct threaded interpreter for the decoded instruction stream.
+ * The registers are kept in local variables for the duration of the
+ * run, and every decoded instruction carries the address of its
+ * handler, so each handler jumps straight to the next one with no
+ * function call, no ijvm_active test and no operand fetching.  When
+ * the compiler doesn't support computed goto (GNU C `&&label'), the
+ * same handlers are compiled as the cases of a switch.
+ *
+ * When trace is TRUE the engine prints the same trace as the switch
+ * engine, using the method area offsets recorded in the decoded
+ * instructions.  The engine returns when main returns or when the
+ * program jumps to code that wasn't decoded; in the latter case PC is
+ * left pointing at the bytecode to continue with.
+ *
+ * The engine runs at most i->budget instructions, and leaves what is
+ * left of the budget there.  The budget is charged a basic block at a
+ * time, as the block is entered, and only checked where a block is
+ * entered by a taken branch, a call or a return: the check there
+ * covers the blocks that conditional branches fall through to as well
+ * (see IJVMInsn), so falling through costs a subtraction.  When the
+ * budget won't cover the next block the engine leaves, and the switch
+ * engine can run what is left of the budget an instruction at a
+ * time.
+ *
+ * Before each instruction the engine stores its offset and SP in i,
+ * so that a memory fault is reported at the instruction that made
+ * it; see ijvm_fault. */
+
+#if defined (__GNUC__) && !defined (IJVM_NO_COMPUTED_GOTO)
+#define IJVM_COMPUTED_GOTO
+#endif
+
+/* Record where the engine is for ijvm_fault: decoded instruction
+ * insn, about to run with stack pointer sp. */
+#define AT(insn, sp)    (i->insn_pc = (insn)->pc, i->insn_sp = (sp))
+
+#ifdef IJVM_COMPUTED_GOTO
+#define TARGET(op)      label_##op:
+#define PSEUDO(op)      label_##op:
+#define NEXT_HANDLER()  do { AT (insn, sp); goto *insn->handler; } while (0)
+#else
+#define TARGET(op)      case IJVM_OPCODE_##op:
+#define PSEUDO(op)      case IJVM_DECODED_##op:
+#define NEXT_HANDLER()  do { AT (insn, sp); goto dispatch; } while (0)
+#endif
+
+/* Continue with insn after a real instruction has been executed. */
+#define DISPATCH()				\
+  do {						\
+    if (trace)					\
+      goto trace_step;				\
+    NEXT_HANDLER ();				\
+  } while (0)
+
+/* Continue with insn after a pseudo instruction. */
+#define CONTINUE()				\
+  do {						\
+    if (trace)					\
+      goto trace_snapshot;			\
+    NEXT_HANDLER ();				\
+  } while (0)
+
+/* Continue with insn at the start of a basic block reached by a taken
+ * branch, if the budget allows. */
+#define ENTER()					\
+  do {						\
+    if (budget < (long) insn->reserve)		\
+      goto out_of_budget;			\
+    budget -= insn->cost;			\
+    DISPATCH ();				\
+  } while (0)
+
+/* Continue with insn after a conditional branch that wasn't taken; it
+ * was paid for when the block of the branch was entered. */
+#define FALL_THROUGH()				\
+  do {						\
+    budget -= insn->cost;			\
+    DISPATCH ();				\
+  } while (0)
+
+/* Continue at a method area offset only known at run time.  Offset
+ * IJVM_INITIAL_PC is never decoded, so returning from main leaves
+ * the engine here too. */
+#define RESUME(target)					\
+  do {							\
+    pc = (target);					\
+    insn = pc < code->size ? code->map[pc] : NULL;	\
+    if (insn == NULL) {					\
+      if (trace)					\
+	ijvm_trace_stack (i, sp, FALSE); \
+      goto leave;					\
+    }							\
+    ENTER ();						\
+  } while (0)
+
+void
+ijvm_run_threaded (IJVM *i, bool trace)
+{
+  IJVMCode *code;
+  IJVMInsn *insn;
+  uint32 pc, sp, lv, n;
+  int32 *stack, a;
+  unsigned long fused, words;
+  long budget;
+
+#ifdef IJVM_COMPUTED_GOTO
+  static void *dispatch_table[IJVM_DECODED_NOPS] = {
+    [0 ... 255]                 = &&label_NOP,
+    [IJVM_OPCODE_BIPUSH]        = &&label_BIPUSH,
+    [IJVM_OPCODE_DUP]           = &&label_DUP,
+    [IJVM_OPCODE_GOTO]          = &&label_GOTO,
+    [IJVM_OPCODE_IADD]          = &&label_IADD,
+    [IJVM_OPCODE_IAND]          = &&label_IAND,
+    [IJVM_OPCODE_IFEQ]          = &&label_IFEQ,
+    [IJVM_OPCODE_IFLT]          = &&label_IFLT,
+    [IJVM_OPCODE_IF_ICMPEQ]     = &&label_IF_ICMPEQ,
+    [IJVM_OPCODE_IINC]          = &&label_IINC,
+    [IJVM_OPCODE_ILOAD]         = &&label_ILOAD,
+    [IJVM_OPCODE_INVOKEVIRTUAL] = &&label_INVOKEVIRTUAL,
+    [IJVM_OPCODE_IOR]           = &&label_IOR,
+    [IJVM_OPCODE_IRETURN]       = &&label_IRETURN,
+    [IJVM_OPCODE_ISTORE]        = &&label_ISTORE,
+    [IJVM_OPCODE_ISUB]          = &&label_ISUB,
+    [IJVM_OPCODE_LDC_W]         = &&label_LDC_W,
+    [IJVM_OPCODE_POP]           = &&label_POP,
+    [IJVM_OPCODE_SWAP]          = &&label_SWAP,
+    [IJVM_DECODED_JUMP]         = &&label_JUMP,
+    [IJVM_DECODED_EXIT]         = &&label_EXIT,
+    [IJVM_DECODED_CALL]         = &&label_CALL,
+    [IJVM_DECODED_TAIL_CALL]    = &&label_TAIL_CALL,
+    [IJVM_DECODED_ILOAD_ILOAD_IADD]      = &&label_ILOAD_ILOAD_IADD,
+    [IJVM_DECODED_ILOAD_ILOAD_ISUB]      = &&label_ILOAD_ILOAD_ISUB,
+    [IJVM_DECODED_ILOAD_ILOAD_IF_ICMPEQ] = &&label_ILOAD_ILOAD_IF_ICMPEQ,
+    [IJVM_DECODED_ILOAD_BIPUSH_ISUB]     = &&label_ILOAD_BIPUSH_ISUB,
+    [IJVM_DECODED_BIPUSH_IF_ICMPEQ]      = &&label_BIPUSH_IF_ICMPEQ,
+    [IJVM_DECODED_ILOAD_IFEQ]            = &&label_ILOAD_IFEQ,
+    [IJVM_DECODED_ILOAD_IFLT]            = &&label_ILOAD_IFLT,
+    [IJVM_DECODED_IINC_GOTO]             = &&label_IINC_GOTO,
+    [IJVM_DECODED_IADD_ISTORE]           = &&label_IADD_ISTORE,
+    [IJVM_DECODED_ISUB_ISTORE]           = &&label_ISUB_ISTORE,
+    [IJVM_DECODED_LOOP]                  = &&label_LOOP
+  };
+#endif
+
+  code = i->code;
+#ifdef IJVM_COMPUTED_GOTO
+  if (code->linked != dispatch_table)
+    ijvm_code_link (code, dispatch_table);
+#endif
+
+  sp = i->sp;
+  lv = i->lv;
+  stack = i->stack;
+  pc = i->pc;
+  fused = 0;
+  budget = i->budget;
+  words = i->memory_size / 4;
+
+  insn = ijvm_code_lookup (code, pc);
+  if (insn == NULL || budget < (long) insn->reserve)
+    goto leave;
+  budget -= insn->cost;
+  CONTINUE ();
+
+#ifndef IJVM_COMPUTED_GOTO
+ dispatch:
+  switch (insn->op) {
+#endif
+
+  TARGET (BIPUSH)
+    stack[++sp] = insn->a;
+    insn++;
+    DISPATCH ();
+
+  TARGET (DUP)
+    stack[sp + 1] = stack[sp];
+    sp++;
+    insn++;
+    DISPATCH ();
+
+  TARGET (GOTO)
+    insn = insn->target;
+    ENTER ();
+
+  TARGET (IADD)
+    a = stack[sp--];
+    stack[sp] = a + stack[sp];
+    insn++;
+    DISPATCH ();
+
+  TARGET (IAND)
+    a = stack[sp--];
+    stack[sp] = a & stack[sp];
+    insn++;
+    DISPATCH ();
+
+  TARGET (IFEQ)
+    if (stack[sp--] == 0) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn++;
+    FALL_THROUGH ();
+
+  TARGET (IFLT)
+    if (stack[sp--] < 0) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn++;
+    FALL_THROUGH ();
+
+  TARGET (IF_ICMPEQ)
+    a = stack[sp--];
+    if (a == stack[sp--]) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn++;
+    FALL_THROUGH ();
+
+  TARGET (IINC)
+    stack[lv + insn->a] += insn->b;
+    insn++;
+    DISPATCH ();
+
+  TARGET (ILOAD)
+    stack[++sp] = stack[lv + insn->a];
+    insn++;
+    DISPATCH ();
+
+  TARGET (INVOKEVIRTUAL)
+    i->pc = insn->pc + insn->length;
+    i->sp = sp;
+    i->lv = lv;
+    /* The budget as the switch engine has it, for a tail call. */
+    i->budget = budget + 1;
+    ijvm_invoke_virtual (i, insn->a);
+    budget = i->budget - 1;
+    sp = i->sp;
+    lv = i->lv;
+    RESUME (i->pc);
+
+  TARGET (IOR)
+    a = stack[sp--];
+    stack[sp] = a | stack[sp];
+    insn++;
+    DISPATCH ();
+
+  TARGET (IRETURN)
+    a = stack[lv];
+    stack[lv] = stack[sp];
+    sp = lv;
+    pc = stack[a];
+    lv = stack[a + 1];
+    RESUME (pc);
+
+  TARGET (ISTORE)
+    stack[lv + insn->a] = stack[sp--];
+    insn++;
+    DISPATCH ();
+
+  TARGET (ISUB)
+    a = stack[sp--];
+    stack[sp] = stack[sp] - a;
+    insn++;
+    DISPATCH ();
+
+  TARGET (LDC_W)
+    stack[++sp] = insn->a;
+    insn++;
+    DISPATCH ();
+
+  TARGET (POP)
+    sp--;
+    insn++;
+    DISPATCH ();
+
+  TARGET (SWAP)
+    a = stack[sp];
+    stack[sp] = stack[sp - 1];
+    stack[sp - 1] = a;
+    insn++;
+    DISPATCH ();
+
+  /* Nop, a wide that isn't folded into an iload or istore and unknown
+   * opcodes. */
+
+#ifndef IJVM_COMPUTED_GOTO
+  default:
+#endif
+  TARGET (NOP)
+    insn++;
+    DISPATCH ();
+
+  PSEUDO (JUMP)
+    insn = insn->target;
+    if (budget < (long) insn->reserve) {
+      pc = insn->pc;
+      goto leave;
+    }
+    budget -= insn->cost;
+    CONTINUE ();
+
+  PSEUDO (EXIT)
+    pc = insn->pc;
+    goto leave;
+
+  /* A branch to the head of a loop that the hot engine counts, which
+   * leaves the engine at the head when the loop gets hot; see
+   * ijvm_run_loops.  The budget was checked for the head. */
+
+  PSEUDO (LOOP)
+    if (--insn->b == 0) {
+      pc = insn->pc;
+      goto leave;
+    }
+    insn = insn->target;
+    budget -= insn->cost;
+    CONTINUE ();
+
+  /* Invokevirtual of a verified method, see ijvm_code_bind: the frame
+   * is checked and built as in ijvm_invoke_virtual, with a the new
+   * LV.  A tail call reuses the frame at LV for it, if the budget
+   * covers the ireturn after it and the frame fits; otherwise it is
+   * an ordinary call. */
+
+  PSEUDO (TAIL_CALL)
+    if (budget >= 1 && lv + (insn->a & 0xffff) - 1 + insn->b < words) {
+      budget--;
+      a = stack[lv];
+      pc = stack[a];
+      a = stack[a + 1];
+      for (n = 0; n < (insn->a & 0xffff); n++)
+	stack[lv + n] = stack[sp - (insn->a & 0xffff) + 1 + n];
+      sp = lv + (insn->a & 0xffff) - 1 + (insn->a >> 16);
+      stack[++sp] = pc;
+      stack[++sp] = a;
+      stack[lv] = sp - 1;
+      insn = insn->target;
+      ENTER ();
+    }
+
+  PSEUDO (CALL)
+    if (sp + insn->b >= words)
+      goto stack_overflow;
+    a = sp - (insn->a & 0xffff) + 1;
+    sp += insn->a >> 16;
+    stack[++sp] = insn->pc + insn->length;
+    stack[++sp] = lv;
+    stack[a] = sp - 1;
+    lv = a;
+    insn = insn->target;
+    ENTER ();
+
+  /* Superinstructions.  They store the same values in the same stack
+   * slots as the sequences they replace, since the slots above the
+   * top of the stack become the locals of the next method invoked,
+   * and record each instruction after the first with AT before it
+   * touches the stack. */
+
+  PSEUDO (ILOAD_ILOAD_IADD)
+    stack[sp + 1] = stack[lv + insn->a];
+    AT (insn + 1, sp + 1);
+    stack[sp + 2] = stack[lv + insn->b];
+    stack[sp + 1] = stack[sp + 2] + stack[sp + 1];
+    sp++;
+    insn += 3;
+    fused += 2;
+    DISPATCH ();
+
+  PSEUDO (ILOAD_ILOAD_ISUB)
+    stack[sp + 1] = stack[lv + insn->a];
+    AT (insn + 1, sp + 1);
+    stack[sp + 2] = stack[lv + insn->b];
+    stack[sp + 1] = stack[sp + 1] - stack[sp + 2];
+    sp++;
+    insn += 3;
+    fused += 2;
+    DISPATCH ();
+
+  PSEUDO (ILOAD_ILOAD_IF_ICMPEQ)
+    stack[sp + 1] = stack[lv + insn->a];
+    AT (insn + 1, sp + 1);
+    stack[sp + 2] = stack[lv + insn->b];
+    fused += 2;
+    if (stack[sp + 2] == stack[sp + 1]) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn += 3;
+    FALL_THROUGH ();
+
+  PSEUDO (ILOAD_BIPUSH_ISUB)
+    stack[sp + 1] = stack[lv + insn->a];
+    AT (insn + 1, sp + 1);
+    stack[sp + 2] = insn->b;
+    stack[sp + 1] = stack[sp + 1] - insn->b;
+    sp++;
+    insn += 3;
+    fused += 2;
+    DISPATCH ();
+
+  PSEUDO (BIPUSH_IF_ICMPEQ)
+    stack[sp + 1] = insn->a;
+    fused += 1;
+    if (stack[sp--] == insn->a) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn += 2;
+    FALL_THROUGH ();
+
+  PSEUDO (ILOAD_IFEQ)
+    stack[sp + 1] = stack[lv + insn->a];
+    fused += 1;
+    if (stack[sp + 1] == 0) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn += 2;
+    FALL_THROUGH ();
+
+  PSEUDO (ILOAD_IFLT)
+    stack[sp + 1] = stack[lv + insn->a];
+    fused += 1;
+    if (stack[sp + 1] < 0) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn += 2;
+    FALL_THROUGH ();
+
+  PSEUDO (IINC_GOTO)
+    stack[lv + insn->a] += insn->b;
+    fused += 1;
+    insn = insn->target;
+    ENTER ();
+
+  PSEUDO (IADD_ISTORE)
+    a = stack[sp--];
+    stack[sp] = a + stack[sp];
+    AT (insn + 1, sp);
+    stack[lv + insn->a] = stack[sp--];
+    insn += 2;
+    fused += 1;
+    DISPATCH ();
+
+  PSEUDO (ISUB_ISTORE)
+    a = stack[sp--];
+    stack[sp] = stack[sp] - a;
+    AT (insn + 1, sp);
+    stack[lv + insn->a] = stack[sp--];
+    insn += 2;
+    fused += 1;
+    DISPATCH ();
+
+#ifndef IJVM_COMPUTED_GOTO
+  }
+#endif
+
+ trace_step:
+  ijvm_trace_stack (i, sp, FALSE);
+ trace_snapshot:
+  if (insn->length == 4) {
+    /* Print the wide folded into this instruction on a line of its
+     * own, like the switch engine does. */
+    ijvm_trace_insn (i, insn->pc);
+    ijvm_trace_stack (i, sp, FALSE);
+    ijvm_trace_insn (i, insn->pc + 1);
+  }
+  else if (insn->op < 256)
+    ijvm_trace_insn (i, insn->pc);
+  NEXT_HANDLER ();
+
+ stack_overflow:
+  /* The frame of the method a call makes doesn't fit, see
+   * ijvm_code_bind.  The method starts 4 bytes before its code. */
+  i->pc = insn->pc + insn->length;
+  i->sp = sp;
+  i->lv = lv;
+  ijvm_stack_overflow (i, insn->target->pc - 4, insn->b);
+
+ out_of_budget:
+  if (trace)
+    ijvm_trace_stack (i, sp, FALSE);
+  pc = insn->pc;
+
+ leave:
+  i->pc = pc;
+  i->sp = sp;
+  i->lv = lv;
+  i->wide = FALSE;
+  i->fused_dispatches += fused;
+  i->budget = budget;
+}
+
+#undef RESUME
+
+/* Top of stack cached version of ijvm_run_threaded.  The top element
+ * of the operand stack lives in the local tos instead of in
+ * stack[sp], which is only brought up to date when something outside
+ * the engine looks at the stack: invokevirtual, ireturn, the trace
+ * and leaving the engine.  Binary operations then cost one load and
+ * no stores, where the threaded engine does two loads and a store.
+ *
+ * The results are the same as for the other engines, but the values
+ * left in the slots above the top of the stack are not, which is
+ * only visible to a method that reads a local variable before it has
+ * stored anything in it.  A push still stores the value in the slot
+ * it goes to, as the other engines do, so that a push past the end
+ * of the memory faults at the same instruction. */
+
+#define RESUME(target)					\
+  do {							\
+    pc = (target);					\
+    insn = pc < code->size ? code->map[pc] : NULL;	\
+    if (insn == NULL) {					\
+      if (trace) {					\
+	stack[sp] = tos;				\
+	ijvm_trace_stack (i, sp, FALSE); \
+      }							\
+      goto leave;					\
+    }							\
+    ENTER ();						\
+  } while (0)
+
+#define PUSH(value)				\
+  do {						\
+    stack[sp] = tos;				\
+    tos = (value);				\
+    stack[++sp] = tos;				\
+  } while (0)
+
+#define DROP()					\
+  do {						\
+    tos = stack[--sp];				\
+  } while (0)
+
+void
+ijvm_run_tos (IJVM *i, bool trace)
+{
+  IJVMCode *code;
+  IJVMInsn *insn;
+  uint32 pc, sp, lv, n;
+  int32 *stack, a, tos;
+  unsigned long fused, words;
+  long budget;
+
+#ifdef IJVM_COMPUTED_GOTO
+  static void *dispatch_table[IJVM_DECODED_NOPS] = {
+    [0 ... 255]                 = &&label_NOP,
+    [IJVM_OPCODE_BIPUSH]        = &&label_BIPUSH,
+    [IJVM_OPCODE_DUP]           = &&label_DUP,
+    [IJVM_OPCODE_GOTO]          = &&label_GOTO,
+    [IJVM_OPCODE_IADD]          = &&label_IADD,
+    [IJVM_OPCODE_IAND]          = &&label_IAND,
+    [IJVM_OPCODE_IFEQ]          = &&label_IFEQ,
+    [IJVM_OPCODE_IFLT]          = &&label_IFLT,
+    [IJVM_OPCODE_IF_ICMPEQ]     = &&label_IF_ICMPEQ,
+    [IJVM_OPCODE_IINC]          = &&label_IINC,
+    [IJVM_OPCODE_ILOAD]         = &&label_ILOAD,
+    [IJVM_OPCODE_INVOKEVIRTUAL] = &&label_INVOKEVIRTUAL,
+    [IJVM_OPCODE_IOR]           = &&label_IOR,
+    [IJVM_OPCODE_IRETURN]       = &&label_IRETURN,
+    [IJVM_OPCODE_ISTORE]        = &&label_ISTORE,
+    [IJVM_OPCODE_ISUB]          = &&label_ISUB,
+    [IJVM_OPCODE_LDC_W]         = &&label_LDC_W,
+    [IJVM_OPCODE_POP]           = &&label_POP,
+    [IJVM_OPCODE_SWAP]          = &&label_SWAP,
+    [IJVM_DECODED_JUMP]         = &&label_JUMP,
+    [IJVM_DECODED_EXIT]         = &&label_EXIT,
+    [IJVM_DECODED_CALL]         = &&label_CALL,
+    [IJVM_DECODED_TAIL_CALL]    = &&label_TAIL_CALL,
+    [IJVM_DECODED_ILOAD_ILOAD_IADD]      = &&label_ILOAD_ILOAD_IADD,
+    [IJVM_DECODED_ILOAD_ILOAD_ISUB]      = &&label_ILOAD_ILOAD_ISUB,
+    [IJVM_DECODED_ILOAD_ILOAD_IF_ICMPEQ] = &&label_ILOAD_ILOAD_IF_ICMPEQ,
+    [IJVM_DECODED_ILOAD_BIPUSH_ISUB]     = &&label_ILOAD_BIPUSH_ISUB,
+    [IJVM_DECODED_BIPUSH_IF_ICMPEQ]      = &&label_BIPUSH_IF_ICMPEQ,
+    [IJVM_DECODED_ILOAD_IFEQ]            = &&label_ILOAD_IFEQ,
+    [IJVM_DECODED_ILOAD_IFLT]            = &&label_ILOAD_IFLT,
+    [IJVM_DECODED_IINC_GOTO]             = &&label_IINC_GOTO,
+    [IJVM_DECODED_IADD_ISTORE]           = &&label_IADD_ISTORE,
+    [IJVM_DECODED_ISUB_ISTORE]           = &&label_ISUB_ISTORE,
+    [IJVM_DECODED_LOOP]                  = &&label_LOOP
+  };
+#endif
+
+  code = i->code;
+#ifdef IJVM_COMPUTED_GOTO
+  if (code->linked != dispatch_table)
+    ijvm_code_link (code, dispatch_table);
+#endif
+
+  sp = i->sp;
+  lv = i->lv;
+  stack = i->stack;
+  pc = i->pc;
+  tos = stack[sp];
+  fused = 0;
+  budget = i->budget;
+  words = i->memory_size / 4;
+
+  insn = ijvm_code_lookup (code, pc);
+  if (insn == NULL || budget < (long) insn->reserve)
+    goto leave;
+  budget -= insn->cost;
+  CONTINUE ();
+
+#ifndef IJVM_COMPUTED_GOTO
+ dispatch:
+  switch (insn->op) {
+#endif
+
+  TARGET (BIPUSH)
+    PUSH (insn->a);
+    insn++;
+    DISPATCH ();
+
+  TARGET (DUP)
+    stack[sp] = tos;
+    stack[++sp] = tos;
+    insn++;
+    DISPATCH ();
+
+  TARGET (GOTO)
+    insn = insn->target;
+    ENTER ();
+
+  TARGET (IADD)
+    tos = stack[--sp] + tos;
+    insn++;
+    DISPATCH ();
+
+  TARGET (IAND)
+    tos = stack[--sp] & tos;
+    insn++;
+    DISPATCH ();
+
+  TARGET (IFEQ)
+    a = tos;
+    DROP ();
+    if (a == 0) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn++;
+    FALL_THROUGH ();
+
+  TARGET (IFLT)
+    a = tos;
+    DROP ();
+    if (a < 0) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn++;
+    FALL_THROUGH ();
+
+  TARGET (IF_ICMPEQ)
+    a = tos;
+    sp -= 2;
+    tos = stack[sp];
+    if (a == stack[sp + 1]) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn++;
+    FALL_THROUGH ();
+
+  TARGET (IINC)
+    stack[lv + insn->a] += insn->b;
+    insn++;
+    DISPATCH ();
+
+  TARGET (ILOAD)
+    PUSH (stack[lv + insn->a]);
+    insn++;
+    DISPATCH ();
+
+  TARGET (INVOKEVIRTUAL)
+    stack[sp] = tos;
+    i->pc = insn->pc + insn->length;
+    i->sp = sp;
+    i->lv = lv;
+    /* The budget as the switch engine has it, for a tail call. */
+    i->budget = budget + 1;
+    ijvm_invoke_virtual (i, insn->a);
+    budget = i->budget - 1;
+    sp = i->sp;
+    lv = i->lv;
+    tos = stack[sp];
+    RESUME (i->pc);
+
+  TARGET (IOR)
+    tos = stack[--sp] | tos;
+    insn++;
+    DISPATCH ();
+
+  TARGET (IRETURN)
+    a = stack[lv];
+    stack[lv] = tos;
+    sp = lv;
+    pc = stack[a];
+    lv = stack[a + 1];
+    RESUME (pc);
+
+  TARGET (ISTORE)
+    stack[lv + insn->a] = tos;
+    DROP ();
+    insn++;
+    DISPATCH ();
+
+  TARGET (ISUB)
+    tos = stack[--sp] - tos;
+    insn++;
+    DISPATCH ();
+
+  TARGET (LDC_W)
+    PUSH (insn->a);
+    insn++;
+    DISPATCH ();
+
+  TARGET (POP)
+    DROP ();
+    insn++;
+    DISPATCH ();
+
+  TARGET (SWAP)
+    a = stack[sp - 1];
+    stack[sp - 1] = tos;
+    tos = a;
+    insn++;
+    DISPATCH ();
+
+#ifndef IJVM_COMPUTED_GOTO
+  default:
+#endif
+  TARGET (NOP)
+    insn++;
+    DISPATCH ();
+
+  PSEUDO (JUMP)
+    insn = insn->target;
+    if (budget < (long) insn->reserve) {
+      pc = insn->pc;
+      goto leave;
+    }
+    budget -= insn->cost;
+    CONTINUE ();
+
+  PSEUDO (EXIT)
+    pc = insn->pc;
+    goto leave;
+
+  PSEUDO (LOOP)
+    if (--insn->b == 0) {
+      pc = insn->pc;
+      goto leave;
+    }
+    insn = insn->target;
+    budget -= insn->cost;
+    CONTINUE ();
+
+  PSEUDO (TAIL_CALL)
+    if (budget >= 1 && lv + (insn->a & 0xffff) - 1 + insn->b < words) {
+      stack[sp] = tos;
+      budget--;
+      a = stack[lv];
+      pc = stack[a];
+      a = stack[a + 1];
+      for (n = 0; n < (insn->a & 0xffff); n++)
+	stack[lv + n] = stack[sp - (insn->a & 0xffff) + 1 + n];
+      sp = lv + (insn->a & 0xffff) - 1 + (insn->a >> 16);
+      stack[++sp] = pc;
+      stack[++sp] = a;
+      tos = a;
+      stack[lv] = sp - 1;
+      insn = insn->target;
+      ENTER ();
+    }
+
+  PSEUDO (CALL)
+    stack[sp] = tos;
+    if (sp + insn->b >= words)
+      goto stack_overflow;
+    a = sp - (insn->a & 0xffff) + 1;
+    sp += insn->a >> 16;
+    stack[++sp] = insn->pc + insn->length;
+    stack[++sp] = lv;
+    tos = lv;
+    stack[a] = sp - 1;
+    lv = a;
+    insn = insn->target;
+    ENTER ();
+
+  PSEUDO (ILOAD_ILOAD_IADD)
+    PUSH (stack[lv + insn->a]);
+    AT (insn + 1, sp);
+    stack[sp + 1] = stack[lv + insn->b];
+    tos += stack[sp + 1];
+    insn += 3;
+    fused += 2;
+    DISPATCH ();
+
+  PSEUDO (ILOAD_ILOAD_ISUB)
+    PUSH (stack[lv + insn->a]);
+    AT (insn + 1, sp);
+    stack[sp + 1] = stack[lv + insn->b];
+    tos -= stack[sp + 1];
+    insn += 3;
+    fused += 2;
+    DISPATCH ();
+
+  PSEUDO (ILOAD_ILOAD_IF_ICMPEQ)
+    stack[sp + 1] = stack[lv + insn->a];
+    AT (insn + 1, sp + 1);
+    stack[sp + 2] = stack[lv + insn->b];
+    fused += 2;
+    if (stack[sp + 2] == stack[sp + 1]) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn += 3;
+    FALL_THROUGH ();
+
+  PSEUDO (ILOAD_BIPUSH_ISUB)
+    PUSH (stack[lv + insn->a]);
+    AT (insn + 1, sp);
+    stack[sp + 1] = insn->b;
+    tos -= insn->b;
+    insn += 3;
+    fused += 2;
+    DISPATCH ();
+
+  PSEUDO (BIPUSH_IF_ICMPEQ)
+    stack[sp + 1] = insn->a;
+    a = tos;
+    DROP ();
+    fused += 1;
+    if (a == insn->a) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn += 2;
+    FALL_THROUGH ();
+
+  PSEUDO (ILOAD_IFEQ)
+    stack[sp + 1] = stack[lv + insn->a];
+    fused += 1;
+    if (stack[sp + 1] == 0) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn += 2;
+    FALL_THROUGH ();
+
+  PSEUDO (ILOAD_IFLT)
+    stack[sp + 1] = stack[lv + insn->a];
+    fused += 1;
+    if (stack[sp + 1] < 0) {
+      insn = insn->target;
+      ENTER ();
+    }
+    insn += 2;
+    FALL_THROUGH ();
+
+  PSEUDO (IINC_GOTO)
+    stack[lv + insn->a] += insn->b;
+    fused += 1;
+    insn = insn->target;
+    ENTER ();
+
+  PSEUDO (IADD_ISTORE)
+    sp -= 2;
+    a = stack[sp + 1] + tos;
+    AT (insn + 1, sp + 1);
+    stack[lv + insn->a] = a;
+    tos = stack[sp];
+    insn += 2;
+    fused += 1;
+    DISPATCH ();
+
+  PSEUDO (ISUB_ISTORE)
+    sp -= 2;
+    a = stack[sp + 1] - tos;
+    AT (insn + 1, sp + 1);
+    stack[lv + insn->a] = a;
+    tos = stack[sp];
+    insn += 2;
+    fused += 1;
+    DISPATCH ();
+
+#ifndef IJVM_COMPUTED_GOTO
+  }
+#endif
+
+ trace_step:
+  stack[sp] = tos;
+  ijvm_trace_stack (i, sp, FALSE);
+ trace_snapshot:
+  if (insn->length == 4) {
+    stack[sp] = tos;
+    ijvm_trace_insn (i, insn->pc);
+    ijvm_trace_stack (i, sp, FALSE);
+    ijvm_trace_insn (i, insn->pc + 1);
+  }
+  else if (insn->op < 256)
+    ijvm_trace_insn (i, insn->pc);
+  NEXT_HANDLER ();
+
+ stack_overflow:
+  i->pc = insn->pc + insn->length;
+  i->sp = sp;
+  i->lv = lv;
+  ijvm_stack_overflow (i, insn->target->pc - 4, insn->b);
+
+ out_of_budget:
+  if (trace) {
+    stack[sp] = tos;
+    ijvm_trace_stack (i, sp, FALSE);
+  }
+  pc = insn->pc;
+
+ leave:
+  stack[sp] = tos;
+  i->pc = pc;
+  i->sp = sp;
+  i->lv = lv;
+  i->wide = FALSE;
+  i->fused_dispatches += fused;
+  i->budget = budget;
+}
+
+#undef AT
+#undef TARGET
+#undef PSEUDO
+#undef NEXT_HANDLER
+#undef DISPATCH
+#undef CONTINUE
+#undef ENTER
+#undef FALL_THROUGH
+#undef RESUME
+#undef PUSH
+#undef DROP
+
+
+/* Stop the program with an error.  The message is kept in i->error;
+ * if i->fault is set, ijvm_error jumps there, as the library does to
+ * get back from a run.  Otherwise the message is printed and the
+ * process exits. */
+
 void
-ijvm_print_result (IJVM *i)
+ijvm_error (IJVM *i, char *format, ...)
 {
-  printf ("return value: %d\n", i->stack[i->sp]);
+  va_list args;
+
+  va_start (args, format);
+  vsnprintf (i->error, sizeof (i->error), format, args);
+  va_end (args);
+
+  if (i->fault != NULL)
+    siglongjmp (*i->fault, 1);
+
+  if (i->io != NULL)
+    ijvm_io_flush (i->io);
+  if (i->sink != NULL)
+    ijvm_sink_flush (i->sink);
+  fflush (stdout);
+  fprintf (stderr, "%s\n", i->error);
+  exit (-1);
+}
+
+/* Report an access outside the IJVM memory, see ijvm-memory.c.  PC
+ * is the offset of the instruction that made the access, or of the
+ * wide before it, and SP the stack pointer before that instruction.
+ * The interpreters store both in i->insn_pc and i->insn_sp before
+ * each instruction; compiled code doesn't, and ijvm_jit_fault finds
+ * them from the machine context instead.  Every engine makes the
+ * accesses that can fault in the same order as the switch engine, so
+ * they all report the same fault. */
+
+static void
+ijvm_fault (void *data, long address, void *context)
+{
+  IJVM *i = data;
+
+  if (i->jit != NULL)
+    ijvm_jit_fault (i, context);
+  ijvm_error (i, "Memory fault at address %ld (PC = 0x%04x, SP = %d)",
+	      address, i->insn_pc, (int32) i->insn_sp);
 }
 
 /* Initialize a new IJVM interpreter given a bytecode image.  The
  * entry point for the java bytecode program is the method main.  The
  * index in the constant pool of the address of main is specified in
  * the bytecode file in the first line; eg. `main index: 38'.  The
- * arguments given on the command line are converted to integers and
- * passed to main. */
+ * nargs words at args are passed to main, after the initial object
+ * reference.  The IJVM gets memory_size bytes of memory.
+ *
+ * Returns NULL if main takes a different number of arguments, the
+ * program doesn't fit in the memory or the memory can't be had; the
+ * reason is written to error, which has room for IJVM_ERROR_SIZE
+ * characters, unless it is NULL. */
+
+IJVM *
+ijvm_new (IJVMImage *image, unsigned long memory_size,
+	  int nargs, int32 *args, char *error)
+{
+  return ijvm_new_shared (image, NULL, memory_size, nargs, args, error);
+}
+
+/* Return the method area and constant pool of image as they are laid
+ * out in IJVM memory, to share between IJVMs running image; see
+ * ijvm_memory_share.  Returns NULL if they can't be shared. */
+
+IJVMMemoryShared *
+ijvm_share_image (IJVMImage *image)
+{
+  IJVMMemoryShared *shared;
+  uint8 *data;
+  uint32 length;
+
+  length = (image->method_area_size + 3) / 4 * 4;
+  data = calloc (length + image->cpool_size * sizeof (int32), 1);
+  memcpy (data, image->method_area, image->method_area_size);
+  memcpy (data + length, image->cpool, image->cpool_size * sizeof (int32));
+  shared = ijvm_memory_share (data, length + image->cpool_size * sizeof (int32));
+  free (data);
+
+  return shared;
+}
+
+/* ijvm_new for an IJVM whose memory starts with shared, which
+ * ijvm_share_image made from image, or with a copy of image if shared
+ * is NULL. */
 
 IJVM *
-ijvm_new (IJVMImage *image, int argc, char *argv[])
+ijvm_new_shared (IJVMImage *image, IJVMMemoryShared *shared,
+		 unsigned long memory_size, int nargs, int32 *args,
+		 char *error)
 {
   IJVM *i;
-  int main_offset, nargs, j;
-  char *end_ptr;
+  uint8 *memory;
+  int main_offset, nlocals, j;
+  unsigned long estimate;
+  char why[IJVM_ERROR_SIZE];
+
+  if (image->main_index >= image->cpool_size ||
+      image->cpool[image->main_index] + 4 > image->method_area_size)
+    main_offset = -1;
+  else
+    main_offset = image->cpool[image->main_index];
+  /* Number of arguments to main, not counting the object reference */
+  if (main_offset < 0 ||
+      image->method_area[main_offset] * 256 +
+      image->method_area[main_offset + 1] != nargs + 1) {
+    if (error != NULL)
+      snprintf (error, IJVM_ERROR_SIZE, "Incorrect number of arguments");
+    return NULL;
+  }
+
+  /* The image, the arguments and the frame of main, with its operand
+   * stack if the image records how far that grows. */
+  nlocals = image->method_area[main_offset + 2] * 256 +
+    image->method_area[main_offset + 3];
+  if ((image->method_area_size + 3) / 4 + image->cpool_size +
+      nargs + nlocals + 3 +
+      MAX (ijvm_image_max_stack (image, main_offset), 0) >= memory_size / 4) {
+    if (error != NULL)
+      snprintf (error, IJVM_ERROR_SIZE,
+		"The program doesn't fit in %lu bytes of memory", memory_size);
+    return NULL;
+  }
+
+  if (shared != NULL)
+    memory = ijvm_memory_new_shared (memory_size, shared);
+  else
+    memory = ijvm_memory_new (memory_size);
+  if (memory == NULL) {
+    if (error != NULL)
+      snprintf (error, IJVM_ERROR_SIZE,
+		"Couldn't allocate %lu bytes of memory", memory_size);
+    return NULL;
+  }
 
   i = malloc (sizeof (IJVM));
-  i->method = malloc (IJVM_MEMORY_SIZE);
+  i->memory_size = memory_size;
+  i->method = memory;
   i->cpp = (int32 *) i->method + (image->method_area_size + 3) / 4;
   i->stack = (int32 *) i->method;
-  memset (i->method, 0, IJVM_MEMORY_SIZE);
+  ijvm_memory_set_fault (i->method, ijvm_fault, i);
 
   i->sp = i->cpp + image->cpool_size - i->stack - 1;
   i->initial_sp = i->sp;
   i->lv = 0;
   i->pc = IJVM_INITIAL_PC;
   i->wide = FALSE;
-
-  memcpy (i->method, image->method_area, image->method_area_size);
-  memcpy (i->cpp, image->cpool, image->cpool_size * sizeof (int32));
-
-  main_offset = i->cpp[image->main_index];
-  /* Number of arguments to main */  
-  nargs = i->method[main_offset] * 256 + i->method[main_offset + 1];
-
-  /* Dont count argv[0], argv[1] or obj. ref. */
-  if (argc - 2 != nargs - 1) {
-    printf ("Incorrect number of arguments\n");
-    exit (-1);
+  i->code = NULL;
+  i->frames = NULL;
+  i->nframes = 0;
+  i->tail_calls = FALSE;
+  i->budget = LONG_MAX;
+  i->instructions = 0;
+  i->limit = 0;
+  i->fused_dispatches = 0;
+  i->jit = NULL;
+  i->loops = NULL;
+  i->memo = NULL;
+  i->sink = NULL;
+  i->io = NULL;
+  i->spec = NULL;
+  i->fault = NULL;
+  i->error[0] = '\0';
+
+  if (shared == NULL) {
+    memcpy (i->method, image->method_area, image->method_area_size);
+    memcpy (i->cpp, image->cpool, image->cpool_size * sizeof (int32));
   }
 
   ijvm_push (i, IJVM_INITIAL_OBJ_REF);
-  for (j = 0; j < nargs - 1; j++) {
-    ijvm_push (i, strtol (argv[j + 2], &end_ptr, 0));
-    if (argv[j + 2] == end_ptr) {
-      printf ("Invalid argument to main method: `%s'\n", argv[j + 2]);
-      exit (-1);
-    }
-  }      
+  for (j = 0; j < nargs; j++)
+    ijvm_push (i, args[j]);
 
   /* Initialize the IJVM by simulating a call to main */
   ijvm_invoke_virtual (i, image->main_index);
 
-  return i;
-}
-
-int 
-main (int argc, char *argv[])
-{
-  FILE *file;
-  IJVMImage *image;
-  IJVM *i;
-  int verbose;
-  char *time_string;
-  time_t t;
-
-  ijvm_print_init (&argc, argv);
-
-  if (argc < 2) {
-    fprintf (stderr, "Usage: ijvm [OPTION] FILENAME [PARAMETERS ...]\n\n");
-    fprintf (stderr, "Where OPTION is\n\n");
-    fprintf (stderr, "  -s            Silent mode.  No snapshot is produced.\n");
-    fprintf (stderr, "  -f SPEC-FILE  The IJVM specification file to use.\n\n");
-    fprintf (stderr, "If you pass `-' as the filename the simulator will read the bytecode\nfile from stdin.\n\n");
-    fprintf (stderr, "You must specify as many arguments as your main method requires, except\n");
-    fprintf (stderr, "one; the simulator will pass the initial object reference for you.\n");
-    exit (-1);
-  }
-
-  verbose = TRUE;
-  if (strcmp (argv[1], "-s") == 0) {
-    verbose = FALSE;
-    argv = argv + 1;
-    argc = argc - 1;
+  /* Calls needn't check their frames if the memory holds the deepest
+   * stack the program can build. */
+  if (image->nmax_stack > 0) {
+    estimate = ijvm_stack_estimate (image, why);
+    if (estimate == 0 || estimate > memory_size) {
+      i->frames = ijvm_stack_frames (image);
+      i->nframes = image->cpool_size;
+    }
   }
 
-  if (strcmp (argv[1], "-") == 0)
-    file = stdin;
-  else
-    file = fopen (argv[1], "r");
-  if (file == NULL) {
-    printf ("Could not open bytecode file `%s'\n", argv[1]);
-    exit (-1);
-  }
-  image = ijvm_image_load (file);
-  fclose (file);
-  i = ijvm_new (image, argc, argv);
-
-  if (verbose) {
-    t = time (NULL);
-    time_string = ctime (&t);
-    printf ("IJVM Trace of %s %s\n", argv[1], time_string);
-  }
+  return i;
+}
 
-  /* This is the interpreter main loop.  It essentially excecutes
-   * ijvm_execute_opcode until the program terminates (which is when
-   * an ireturn from main is encountered).  In each step, the
-   * instruction, its arguments and the top 8 elements on the stack
-   * are printed. */
-
-  if (verbose)
-    ijvm_print_stack (i->stack + i->sp, MIN (i->sp - i->initial_sp, 8), TRUE);
-  while (ijvm_active (i)) {
-    if (verbose)
-      ijvm_print_snapshot (i->method + i->pc);
-    ijvm_execute_opcode (i);
-    if (verbose)
-      ijvm_print_stack (i->stack + i->sp, MIN (i->sp - i->initial_sp, 8), FALSE);
-  }
+/* Free i with its memory, decoded and compiled code and I/O
+ * buffers. */
 
-  ijvm_print_result (i);
-  return 0;
+void
+ijvm_free (IJVM *i)
+{
+  ijvm_memory_free (i->method);
+  if (i->code != NULL)
+    ijvm_code_free (i->code);
+  if (i->jit != NULL)
+    ijvm_jit_free (i->jit);
+  if (i->loops != NULL)
+    ijvm_loops_free (i->loops);
+  if (i->memo != NULL)
+    ijvm_memo_free (i->memo);
+  if (i->io != NULL)
+    ijvm_io_free (i->io);
+  free (i);
 }
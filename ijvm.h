@@ -0,0 +1,263 @@
+#ifndef IJVM_H
+#define IJVM_H
+
+#include <setjmp.h>
+
+#include "types.h"
+#include "ijvm-util.h"
+#include "ijvm-sink.h"
+#include "ijvm-io.h"
+#include "ijvm-memory.h"
+
+/* ijvm.h
+ *
+ * Internal interface of the IJVM interpreter, shared between the
+ * interpreter proper in ijvm.c and the modules that prepare code for
+ * it. */
+
+typedef struct IJVMInsn IJVMInsn;
+typedef struct IJVMCode IJVMCode;
+typedef struct IJVMCodeBlock IJVMCodeBlock;
+typedef struct IJVMJit IJVMJit;
+typedef struct IJVMLoops IJVMLoops;
+typedef struct IJVMProfile IJVMProfile;
+typedef struct IJVMCoverage IJVMCoverage;
+typedef struct IJVMMemo IJVMMemo;
+
+/* Pseudo operations in the decoded instruction stream.  They are
+ * numbered after the 256 IJVM opcodes, so that a decoded instruction
+ * is either a real opcode or one of these. */
+
+#define IJVM_DECODED_JUMP   256  /* Continue at target (no trace line) */
+#define IJVM_DECODED_EXIT   257  /* Leave the decoded stream at pc */
+#define IJVM_DECODED_CALL   258  /* Invoke a verified method, see
+				  * ijvm_code_bind */
+#define IJVM_DECODED_TAIL_CALL 259  /* The same, followed by ireturn */
+
+/* Superinstructions.  A superinstruction replaces the first of a
+ * sequence of decoded instructions and does the work of the whole
+ * sequence; the rest of the sequence stays in place behind it, in
+ * case something jumps into the middle.  See ijvm_super_insns in
+ * ijvm-decode.c for the sequences and their operands. */
+
+#define IJVM_DECODED_ILOAD_ILOAD_IADD       260
+#define IJVM_DECODED_ILOAD_ILOAD_ISUB       261
+#define IJVM_DECODED_ILOAD_ILOAD_IF_ICMPEQ  262
+#define IJVM_DECODED_ILOAD_BIPUSH_ISUB      263
+#define IJVM_DECODED_BIPUSH_IF_ICMPEQ       264
+#define IJVM_DECODED_ILOAD_IFEQ             265
+#define IJVM_DECODED_ILOAD_IFLT             266
+#define IJVM_DECODED_IINC_GOTO              267
+#define IJVM_DECODED_IADD_ISTORE            268
+#define IJVM_DECODED_ISUB_ISTORE            269
+
+/* The head of a loop the hot engine is counting, see ijvm-loops.c:
+ * target = the head, b = the entries left before it is traced. */
+
+#define IJVM_DECODED_LOOP   270
+
+#define IJVM_DECODED_NOPS   271
+
+/* A decoded instruction.  The operands are fetched, sign extended
+ * and folded with a preceding wide by the decoder, and branch offsets
+ * are turned into absolute method area offsets (a) and a pointer to
+ * the decoded target (target).  The byte offset of the original
+ * instruction is kept in pc, for traces and for returning to byte
+ * interpretation.
+ *
+ *   bipush      a = value
+ *   iinc        a = varnum, b = value
+ *   iload       a = varnum
+ *   istore      a = varnum
+ *   ldc_w       a = constant value
+ *   invokevirtual a = constant pool index
+ *   branches    a = target pc, target = decoded target
+ *   call        a = nargs + nlocals * 65536, b = words the frame
+ *               needs (0 for no check), target = decoded method
+ *   tail call   as call
+ *
+ * For instruction budgets, see ijvm_run_threaded, each instruction
+ * also records the cost of running from it to the end of its basic
+ * block: the number of bytecode instructions up to and including the
+ * next branch, invokevirtual, ireturn or pseudo instruction (a folded
+ * wide counts as an instruction of its own, as in the switch engine).
+ * If the block ends in a conditional branch, reserve adds the reserve
+ * of the block it falls through to, so it covers every instruction
+ * the engine can run before it next takes a branch, calls or
+ * returns.
+ */
+
+struct IJVMInsn
+{
+  void *handler;        /* Threaded engine handler, set when linked */
+  IJVMInsn *target;
+  int32 a, b;
+  uint32 pc;
+  uint32 cost, reserve; /* Instructions to the end of the block */
+  uint16 op;
+  uint8 length;         /* Size in method area, including any wide */
+};
+
+struct IJVMCode
+{
+  IJVMInsn *insns;
+  int ninsns, alloc;
+  IJVMInsn **map;       /* Method area offset to decoded instruction */
+  uint32 size;          /* Size of method area */
+  void **linked;        /* Dispatch table the handlers were taken from */
+  IJVMCodeBlock *blocks;  /* Instructions added since, see ijvm_code_add */
+};
+
+/* Instructions made after decoding, such as the loop traces of the
+ * hot engine.  They may jump to the decoded ones and back, and are
+ * linked with them. */
+
+struct IJVMCodeBlock
+{
+  IJVMInsn *insns;
+  int ninsns;
+  IJVMCodeBlock *next;
+};
+
+typedef struct IJVMSuperInsn IJVMSuperInsn;
+struct IJVMSuperInsn
+{
+  uint16 op;
+  int length;           /* Number of instructions replaced */
+  uint8 opcodes[3];
+};
+
+extern IJVMSuperInsn ijvm_super_insns[];
+
+IJVMCode *ijvm_code_decode (IJVMImage *image);
+IJVMInsn *ijvm_code_lookup (IJVMCode *code, uint32 pc);
+void ijvm_code_free (IJVMCode *code);
+void ijvm_code_count (IJVMInsn *insns, int ninsns);
+void ijvm_code_add (IJVMCode *code, IJVMInsn *insns, int ninsns);
+void ijvm_code_link (IJVMCode *code, void **table);
+bool ijvm_insn_ends_block (IJVMInsn *insn);
+bool ijvm_insn_is_conditional (IJVMInsn *insn);
+void ijvm_code_fuse (IJVMCode *code, IJVMSuperInsn **table);
+void ijvm_code_bind (IJVM *i, IJVMImage *image);
+bool ijvm_verify (IJVMImage *image, char *error);
+bool ijvm_verify_cached (IJVMImage *image, IJVMSpec *spec, char *error);
+uint32 *ijvm_stack_frames (IJVMImage *image);
+unsigned long ijvm_stack_estimate (IJVMImage *image, char *why);
+IJVMSuperInsn **ijvm_super_insns_from_profile (FILE *file);
+void ijvm_pair_profile_write (FILE *file, unsigned long *pairs);
+
+#define IJVM_ERROR_SIZE 256
+
+/* The exit status of ijvm when the program runs out of its --limit,
+ * the value of IJVM_STATUS_LIMIT in libijvm.h.  Other errors exit
+ * with -1. */
+#define IJVM_EXIT_LIMIT 3
+
+struct IJVM
+{
+  uint32 sp, lv, pc, wide;
+  uint32 insn_pc, insn_sp;         /* The instruction running, see ijvm_fault */
+  int32 *stack;
+  int32 *cpp;
+  uint8 *method;
+
+  uint32 initial_sp;
+  unsigned long memory_size;
+
+  IJVMCode *code;
+  uint32 *frames;                  /* See ijvm_stack_frames, or NULL */
+  uint32 nframes;
+  bool tail_calls;                 /* See ijvm_invoke_virtual */
+  long budget;                     /* See ijvm_run_threaded */
+  unsigned long instructions;      /* Run by ijvm_run, see libijvm.c */
+  unsigned long limit;             /* Most ijvm_run may run, 0 if any */
+  unsigned long fused_dispatches;  /* Dispatches saved by superinsns */
+  IJVMJit *jit;                    /* Compiled code, see ijvm-jit.c */
+  IJVMLoops *loops;                /* Loop traces, see ijvm-loops.c */
+  IJVMMemo *memo;                  /* Results of pure methods, or NULL */
+  IJVMSink *sink;                  /* Binary trace, or NULL */
+  IJVMIO *io;                      /* Input and output of builtins */
+  IJVMSpec *spec;                  /* For text traces, or NULL */
+  sigjmp_buf *fault;               /* Where ijvm_error jumps, or NULL */
+  char error[IJVM_ERROR_SIZE];     /* Why the program stopped */
+};
+
+/* The interpreter engines.  The switch engine is the reference
+ * implementation; it executes one instruction per call to
+ * ijvm_execute_opcode.  The threaded engine runs the instruction
+ * stream decoded by ijvm_code_decode until the program terminates or
+ * leaves the decoded code, after which the switch engine takes
+ * over.  The tos engine is the threaded engine with the top of the
+ * stack cached in a register.  The jit engine compiles methods to
+ * native code, see ijvm-jit.c.  The hot engine is the threaded
+ * engine with traces of its hot loops, see ijvm-loops.c. */
+
+typedef enum IJVMEngine IJVMEngine;
+enum IJVMEngine
+{
+  IJVM_ENGINE_SWITCH,
+  IJVM_ENGINE_THREADED,
+  IJVM_ENGINE_TOS,
+  IJVM_ENGINE_JIT,
+  IJVM_ENGINE_HOT
+};
+
+int8   ijvm_fetch_int8 (IJVM *i);
+uint8  ijvm_fetch_uint8 (IJVM *i);
+int16  ijvm_fetch_int16 (IJVM *i);
+uint16 ijvm_fetch_uint16 (IJVM *i);
+void   ijvm_push (IJVM *i, int32 word);
+int32  ijvm_pop (IJVM *i);
+void   ijvm_invoke_builtin (IJVM *i, uint16 index);
+void   ijvm_invoke_virtual (IJVM *i, uint16 index);
+void   ijvm_stack_overflow (IJVM *i, uint32 address, uint32 words);
+void   ijvm_ireturn (IJVM *i);
+void   ijvm_execute_opcode (IJVM *i);
+int    ijvm_active (IJVM *i);
+void   ijvm_trace_insn (IJVM *i, uint32 pc);
+void   ijvm_trace_stack (IJVM *i, uint32 sp, bool indent);
+void   ijvm_run_threaded (IJVM *i, bool trace);
+void   ijvm_run_tos (IJVM *i, bool trace);
+bool   ijvm_run_jit (IJVM *i);
+void   ijvm_jit_fault (IJVM *i, void *context);
+void   ijvm_jit_print_statistics (IJVM *i);
+void   ijvm_jit_free (IJVMJit *jit);
+void   ijvm_run_loops (IJVM *i, IJVMSuperInsn **supers);
+void   ijvm_loops_print_statistics (IJVM *i);
+void   ijvm_loops_free (IJVMLoops *loops);
+void   ijvm_run_engine (IJVM *i, IJVMImage *image, IJVMEngine engine,
+			IJVMSuperInsn **supers, bool verbose);
+int    ijvm_batch_run (IJVMImage *image, char *filename, int nthreads,
+		       unsigned long memory_size, unsigned long limit,
+		       IJVMEngine engine, IJVMSuperInsn **supers,
+		       bool tail_calls);
+bool   ijvm_checkpoint_at_input (IJVM *i);
+bool   ijvm_checkpoint_write (IJVM *i, IJVMImage *image, FILE *file);
+IJVM  *ijvm_checkpoint_read (FILE *file, IJVMImage *image,
+			     long *input, long *output, char *error);
+IJVMProfile *ijvm_profile_new (IJVM *i, IJVMImage *image);
+void   ijvm_profile_step (IJVMProfile *p, IJVM *i);
+void   ijvm_profile_finish (IJVMProfile *p);
+void   ijvm_profile_print (IJVMProfile *p, FILE *file);
+void   ijvm_profile_write_folded (IJVMProfile *p, FILE *file);
+void   ijvm_profile_free (IJVMProfile *p);
+IJVMCoverage *ijvm_coverage_new (IJVMImage *image, IJVMSpec *spec);
+bool   ijvm_coverage_read_lines (IJVMCoverage *c, FILE *file);
+void   ijvm_coverage_step (IJVMCoverage *c, IJVM *i);
+void   ijvm_coverage_write (IJVMCoverage *c, FILE *file);
+void   ijvm_coverage_free (IJVMCoverage *c);
+IJVMMemo *ijvm_memo_new (IJVMImage *image);
+bool   ijvm_memo_call (IJVMMemo *memo, IJVM *i, uint16 index);
+void   ijvm_memo_return (IJVMMemo *memo, IJVM *i);
+void   ijvm_memo_print_statistics (IJVM *i);
+void   ijvm_memo_free (IJVMMemo *memo);
+void   ijvm_error (IJVM *i, char *format, ...);
+IJVM  *ijvm_new (IJVMImage *image, unsigned long memory_size,
+		 int nargs, int32 *args, char *error);
+IJVMMemoryShared *ijvm_share_image (IJVMImage *image);
+IJVM  *ijvm_new_shared (IJVMImage *image, IJVMMemoryShared *shared,
+			unsigned long memory_size, int nargs, int32 *args,
+			char *error);
+void   ijvm_free (IJVM *i);
+
+#endif
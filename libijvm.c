@@ -0,0 +1,297 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "ijvm.h"
+#include "libijvm.h"
+
+/* libijvm.c
+ *
+ * The library interface, see libijvm.h.  A run uses the threaded
+ * engine, which keeps to an instruction budget a basic block at a
+ * time, and the switch engine for the instructions that are left
+ * when the budget won't cover another block; the other engines
+ * belong to the ijvm program.  Errors in the interpreter end up in
+ * ijvm_error, which jumps back to ijvm_run through i->fault. */
+
+/* Create an IJVM running image, with memory_size bytes of memory and
+ * the nargs words at args as the arguments to main.  Returns NULL if
+ * it can't be, see ijvm_new, and writes why to error, which has room
+ * for size characters. */
+
+IJVM *
+ijvm_create (IJVMImage *image, unsigned long memory_size,
+	     int nargs, int *args, char *error, int size)
+{
+  IJVM *i;
+  int32 *words;
+  char message[IJVM_ERROR_SIZE];
+  int j;
+
+  words = malloc (MAX (nargs, 1) * sizeof (int32));
+  for (j = 0; j < nargs; j++)
+    words[j] = args[j];
+  i = ijvm_new (image, memory_size, nargs, words, message);
+  free (words);
+  if (i == NULL) {
+    if (size > 0)
+      snprintf (error, size, "%s", message);
+    return NULL;
+  }
+
+  i->io = ijvm_io_new_memory ((uint8 *) "", 0);
+  i->code = ijvm_code_decode (image);
+  i->tail_calls = TRUE;
+  ijvm_code_fuse (i->code, NULL);
+  ijvm_code_bind (i, image);
+
+  return i;
+}
+
+/* Check image with the verifier, see ijvm-verify.c.  Returns 1 if it
+ * passes, after which the IJVMs created from it run their calls
+ * without checks; otherwise returns 0 and writes what is wrong with
+ * it to error, which has room for size characters. */
+
+int
+ijvm_image_verify (IJVMImage *image, char *error, int size)
+{
+  char message[IJVM_ERROR_SIZE];
+
+  if (ijvm_verify (image, message))
+    return 1;
+  if (size > 0)
+    snprintf (error, size, "%s", message);
+  return 0;
+}
+
+/* Give the program the length characters at data as its input, in
+ * place of what was left of the input before. */
+
+void
+ijvm_set_input (IJVM *i, const unsigned char *data, int length)
+{
+  IJVMIO *io;
+
+  io = ijvm_io_new_memory ((uint8 *) data, length);
+  ijvm_io_write (io, i->io->out, i->io->out_length);
+  ijvm_io_free (i->io);
+  i->io = io;
+}
+
+/* Run at most steps instructions, or until the program ends if steps
+ * is 0, and never past the limit set with ijvm_set_limit. */
+
+IJVMStatus
+ijvm_run (IJVM *i, unsigned long steps)
+{
+  sigjmp_buf fault;
+  volatile long budget;         /* Kept across the siglongjmp */
+
+  if (i->error[0] != '\0')
+    return IJVM_STATUS_ERROR;
+
+  budget = steps == 0 || steps > LONG_MAX ? LONG_MAX : (long) steps;
+  if (i->limit > 0 && ijvm_active (i)) {
+    if (i->instructions >= i->limit)
+      return IJVM_STATUS_LIMIT;
+    if (i->limit - i->instructions < (unsigned long) budget)
+      budget = i->limit - i->instructions;
+  }
+
+  if (sigsetjmp (fault, 1) != 0) {
+    i->instructions += budget - i->budget;
+    i->budget = LONG_MAX;
+    i->fault = NULL;
+    return IJVM_STATUS_ERROR;
+  }
+  i->fault = &fault;
+
+  /* The threaded engine can't start after a wide, which it folds
+   * into the next instruction. */
+  i->budget = budget;
+  while (ijvm_active (i) && i->budget > 0) {
+    if (!i->wide)
+      ijvm_run_threaded (i, FALSE);
+    if (ijvm_active (i) && i->budget > 0) {
+      ijvm_execute_opcode (i);
+      i->budget--;
+    }
+  }
+  i->instructions += budget - i->budget;
+  i->budget = LONG_MAX;
+
+  i->fault = NULL;
+  if (!ijvm_active (i))
+    return IJVM_STATUS_DONE;
+  if (i->limit > 0 && i->instructions >= i->limit)
+    return IJVM_STATUS_LIMIT;
+  return IJVM_STATUS_RUNNING;
+}
+
+/* Stop the program with IJVM_STATUS_LIMIT once it has run
+ * instructions instructions in all, or never if instructions is 0. */
+
+void
+ijvm_set_limit (IJVM *i, unsigned long instructions)
+{
+  i->limit = instructions;
+}
+
+/* The number of instructions the program has run so far. */
+
+unsigned long
+ijvm_get_instructions (IJVM *i)
+{
+  return i->instructions;
+}
+
+void
+ijvm_get_registers (IJVM *i, IJVMRegisters *registers)
+{
+  registers->pc = i->pc;
+  registers->sp = i->sp;
+  registers->lv = i->lv;
+  registers->cpp = i->cpp - i->stack;
+  registers->wide = i->wide;
+}
+
+/* Copy up to n words from the top of the stack to words, the top
+ * first.  Returns the number of words copied, which is less than n
+ * if the stack holds fewer.  After an error SP may be anywhere, so
+ * only words in the memory are copied. */
+
+int
+ijvm_get_stack (IJVM *i, int *words, int n)
+{
+  uint32 size;
+  int j;
+
+  size = i->memory_size / 4;
+  for (j = 0; j < n && i->sp - j > i->initial_sp; j++) {
+    if (i->sp - j >= size)
+      break;
+    words[j] = i->stack[i->sp - j];
+  }
+
+  return j;
+}
+
+/* The value main returned, once ijvm_run says it is done. */
+
+int
+ijvm_get_result (IJVM *i)
+{
+  if (i->sp >= i->memory_size / 4)
+    return 0;
+  return i->stack[i->sp];
+}
+
+/* The output of the program so far, which stays valid until the
+ * program is run again or destroyed. */
+
+const unsigned char *
+ijvm_get_output (IJVM *i, int *length)
+{
+  return ijvm_io_output (i->io, length);
+}
+
+/* Why the program stopped with IJVM_STATUS_ERROR, or "". */
+
+const char *
+ijvm_get_error (IJVM *i)
+{
+  return i->error;
+}
+
+void
+ijvm_destroy (IJVM *i)
+{
+  ijvm_free (i);
+}
+
+/* Round robin scheduling.  The IJVMs take turns of quantum
+ * instructions, in the order they were added, until one stops; the
+ * scheduler hands that one back and the others carry on from where
+ * they were at the next call. */
+
+struct IJVMScheduler
+{
+  IJVM **ijvms;
+  int n, alloc;
+  int next;             /* Whose turn it is */
+  unsigned long quantum;
+};
+
+IJVMScheduler *
+ijvm_scheduler_new (unsigned long quantum)
+{
+  IJVMScheduler *scheduler;
+
+  scheduler = malloc (sizeof (IJVMScheduler));
+  scheduler->ijvms = NULL;
+  scheduler->n = 0;
+  scheduler->alloc = 0;
+  scheduler->next = 0;
+  scheduler->quantum = quantum > 0 ? quantum : 1;
+
+  return scheduler;
+}
+
+void
+ijvm_scheduler_add (IJVMScheduler *scheduler, IJVM *i)
+{
+  if (scheduler->n == scheduler->alloc) {
+    scheduler->alloc = MAX (scheduler->alloc * 2, 16);
+    scheduler->ijvms = realloc (scheduler->ijvms,
+				scheduler->alloc * sizeof (IJVM *));
+  }
+  scheduler->ijvms[scheduler->n++] = i;
+}
+
+/* The number of IJVMs that haven't stopped yet. */
+
+int
+ijvm_scheduler_count (IJVMScheduler *scheduler)
+{
+  return scheduler->n;
+}
+
+/* Run the IJVMs in turn until one of them stops, and return it with
+ * the status it stopped with; it is no longer scheduled.  Returns
+ * NULL when there are no IJVMs left. */
+
+IJVM *
+ijvm_scheduler_run (IJVMScheduler *scheduler, IJVMStatus *status)
+{
+  IJVM *i;
+  int j;
+
+  while (scheduler->n > 0) {
+    if (scheduler->next >= scheduler->n)
+      scheduler->next = 0;
+    i = scheduler->ijvms[scheduler->next];
+    *status = ijvm_run (i, scheduler->quantum);
+    if (*status == IJVM_STATUS_RUNNING) {
+      scheduler->next++;
+      continue;
+    }
+
+    /* Keep the order of the others, so turns stay fair. */
+    scheduler->n--;
+    for (j = scheduler->next; j < scheduler->n; j++)
+      scheduler->ijvms[j] = scheduler->ijvms[j + 1];
+    return i;
+  }
+
+  return NULL;
+}
+
+/* Free scheduler; the IJVMs still in it are left to the caller. */
+
+void
+ijvm_scheduler_free (IJVMScheduler *scheduler)
+{
+  free (scheduler->ijvms);
+  free (scheduler);
+}
@@ -0,0 +1,86 @@
+#ifndef LIBIJVM_H
+#define LIBIJVM_H
+
+#include <stdio.h>
+
+/* libijvm.h
+ *
+ * The IJVM interpreter as a library, for programs that run IJVM
+ * programs of their own.  An IJVM is created from a bytecode image,
+ * run for as many instructions at a time as the caller likes, and
+ * looked at in between.  The library keeps no state outside the IJVMs
+ * and images it hands out, so any number of them can be used at once,
+ * from as many threads, as long as each IJVM is only used by one
+ * thread at a time.  An image can be shared by IJVMs in any thread;
+ * ijvm_create copies what it needs from it.
+ *
+ * A program reads its input from a block of memory given with
+ * ijvm_set_input, empty unless one is given, and its output collects
+ * in memory, see ijvm_get_output.  An error in the program, such as
+ * an access outside its memory, stops it with IJVM_STATUS_ERROR
+ * instead of stopping the process, and ijvm_get_error says why.
+ *
+ * ijvm_image_read takes both the text images of ijvm-asm and the
+ * binary ones of `ijvm-asm --binary'; a binary image in a regular file
+ * is mapped into memory rather than read.
+ *
+ * An image read from an untrusted source can be checked with
+ * ijvm_image_verify before it is run; the programs it passes run a
+ * little faster, and the ones it fails are better not run at all.
+ *
+ * A program can be given a limit on the number of instructions it
+ * runs in all, see ijvm_set_limit, after which it stops with
+ * IJVM_STATUS_LIMIT; a program that never ends then can't hold up its
+ * caller.  An IJVMScheduler runs any number of IJVMs on one thread,
+ * taking turns of a fixed number of instructions each, and hands them
+ * back as they stop.
+ *
+ * Link with -lijvm -lpthread. */
+
+typedef struct IJVM IJVM;
+typedef struct IJVMImage IJVMImage;
+typedef struct IJVMScheduler IJVMScheduler;
+
+typedef enum IJVMStatus IJVMStatus;
+enum IJVMStatus
+{
+  IJVM_STATUS_RUNNING,  /* Ran the instructions asked for, not done yet */
+  IJVM_STATUS_DONE,     /* Main returned, see ijvm_get_result */
+  IJVM_STATUS_ERROR,    /* Stopped by an error, see ijvm_get_error */
+  IJVM_STATUS_LIMIT     /* Ran as many instructions as ijvm_set_limit allows */
+};
+
+typedef struct IJVMRegisters IJVMRegisters;
+struct IJVMRegisters
+{
+  unsigned int pc;      /* Byte offset in the method area */
+  unsigned int sp;      /* Word offsets in the memory */
+  unsigned int lv;
+  unsigned int cpp;
+  int wide;             /* The last instruction was wide */
+};
+
+IJVMImage *ijvm_image_read (FILE *file);
+int ijvm_image_verify (IJVMImage *image, char *error, int size);
+void ijvm_image_free (IJVMImage *image);
+
+IJVM *ijvm_create (IJVMImage *image, unsigned long memory_size,
+		   int nargs, int *args, char *error, int size);
+void ijvm_set_input (IJVM *i, const unsigned char *data, int length);
+IJVMStatus ijvm_run (IJVM *i, unsigned long steps);
+void ijvm_set_limit (IJVM *i, unsigned long instructions);
+unsigned long ijvm_get_instructions (IJVM *i);
+void ijvm_get_registers (IJVM *i, IJVMRegisters *registers);
+int ijvm_get_stack (IJVM *i, int *words, int n);
+int ijvm_get_result (IJVM *i);
+const unsigned char *ijvm_get_output (IJVM *i, int *length);
+const char *ijvm_get_error (IJVM *i);
+void ijvm_destroy (IJVM *i);
+
+IJVMScheduler *ijvm_scheduler_new (unsigned long quantum);
+void ijvm_scheduler_add (IJVMScheduler *scheduler, IJVM *i);
+int ijvm_scheduler_count (IJVMScheduler *scheduler);
+IJVM *ijvm_scheduler_run (IJVMScheduler *scheduler, IJVMStatus *status);
+void ijvm_scheduler_free (IJVMScheduler *scheduler);
+
+#endif
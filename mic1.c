@@ -1,8 +1,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <stdarg.h>
 #include "mic1-util.h"
 #include "ijvm-util.h"
+#include "ijvm-sink.h"
+#include "ijvm-memory.h"
 
 typedef struct Mic1 Mic1;
 struct Mic1 {
@@ -19,6 +22,10 @@ struct Mic1 {
 
   /* This is the first address on the stack */
   uint32 stack_base;
+  unsigned long memory_size;
+
+  /* Binary trace, or NULL to print the trace */
+  IJVMSink *sink;
 };
 
 typedef struct Mic1Breakpoint Mic1Breakpoint;
@@ -29,6 +36,7 @@ struct Mic1Breakpoint {
 
 Mic1Breakpoint *mic1_breakpoint_list;
 bool mic1_default_microtrace = FALSE, mic1_microtrace;
+IJVMSpec *mic1_spec;
 
 bool
 mic1_breakpoint_add (char *mnemonic)
@@ -40,7 +48,7 @@ mic1_breakpoint_add (char *mnemonic)
     mic1_default_microtrace = TRUE;
     return TRUE;
   }
-  opcode = ijvm_get_opcode (mnemonic);
+  opcode = ijvm_get_opcode (mic1_spec, mnemonic);
   if (opcode == -1)
     return FALSE;
   bp = malloc (sizeof (Mic1Breakpoint));
@@ -64,15 +72,35 @@ mic1_is_breakpoint (int opcode)
   return FALSE;
 }
 
+/* Print trace text, or record it in the binary trace. */
+
+void
+mic1_printf (Mic1 *m, const char *format, ...)
+{
+  va_list ap;
+
+  va_start (ap, format);
+  if (m->sink != NULL)
+    ijvm_sink_vprintf (m->sink, format, ap);
+  else
+    vprintf (format, ap);
+  va_end (ap);
+}
+
 void
 mic1_print_stack (Mic1 *m, int indent)
 {
   int length;
 
-  if (0 <= m->sp && m->sp < IJVM_MEMORY_SIZE / 4) {
+  if (0 <= m->sp && (unsigned long) m->sp < m->memory_size / 4) {
     length = MIN (m->sp - m->stack_base, 8);
-    ijvm_print_stack (m->word_store + m->sp, length, indent);
+    if (m->sink != NULL)
+      ijvm_sink_stack (m->sink, m->word_store, m->sp, length, indent);
+    else
+      ijvm_print_stack (m->word_store + m->sp, length, indent);
   }
+  else if (m->sink != NULL)
+    ijvm_sink_sp_out_of_range (m->sink, m->sp);
   else
     printf ("SP out of range (SP = %d)\n", m->sp);
 }
@@ -80,10 +108,10 @@ mic1_print_stack (Mic1 *m, int indent)
 void
 mic1_print_registers (Mic1 *m)
 {
-  printf ("  MAR=%d MDR=%d PC=%d MBR=%d MBRU=%d SP=%d "
-	  "LV=%d CPP=%d TOS=%d OPC=%d H=%d\n\n",
-	  m->mar, m->mdr, m->pc, m->u.mbr, m->u.mbru, m->sp,
-	  m->lv, m->cpp, m->tos, m->opc, m->h);
+  mic1_printf (m, "  MAR=%d MDR=%d PC=%d MBR=%d MBRU=%d SP=%d "
+	       "LV=%d CPP=%d TOS=%d OPC=%d H=%d\n\n",
+	       m->mar, m->mdr, m->pc, m->u.mbr, m->u.mbru, m->sp,
+	       m->lv, m->cpp, m->tos, m->opc, m->h);
 }
 
 void
@@ -110,10 +138,13 @@ mic1_print_instruction (Mic1 *m)
   /* Note: m->mir isn't valid here, since we print this before the cycle */
 
   if (mic1_word_get_bit (m->control_store[m->mpc], MIC1_WORD_JMPC_BIT)) {
-    ijvm_print_snapshot (m->byte_store + m->pc);
+    if (m->sink != NULL)
+      ijvm_sink_insn (m->sink, m->pc, m->byte_store + m->pc);
+    else
+      ijvm_print_snapshot (mic1_spec, m->byte_store + m->pc);
     if (mic1_is_breakpoint (m->byte_store[m->pc])) {
       mic1_microtrace = TRUE;
-      printf ("\n\n");
+      mic1_printf (m, "\n\n");
       mic1_print_registers (m);
     }
     else
@@ -122,7 +153,7 @@ mic1_print_instruction (Mic1 *m)
 
   if (mic1_microtrace) {
     mic1_word_disassemble (m->control_store[m->mpc], buf);
-    printf ("0x%03x:  %s\n\n", m->mpc, buf);
+    mic1_printf (m, "0x%03x:  %s\n\n", m->mpc, buf);
   }
 }
 
@@ -327,17 +358,11 @@ mic1_cycle (Mic1 *m)
    */
 
   if (m->doing_rd) {
-    if (0 <= m->mar && m->mar < IJVM_MEMORY_SIZE / 4)
-      m->mdr = m->word_store[m->mar];
-    else
-      m->mdr = 0;
+    m->mdr = m->word_store[m->mar];
     m->doing_rd = FALSE;
   }
   if (m->doing_fetch) {
-    if (0 <= m->mar && m->mar < IJVM_MEMORY_SIZE)
-      m->u.mbru = m->byte_store[m->pc];
-    else
-      m->u.mbru = 0;
+    m->u.mbru = m->byte_store[m->pc];
     m->doing_fetch = FALSE;
   }
   mic1_write_c_bus (m, res);
@@ -348,8 +373,7 @@ mic1_cycle (Mic1 *m)
   /* Initiate memory operations, if any, now that MAR and PC has been
    * loaded. */
 
-  if (mic1_word_get_bit (m->mir, MIC1_WORD_WRITE_BIT) && 
-      0 <= m->mar && m->mar < IJVM_MEMORY_SIZE / 4)
+  if (mic1_word_get_bit (m->mir, MIC1_WORD_WRITE_BIT))
     m->word_store[m->mar] = m->mdr;
 
   if (mic1_word_get_bit (m->mir, MIC1_WORD_READ_BIT))
@@ -379,11 +403,28 @@ mic1_cycle (Mic1 *m)
   m->mpc = address;
 }
 
+/* Report a read, write or fetch outside the memory.  Memory accesses
+ * aren't range checked; the guard areas around the memory catch them,
+ * see ijvm-memory.c. */
+
+static void
+mic1_fault (void *data, long address, void *context)
+{
+  Mic1 *m = data;
+
+  if (m->sink != NULL)
+    ijvm_sink_flush (m->sink);
+  fflush (stdout);
+  fprintf (stderr, "Memory fault at address %ld (MPC = 0x%03x, PC = %d, "
+	   "SP = %d, MAR = %d)\n", address, m->mpc, m->pc, m->sp, m->mar);
+  exit (-1);
+}
+
 /* Construct a Mic1 simulator from a Mic1 image and a IJVM image. */
 
 Mic1 *
 mic1_new (Mic1Image *mic1_image, IJVMImage *ijvm_image,
-	  int argc, char *argv[])
+	  unsigned long memory_size, int argc, char *argv[])
 {
   Mic1 *m;
   int i;
@@ -391,9 +432,14 @@ mic1_new (Mic1Image *mic1_image, IJVMImage *ijvm_image,
 
   m = malloc (sizeof (Mic1));
   memset (m, 0, sizeof (Mic1));
-  m->byte_store = malloc (IJVM_MEMORY_SIZE);
+  m->memory_size = memory_size;
+  m->byte_store = ijvm_memory_new (memory_size);
+  if (m->byte_store == NULL) {
+    fprintf (stderr, "Couldn't allocate %lu bytes of memory\n", memory_size);
+    exit (-1);
+  }
   m->word_store = (int32 *) m->byte_store;
-  memset (m->byte_store, 0, IJVM_MEMORY_SIZE);
+  ijvm_memory_set_fault (m->byte_store, mic1_fault, m);
 
   if (ijvm_image != NULL) {
     m->h = ijvm_image->main_index;
@@ -436,14 +482,18 @@ main (int argc, char *argv[])
   Mic1Image *mic1_image;
   IJVMImage *ijvm_image;
   Mic1 *m;
+  IJVMSink *sink;
   bool verbose, step;
+  unsigned long memory_size;
   char *time_string;
   time_t t;
 
-  ijvm_print_init (&argc, argv);
+  mic1_spec = ijvm_print_init (&argc, argv);
 
   verbose = TRUE;
   step = FALSE;
+  sink = NULL;
+  memory_size = IJVM_MEMORY_SIZE;
 
   while (argc > 1) {
 
@@ -477,6 +527,41 @@ main (int argc, char *argv[])
       continue;
     }
 
+    if (strcmp (argv[1], "-T") == 0) {
+      if (argc > 2) {
+	ijvm_file = fopen (argv[2], "wb");
+	if (ijvm_file == NULL) {
+	  fprintf (stderr, "Couldn't open `%s' for writing.\n", argv[2]);
+	  exit (-1);
+	}
+	sink = ijvm_sink_new (ijvm_file, mic1_spec);
+      }
+      else {
+	fprintf (stderr, "Option -T requires an argument\n");
+	exit (-1);
+      }
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
+    if (strcmp (argv[1], "-m") == 0 || strcmp (argv[1], "--memory") == 0) {
+      if (argc > 2) {
+	memory_size = ijvm_memory_parse_size (argv[2]);
+	if (memory_size == 0) {
+	  fprintf (stderr, "Invalid memory size: `%s'\n", argv[2]);
+	  exit (-1);
+	}
+      }
+      else {
+	fprintf (stderr, "Option %s requires an argument\n", argv[1]);
+	exit (-1);
+      }
+      argv = argv + 2;
+      argc = argc - 2;
+      continue;
+    }
+
     if (strcmp (argv[1], "-f") == 0) {
       argv = argv + 2;
       argc = argc - 2;
@@ -486,7 +571,7 @@ main (int argc, char *argv[])
     if (strcmp (argv[1], "-v") == 0) {
       printf ("mic1 version " VERSION " compiled " 
 	      COMPILE_DATE " on " COMPILE_HOST "\n");
-      printf ("Default specification file is " IJVM_DATADIR "/ijvm.spec\n");
+      printf ("The default specification is built in; -f SPEC-FILE reads another\n");
       exit (0);
     }    
     break;
@@ -496,8 +581,13 @@ main (int argc, char *argv[])
     fprintf (stderr, "Usage: mic1 [OPTION] MIC1-FILENAME [IJVM-FILENAME PARAMETERS ...]\n\n");
     fprintf (stderr, "Where OPTION is\n\n");
     fprintf (stderr, "  -s            Silent mode.  No snapshot is produced.\n");
-    fprintf (stderr, "  -f SPEC-FILE  The IJVM specification file to use.\n");
+    fprintf (stderr, "  -f SPEC-FILE  The IJVM specification file to use, instead of the\n");
+    fprintf (stderr, "                one built in.\n");
     fprintf (stderr, "  -t            Singlestep through microtrace.\n");
+    fprintf (stderr, "  -T FILE       Write a binary trace to FILE; see ijvm-trace.\n");
+    fprintf (stderr, "  -m, --memory SIZE\n");
+    fprintf (stderr, "                Size of the memory, in bytes or with a K, M or G\n");
+    fprintf (stderr, "                suffix, up to 4G.  The default is 640K.\n");
     fprintf (stderr, "  -v            Display version and build info.\n");
     fprintf (stderr, "  -b INSN       Show microtrace for the IJVM instruction INSN.\n\n");
     fprintf (stderr, "If you pass `-' as the Mic1 filename, the simulator will read the bytecode\nfile from stdin.\n\n");
@@ -531,20 +621,27 @@ main (int argc, char *argv[])
     }
     ijvm_image = ijvm_image_load (ijvm_file);
     fclose (ijvm_file);
-    m = mic1_new (mic1_image, ijvm_image, argc - 3, argv + 3);
+    m = mic1_new (mic1_image, ijvm_image, memory_size, argc - 3, argv + 3);
   }
   else {
-    m = mic1_new (mic1_image, NULL, 0, NULL);
+    m = mic1_new (mic1_image, NULL, memory_size, 0, NULL);
     mic1_default_microtrace = TRUE;
   }
 
+  /* A binary trace records what the text trace would print. */
+  if (sink != NULL) {
+    verbose = TRUE;
+    m->sink = sink;
+  }
+
   if (verbose) {
     t = time (NULL);
     time_string = ctime (&t);
     if (argv[2] != NULL)
-      printf ("Mic1 Trace of %s with %s %s\n", argv[1], argv[2], time_string);
+      mic1_printf (m, "Mic1 Trace of %s with %s %s\n",
+		   argv[1], argv[2], time_string);
     else
-      printf ("Mic1 Trace of %s %s\n", argv[1], time_string);
+      mic1_printf (m, "Mic1 Trace of %s %s\n", argv[1], time_string);
   }
 
   mic1_microtrace = mic1_default_microtrace;
@@ -571,5 +668,9 @@ main (int argc, char *argv[])
   }
 
   printf ("return value: %d\n", m->tos);
+  if (sink != NULL) {
+    ijvm_sink_printf (sink, "return value: %d\n", m->tos);
+    ijvm_sink_close (sink);
+  }
   return 0;
 }
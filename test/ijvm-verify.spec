@@ -0,0 +1,23 @@
+0x10 bipush byte
+0x59 dup
+0xA7 goto label
+0x60 iadd
+0x7E iand
+0x99 ifeq label
+0x9B iflt label
+0x9F if_icmpeq label
+0x84 iinc varnum, byte
+0x15 iload varnum-wide
+0xB6 invokevirtual method
+0x80 ior
+0xAC ireturn
+0x36 istore varnum-wide
+0x64 isub
+0x13 ldc_w constant
+0x00 nop
+0x57 pop
+0x5F swap
+0xC4 wide
+
+0xA7 goto_offset byte, byte
+0x13 ldc_w_index byte, byte
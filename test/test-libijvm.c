@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libijvm.h"
+
+/* test-libijvm.c
+ *
+ * Runs programs through libijvm, for test-libijvm in Makefile.am:
+ * test-min.bc, test-tail.bc and test-getchar.bc, given in that order
+ * on the command line.  They are stepped by a round robin scheduler
+ * a few instructions at a time, and must stop in the order of their
+ * lengths, with the results, output and instruction counts of a run
+ * of their own.  A run with a limit stops after exactly that many
+ * instructions.  Prints what went wrong and exits with 1 if anything
+ * did. */
+
+#define QUANTUM 7
+#define LIMIT   100
+#define MEMORY  (64 << 10)
+
+static int failures;
+
+static void
+check (int ok, const char *what)
+{
+  if (!ok) {
+    printf ("test-libijvm: %s\n", what);
+    failures++;
+  }
+}
+
+static IJVMImage *
+read_image (char *filename)
+{
+  IJVMImage *image;
+  FILE *file;
+
+  file = fopen (filename, "r");
+  if (file == NULL || (image = ijvm_image_read (file)) == NULL) {
+    printf ("test-libijvm: couldn't read `%s'\n", filename);
+    exit (1);
+  }
+  fclose (file);
+
+  return image;
+}
+
+static IJVM *
+create (IJVMImage *image, int nargs, int *args)
+{
+  IJVM *i;
+  char error[256];
+
+  i = ijvm_create (image, MEMORY, nargs, args, error, sizeof (error));
+  if (i == NULL) {
+    printf ("test-libijvm: ijvm_create: %s\n", error);
+    exit (1);
+  }
+
+  return i;
+}
+
+/* The number of instructions i runs by itself. */
+
+static unsigned long
+run_alone (IJVMImage *image, int nargs, int *args, const char *input)
+{
+  IJVM *i;
+  unsigned long n;
+
+  i = create (image, nargs, args);
+  if (input != NULL)
+    ijvm_set_input (i, (const unsigned char *) input, strlen (input));
+  check (ijvm_run (i, 0) == IJVM_STATUS_DONE, "a run of its own failed");
+  n = ijvm_get_instructions (i);
+  ijvm_destroy (i);
+
+  return n;
+}
+
+int
+main (int argc, char *argv[])
+{
+  IJVMImage *min, *tail, *getchar_image;
+  IJVMScheduler *scheduler;
+  IJVM *i, *ijvms[3];
+  IJVMStatus status;
+  unsigned long counts[3];
+  const unsigned char *output;
+  int min_args[2] = { 5, 7 }, tail_args[1] = { 1000 };
+  char error[256];
+  int length, k;
+
+  if (argc != 4) {
+    printf ("Usage: test-libijvm TEST-MIN TEST-TAIL TEST-GETCHAR\n");
+    return 1;
+  }
+  min = read_image (argv[1]);
+  tail = read_image (argv[2]);
+  getchar_image = read_image (argv[3]);
+
+  /* A failed ijvm_create says why. */
+  error[0] = '\0';
+  check (ijvm_create (min, MEMORY, 1, min_args, error, sizeof (error)) ==
+	 NULL, "ijvm_create took the wrong number of arguments");
+  check (strcmp (error, "Incorrect number of arguments") == 0,
+	 "ijvm_create didn't say why it failed");
+
+  counts[0] = run_alone (min, 2, min_args, NULL);
+  counts[1] = run_alone (tail, 1, tail_args, NULL);
+  counts[2] = run_alone (getchar_image, 0, NULL, "x");
+  check (counts[0] < counts[2] && counts[2] < counts[1],
+	 "the programs don't have the lengths expected");
+
+  ijvms[0] = create (min, 2, min_args);
+  ijvms[1] = create (tail, 1, tail_args);
+  ijvms[2] = create (getchar_image, 0, NULL);
+  ijvm_set_input (ijvms[2], (const unsigned char *) "x", 1);
+
+  scheduler = ijvm_scheduler_new (QUANTUM);
+  for (k = 0; k < 3; k++)
+    ijvm_scheduler_add (scheduler, ijvms[k]);
+
+  /* Each stops in the turn that takes it to the end, and the others
+   * have had all the turns before it. */
+  i = ijvm_scheduler_run (scheduler, &status);
+  check (i == ijvms[0] && status == IJVM_STATUS_DONE,
+	 "test-min didn't stop first");
+  check (ijvm_get_result (ijvms[0]) == 5, "test-min returned the wrong value");
+  check (ijvm_get_instructions (ijvms[1]) ==
+	 ((counts[0] + QUANTUM - 1) / QUANTUM - 1) * QUANTUM,
+	 "test-tail didn't get a turn for each of test-min");
+  check (ijvm_scheduler_count (scheduler) == 2,
+	 "test-min is still scheduled");
+
+  i = ijvm_scheduler_run (scheduler, &status);
+  check (i == ijvms[2] && status == IJVM_STATUS_DONE,
+	 "test-getchar didn't stop second");
+  output = ijvm_get_output (ijvms[2], &length);
+  check (length == 1 && output[0] == 'X', "test-getchar printed wrong");
+
+  i = ijvm_scheduler_run (scheduler, &status);
+  check (i == ijvms[1] && status == IJVM_STATUS_DONE,
+	 "test-tail didn't stop last");
+  check (ijvm_get_result (ijvms[1]) == 500500,
+	 "test-tail returned the wrong value");
+  for (k = 0; k < 3; k++)
+    check (ijvm_get_instructions (ijvms[k]) == counts[k],
+	   "a scheduled run took a different number of instructions");
+
+  check (ijvm_scheduler_run (scheduler, &status) == NULL,
+	 "the scheduler isn't empty");
+  ijvm_scheduler_free (scheduler);
+
+  /* The limit holds across runs of any number of steps. */
+  i = create (tail, 1, tail_args);
+  ijvm_set_limit (i, LIMIT);
+  check (ijvm_run (i, QUANTUM) == IJVM_STATUS_RUNNING &&
+	 ijvm_run (i, 0) == IJVM_STATUS_LIMIT &&
+	 ijvm_get_instructions (i) == LIMIT &&
+	 ijvm_run (i, 1) == IJVM_STATUS_LIMIT &&
+	 ijvm_get_instructions (i) == LIMIT,
+	 "a run didn't stop at its limit");
+  ijvm_destroy (i);
+
+  for (k = 0; k < 3; k++)
+    ijvm_destroy (ijvms[k]);
+  ijvm_image_free (min);
+  ijvm_image_free (tail);
+  ijvm_image_free (getchar_image);
+
+  return failures > 0;
+}